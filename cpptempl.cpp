@@ -31,8 +31,24 @@
 #include <stack>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/utility/string_view.hpp>
 #include <cassert>
+#include <chrono>
+#include <iomanip>
 #include <cstdlib>
+#include <cerrno>
+
+#if _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// Vectorized tag scanning is available with GCC-compatible compilers on x86.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define CPPTEMPL_X86_SIMD 1
+#include <immintrin.h>
+#endif
 
 namespace cpptempl
 {
@@ -80,43 +96,86 @@ enum TokenType
 };
 
 // Represents a token in a control statement.
+//
+// The value normally references the statement text directly. Only string literals
+// containing escape sequences own a copy of their value.
 class Token
 {
     TokenType m_type;
-    std::string m_value;
+    boost::string_view m_value;
+    std::string m_storage;
+    bool m_is_owned;
 
 public:
     Token(TokenType tokenType)
     : m_type(tokenType)
     , m_value()
+    , m_storage()
+    , m_is_owned(false)
     {
     }
-    Token(TokenType tokenType, const std::string &value)
+    Token(TokenType tokenType, boost::string_view value)
     : m_type(tokenType)
     , m_value(value)
+    , m_storage()
+    , m_is_owned(false)
+    {
+    }
+    Token(TokenType tokenType, std::string &&value)
+    : m_type(tokenType)
+    , m_value()
+    , m_storage(std::move(value))
+    , m_is_owned(true)
     {
+        m_value = m_storage;
     }
     Token(const Token &other)
     : m_type(other.m_type)
     , m_value(other.m_value)
+    , m_storage(other.m_storage)
+    , m_is_owned(other.m_is_owned)
     {
+        rebind();
     }
     Token(Token &&other)
     : m_type(other.m_type)
-    , m_value(std::move(other.m_value))
+    , m_value(other.m_value)
+    , m_storage(std::move(other.m_storage))
+    , m_is_owned(other.m_is_owned)
+    {
+        rebind();
+    }
+    Token &operator=(const Token &other)
     {
+        m_type = other.m_type;
+        m_value = other.m_value;
+        m_storage = other.m_storage;
+        m_is_owned = other.m_is_owned;
+        rebind();
+        return *this;
     }
-    Token &operator=(const Token &other) = default;
     Token &operator=(Token &&other)
     {
         m_type = other.m_type;
-        m_value.assign(std::move(other.m_value));
+        m_value = other.m_value;
+        m_storage.assign(std::move(other.m_storage));
+        m_is_owned = other.m_is_owned;
+        rebind();
         return *this;
     }
     ~Token() = default;
 
     TokenType get_type() const { return m_type; }
-    const std::string &get_value() const { return m_value; }
+    boost::string_view get_value() const { return m_value; }
+
+private:
+    void rebind()
+    {
+        if (m_is_owned)
+        {
+            m_value = m_storage;
+        }
+    }
 };
 
 typedef std::vector<Token> token_vector;
@@ -153,27 +212,315 @@ public:
     const Token &operator*() const { return *get(); }
 };
 
+// Monotonic allocator for temporaries that live no longer than one render, such as
+// call arguments and loop state. Memory comes from blocks that are kept until the arena
+// is destroyed. An ArenaScope gives back everything allocated during its lifetime, so
+// once the blocks have grown to fit a render's temporaries they cost no heap allocation.
+class Arena
+{
+public:
+    struct Mark
+    {
+        size_t block;
+        size_t used;
+    };
+
+    Arena()
+    : m_blocks()
+    , m_block(0)
+    , m_used(0)
+    {
+    }
+
+    //! Never returns nullptr, even for a size of 0.
+    void *allocate(size_t size);
+    //! Only the most recent allocation is reclaimed; others wait for their scope to end.
+    void deallocate(void *p, size_t size);
+
+    Mark mark() const { return Mark{ m_block, m_used }; }
+    void rewind(const Mark &mark)
+    {
+        m_block = mark.block;
+        m_used = mark.used;
+    }
+    size_t capacity() const;
+
+private:
+    struct Block
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    static const size_t k_alignment = 16;
+    static const size_t k_first_block = 4096;
+
+    static size_t aligned(size_t size) { return (std::max<size_t>(size, 1) + k_alignment - 1) & ~(k_alignment - 1); }
+
+    std::vector<Block> m_blocks;
+    size_t m_block; //!< Block currently being allocated from.
+    size_t m_used;  //!< Bytes used in that block.
+};
+
+// Rewinds the arena to where it was on construction.
+class ArenaScope
+{
+    Arena &m_arena;
+    Arena::Mark m_mark;
+
+public:
+    explicit ArenaScope(Arena &arena)
+    : m_arena(arena)
+    , m_mark(arena.mark())
+    {
+    }
+    ~ArenaScope() { m_arena.rewind(m_mark); }
+};
+
+// Standard allocator for containers of render temporaries.
+template <typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    explicit ArenaAllocator(Arena &arena)
+    : m_arena(&arena)
+    {
+    }
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other)
+    : m_arena(other.arena())
+    {
+    }
+
+    T *allocate(size_t count) { return static_cast<T *>(m_arena->allocate(count * sizeof(T))); }
+    void deallocate(T *p, size_t count) { m_arena->deallocate(p, count * sizeof(T)); }
+    Arena *arena() const { return m_arena; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &other) const { return m_arena == other.arena(); }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &other) const { return m_arena != other.arena(); }
+
+private:
+    Arena *m_arena;
+};
+
+// Values held for the duration of a call, such as its arguments.
+typedef std::vector<data_ptr, ArenaAllocator<data_ptr> > temp_list;
+
+// State of a single render, passed down through node and expression evaluation
+// (including into subtemplates) instead of being kept in globals. A template can
+// therefore be rendered on several threads at once, each with its own context and
+// data_map.
+struct RenderContext
+{
+    bool remove_newline; //!< Drop the newline starting the next text output.
+    size_t output_size;  //!< Number of characters written so far.
+    Profiler *profiler;  //!< Records per-node statistics if set.
+    LookupStats lookups; //!< Key path lookup cache counts, added to lookup_stats() at the end.
+    Arena arena;         //!< Temporaries of this render. Nothing in it is reachable from data.
+    ThreadPool *pool;    //!< Renders loops of at least parallel_min_items items if set.
+    size_t parallel_min_items;
+    bool parallel_chunk; //!< Rendering part of a parallel loop, which must not call subtemplates.
+    bool copy_shared;    //!< Assignments copy maps held elsewhere rather than modify them.
+
+    RenderContext()
+    : remove_newline(false)
+    , output_size(0)
+    , profiler(nullptr)
+    , lookups()
+    , arena()
+    , pool(nullptr)
+    , parallel_min_items(0)
+    , parallel_chunk(false)
+    , copy_shared(false)
+    {
+    }
+    ~RenderContext();
+};
+
+// Thrown when a chunk of a parallel loop is about to call a subtemplate. Subtemplates may
+// assign to the data, so the loop is rendered serially instead.
+struct SubtemplateInParallelLoop
+{
+};
+
+// Records a profiler frame for its lifetime if the render is being profiled.
+class ProfileScope
+{
+    RenderContext &m_context;
+
+public:
+    ProfileScope(RenderContext &context, const void *key, const char *kind, uint32_t line, const char *name = nullptr)
+    : m_context(context)
+    {
+        if (m_context.profiler)
+        {
+            m_context.profiler->enter(key, kind, line, name, m_context.output_size);
+        }
+    }
+    ~ProfileScope()
+    {
+        if (m_context.profiler)
+        {
+            m_context.profiler->leave(m_context.output_size);
+        }
+    }
+};
+
+// Expression tree classes
+// base class for all expression types
+class Expr
+{
+public:
+    virtual ~Expr() = default;
+    virtual data_ptr eval(data_map &data, RenderContext &context) = 0;
+
+    // Writes the value to the output, returning false if it was empty. Expressions in
+    // output position use this so that subtemplates can render straight into the sink.
+    virtual bool write(OutputSink &sink, data_map &data, RenderContext &context);
+
+    // Evaluates on its own, outside of any render.
+    data_ptr eval(data_map &data)
+    {
+        RenderContext context;
+        return eval(data, context);
+    }
+};
+
+typedef std::unique_ptr<Expr> expr_ptr;
+typedef std::vector<expr_ptr> expr_vector;
+
+// literal value
+class ExprLiteral : public Expr
+{
+    data_ptr m_value;
+
+public:
+    ExprLiteral(const data_ptr &value)
+    : m_value(value)
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+};
+
+// key path lookup, which may be a subtemplate invocation
+class ExprKeyPath : public Expr
+{
+    KeyPath m_path;
+    expr_vector m_args;
+
+public:
+    ExprKeyPath(const std::string &path, expr_vector &&args)
+    : m_path(path)
+    , m_args(std::move(args))
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+    bool write(OutputSink &sink, data_map &data, RenderContext &context);
+};
+
+// Built-in pseudo functions.
+enum FunctionType
+{
+    COUNT_FN,
+    EMPTY_FN,
+    DEFINED_FN,
+    ADD_INDENT_FN,
+    INT_FN,
+    STR_FN,
+    UPPER_FN,
+    LOWER_FN,
+};
+
+// built-in function call
+class ExprFunction : public Expr
+{
+    FunctionType m_fn;
+    expr_vector m_args;
+
+public:
+    ExprFunction(FunctionType fn, expr_vector &&args)
+    : m_fn(fn)
+    , m_args(std::move(args))
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+};
+
+// "not" and unary "-"
+class ExprUnary : public Expr
+{
+    TokenType m_op;
+    expr_ptr m_expr;
+
+public:
+    ExprUnary(TokenType op, expr_ptr &&expr)
+    : m_op(op)
+    , m_expr(std::move(expr))
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+};
+
+// comparison, arithmetic, concatenation, "and" and "or"
+class ExprBinary : public Expr
+{
+    TokenType m_op;
+    expr_ptr m_left;
+    expr_ptr m_right;
+
+public:
+    ExprBinary(TokenType op, expr_ptr &&left, expr_ptr &&right)
+    : m_op(op)
+    , m_left(std::move(left))
+    , m_right(std::move(right))
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+    bool write(OutputSink &sink, data_map &data, RenderContext &context);
+};
+
+// inline "x if p else y"
+class ExprInlineIf : public Expr
+{
+    expr_ptr m_value;
+    expr_ptr m_predicate;
+    expr_ptr m_else;
+
+public:
+    ExprInlineIf(expr_ptr &&value, expr_ptr &&predicate, expr_ptr &&elseValue)
+    : m_value(std::move(value))
+    , m_predicate(std::move(predicate))
+    , m_else(std::move(elseValue))
+    {
+    }
+    data_ptr eval(data_map &data, RenderContext &context);
+    bool write(OutputSink &sink, data_map &data, RenderContext &context);
+};
+
+// Builds an expression tree from a statement's tokens.
 class ExprParser
 {
     TokenIterator &m_tok;
-    data_map &m_data;
 
 public:
-    ExprParser(TokenIterator &seq, data_map &data)
+    ExprParser(TokenIterator &seq)
     : m_tok(seq)
-    , m_data(data)
     {
     }
 
-    data_ptr parse_expr();
-    data_ptr parse_oterm();
-    data_ptr parse_bterm();
-    data_ptr parse_bfactor();
-    data_ptr parse_gfactor();
-    data_ptr parse_afactor();
-    data_ptr parse_mfactor();
-    data_ptr parse_factor();
-    data_ptr get_var_value(const std::string &path, data_list &params);
+    expr_ptr parse_expr();
+    expr_ptr parse_oterm();
+    expr_ptr parse_bterm();
+    expr_ptr parse_bfactor();
+    expr_ptr parse_gfactor();
+    expr_ptr parse_afactor();
+    expr_ptr parse_mfactor();
+    expr_ptr parse_factor();
+    expr_ptr parse_key_path(const std::string &path);
 };
 
 typedef enum
@@ -201,11 +548,19 @@ public:
     {
     }
     virtual NodeType gettype() = 0;
-    virtual void gettext(std::ostream &stream, data_map &data) = 0;
+    virtual void gettext(OutputSink &sink, data_map &data, RenderContext &context) = 0;
     virtual void set_children(node_vector &children);
     virtual node_vector &get_children();
     uint32_t get_line() { return m_line; }
     void set_line(uint32_t line) { m_line = line; }
+
+    // Renders on its own, outside of any template.
+    void gettext(std::ostream &stream, data_map &data)
+    {
+        StreamSink sink(stream);
+        RenderContext context;
+        gettext(sink, data, context);
+    }
 };
 
 // node with children
@@ -223,58 +578,98 @@ public:
     node_vector &get_children();
 };
 
-// normal text
+// Immutable template text shared by the parser and text nodes.
+typedef std::shared_ptr<const std::string> source_ptr;
+
+// normal text, referencing the template source
 class NodeText : public Node
 {
-    std::string m_text;
+    source_ptr m_source;
+    boost::string_view m_text;
 
 public:
-    NodeText(std::string text, uint32_t line = 0)
+    NodeText(const std::string &text, uint32_t line = 0)
+    : Node(line)
+    , m_source(std::make_shared<const std::string>(text))
+    , m_text(*m_source)
+    {
+    }
+    NodeText(const source_ptr &source, boost::string_view text, uint32_t line = 0)
     : Node(line)
+    , m_source(source)
     , m_text(text)
     {
     }
     NodeType gettype();
-    void gettext(std::ostream &stream, data_map &data);
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
 };
 
 // variable
 class NodeVar : public Node
 {
-    token_vector m_expr;
+    expr_ptr m_expr;
     bool m_removeNewLine;
 
 public:
-    NodeVar(const token_vector &expr, uint32_t line = 0, bool removeNewLine = false)
-    : Node(line)
-    , m_expr(expr)
-    , m_removeNewLine(removeNewLine)
+    NodeVar(const token_vector &expr, uint32_t line = 0, bool removeNewLine = false);
+    NodeType gettype();
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
+};
+
+// State of a for loop while it is executing.
+struct LoopState
+{
+    data_ptr saved_loop;
+    data_ptr value;
+    const data_ptr *items; //!< Items of the list held by value.
+    uint32_t *filtered;    //!< Numbers of the items passing the filter, in the render arena.
+    size_t count;          //!< Number of items to visit.
+    size_t index;
+    data_ptr *loop_slot;  //!< Entry for "loop" in the data map, looked up once per loop.
+    data_ptr *item_slot;  //!< Entry for the loop variable in the data map.
+    Arena::Mark arena_mark; //!< Arena position before the loop, restored by end_loop().
+
+    LoopState()
+    : saved_loop()
+    , value()
+    , items(nullptr)
+    , filtered(nullptr)
+    , count(0)
+    , index(0)
+    , loop_slot(nullptr)
+    , item_slot(nullptr)
+    , arena_mark()
     {
     }
-    NodeType gettype();
-    void gettext(std::ostream &stream, data_map &data);
+
+    const data_ptr &item() const { return item(index); }
+    const data_ptr &item(size_t i) const { return items[filtered ? filtered[i] : i]; }
 };
 
 // for block
 class NodeFor : public NodeParent
 {
-    std::string m_key;
+    KeyPath m_key;
     std::string m_val;
     bool m_is_top;
-    bool m_has_predicate;
-    token_vector m_predicate_tokens;
+    expr_ptr m_predicate;
+    std::atomic<bool> m_calls_subtemplate; //!< A parallel render found the body calling one.
 
 public:
     NodeFor(const token_vector &tokens, bool is_top, uint32_t line = 0);
     NodeType gettype();
-    void gettext(std::ostream &stream, data_map &data);
-    data_map build_loop_map(size_t i, size_t count);
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
+
+    bool begin_loop(data_map &data, LoopState &state, RenderContext &context);
+    bool render_parallel(OutputSink &sink, data_map &data, LoopState &state, RenderContext &context);
+    bool next_iteration(data_map &data, LoopState &state);
+    void end_loop(data_map &data, LoopState &state, RenderContext &context);
 };
 
 // if block
 class NodeIf : public NodeParent
 {
-    token_vector m_expr;
+    expr_ptr m_expr;
     node_ptr m_else_if;
     NodeType m_if_type;
 
@@ -282,36 +677,75 @@ public:
     NodeIf(const token_vector &expr, uint32_t line = 0);
     NodeType gettype();
     void set_else_if(node_ptr else_if);
-    void gettext(std::ostream &stream, data_map &data);
-    bool is_true(data_map &data);
+    node_ptr get_else_if() { return m_else_if; }
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
+    bool is_true(data_map &data, RenderContext &context);
     bool is_else();
 };
 
 // def block
 class NodeDef : public NodeParent
 {
-    std::string m_name;
+    KeyPath m_name;
     string_vector m_params;
+    std::shared_ptr<const std::vector<SymbolRef> > m_param_symbols;
 
 public:
     NodeDef(const token_vector &expr, uint32_t line = 0);
     NodeType gettype();
-    void gettext(std::ostream &stream, data_map &data);
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
+    void define(data_map &data, const program_ptr &program, const RenderContext &context);
 };
 
 // set variable
 class NodeSet : public Node
 {
-    token_vector m_expr;
+    KeyPath m_path;
+    expr_ptr m_expr;
 
 public:
-    NodeSet(const token_vector &expr, uint32_t line = 0)
-    : Node(line)
-    , m_expr(expr)
-    {
-    }
+    NodeSet(const token_vector &expr, uint32_t line = 0);
     NodeType gettype();
-    void gettext(std::ostream &stream, data_map &data);
+    void gettext(OutputSink &sink, data_map &data, RenderContext &context);
+};
+
+// Opcodes for compiled template programs.
+enum OpCode
+{
+    TEXT_OP,          //!< Output a NodeText.
+    VAR_OP,           //!< Output a NodeVar.
+    SET_OP,           //!< Execute a NodeSet.
+    DEF_OP,           //!< Execute a NodeDef; arg is the index of the body's program.
+    JUMP_IF_FALSE_OP, //!< Test an if/elif NodeIf; arg is the jump target if false.
+    JUMP_OP,          //!< Unconditional jump; arg is the target.
+    FOR_BEGIN_OP,     //!< Start a NodeFor loop; arg is the target following the loop.
+    FOR_NEXT_OP,      //!< Advance the innermost loop; arg is the start of the loop body.
+};
+
+struct Instruction
+{
+    OpCode op;
+    uint32_t arg;
+    Node *node;
+};
+
+// A template node tree flattened into a linear instruction stream.
+class Program
+{
+    std::vector<Instruction> m_code;
+    std::vector<program_ptr> m_defs;
+    uint32_t m_loop_depth; //!< Deepest nesting of for loops.
+
+public:
+    Program(const node_vector &tree);
+
+    void run(OutputSink &sink, data_map &data, RenderContext &context);
+    const std::vector<Instruction> &code() const { return m_code; }
+
+private:
+    void compile(const node_vector &nodes);
+    void compile_if(NodeIf *node);
+    uint32_t emit(OpCode op, Node *node, uint32_t arg = 0);
 };
 
 // Lexer states for statement tokenizer.
@@ -332,7 +766,8 @@ struct KeywordDef
 
 class TemplateParser
 {
-    std::string m_text;
+    source_ptr m_source;        //!< Shared copy of the template text referenced by text nodes.
+    boost::string_view m_text;  //!< Unparsed remainder of m_source.
     node_vector &m_top_nodes;
     uint32_t m_current_line;
     std::stack<std::pair<node_ptr, TokenType> > m_node_stack;
@@ -358,11 +793,35 @@ private:
 
 std::string indent(int level);
 inline bool is_key_path_char(char c);
-TokenType get_keyword_token(const std::string &s);
-void create_id_token(token_vector &tokens, const std::string &s);
+TokenType get_keyword_token(boost::string_view s);
+void create_id_token(token_vector &tokens, boost::string_view s);
 int append_string_escape(std::string &str, std::function<char(unsigned)> peek);
-token_vector tokenize_statement(const std::string &text);
-inline size_t count_newlines(const std::string &text);
+token_vector tokenize_statement(boost::string_view text);
+inline size_t count_newlines(boost::string_view text);
+bool write_value(OutputSink &sink, const data_ptr &value, RenderContext &context);
+const char *node_kind_name(NodeType type);
+void render_node(Node *node, OutputSink &sink, data_map &data, RenderContext &context);
+bool may_stop_on_key_error(const node_vector &nodes);
+#if __CYGWIN__ || _WIN32
+void normalize_eol(std::string &str);
+#endif
+
+//! @brief Finds the first tag opener ("{$", "{%" or "{#") in @a text.
+//!
+//! Returns the offset of the opening brace, or npos if there is no tag. The number of
+//! newlines preceding the tag (or in the whole text if there is none) is stored in
+//! @a newlines.
+typedef size_t (*tag_scanner_t)(boost::string_view text, uint32_t &newlines);
+
+struct TagScanner
+{
+    const char *name;
+    tag_scanner_t scan;
+};
+
+size_t find_tag_scalar(boost::string_view text, uint32_t &newlines);
+size_t find_tag(boost::string_view text, uint32_t &newlines);
+const TagScanner *get_tag_scanners();
 }
 
 // This allows inclusion of the cpptempl::impl declarations into the unit test
@@ -371,557 +830,2016 @@ inline size_t count_newlines(const std::string &text);
 }
 #else
 
-//! Flag to track whether to remove the next newline that appears in the output.
-//!
-//! @bug This global breaks reentrancy.
-static bool s_removeNewLine;
-
 //////////////////////////////////////////////////////////////////////////
 // Data classes
 //////////////////////////////////////////////////////////////////////////
 
 // These ctors are defined here to resolve definition ordering issues with clang.
+// Bools and ints are stored inline, so the passed object is released immediately.
 data_ptr::data_ptr(DataBool *data)
-: ptr(data)
 {
+    clear();
+    set_bool(data->getint() != 0);
+    delete data;
 }
 data_ptr::data_ptr(DataInt *data)
-: ptr(data)
 {
+    clear();
+    set_int(data->getint());
+    delete data;
 }
 data_ptr::data_ptr(DataValue *data)
-: ptr(data)
 {
+    clear();
+    adopt(data, VALUE);
 }
 data_ptr::data_ptr(DataList *data)
-: ptr(data)
 {
+    clear();
+    adopt(data, LIST);
 }
 data_ptr::data_ptr(DataMap *data)
-: ptr(data)
 {
+    clear();
+    adopt(data, MAP);
 }
 data_ptr::data_ptr(DataTemplate *data)
-: ptr(data)
 {
+    clear();
+    adopt(data, TEMPLATE);
 }
 
-// data_map
-data_ptr &data_map::operator[](const std::string &key)
+size_t hash_key(boost::string_view key)
 {
-    if (data.find(key) == data.end() && parent)
+    // FNV-1a, with the high bits folded in since the index uses the low bits.
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key)
     {
-        return (*parent)[key];
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
     }
-    return data[key];
-}
-bool data_map::empty()
-{
-    return data.empty();
+    return static_cast<size_t>(hash ^ (hash >> 32));
 }
-bool data_map::has(const std::string &key)
+
+// Totals of the RenderContext lookup counts.
+static std::atomic<size_t> s_lookup_hits(0);
+static std::atomic<size_t> s_lookup_misses(0);
+
+LookupStats lookup_stats()
 {
-    bool local_has = data.find(key) != data.end();
-    return !local_has && parent ? parent->has(key) : local_has;
+    LookupStats stats = { s_lookup_hits.load(), s_lookup_misses.load() };
+    return stats;
 }
 
-// data_ptr
-template <>
-void data_ptr::operator=(const bool &data)
+void reset_lookup_stats()
 {
-    ptr.reset(new DataBool(data));
+    s_lookup_hits = 0;
+    s_lookup_misses = 0;
 }
 
-template <>
-void data_ptr::operator=(const int &data)
+const size_t impl::Arena::k_alignment;
+const size_t impl::Arena::k_first_block;
+
+void *impl::Arena::allocate(size_t size)
 {
-    ptr.reset(new DataInt(data));
+    size = aligned(size);
+    while (m_block < m_blocks.size())
+    {
+        Block &block = m_blocks[m_block];
+        if (block.size - m_used >= size)
+        {
+            void *p = block.data.get() + m_used;
+            m_used += size;
+            return p;
+        }
+        if (m_block + 1 == m_blocks.size())
+        {
+            break;
+        }
+        ++m_block;
+        m_used = 0;
+    }
+
+    // Each new block is twice the size of the last, so a render needs few of them.
+    size_t block_size = std::max(size, m_blocks.empty() ? k_first_block : m_blocks.back().size * 2);
+    m_blocks.push_back(Block{ std::unique_ptr<char[]>(new char[block_size]), block_size });
+    m_block = m_blocks.size() - 1;
+    m_used = size;
+    return m_blocks.back().data.get();
 }
 
-template <>
-void data_ptr::operator=(const unsigned int &data)
+void impl::Arena::deallocate(void *p, size_t size)
 {
-    ptr.reset(new DataInt(data));
+    size = aligned(size);
+    if (m_block < m_blocks.size() && m_used >= size && static_cast<char *>(p) == m_blocks[m_block].data.get() + m_used - size)
+    {
+        m_used -= size;
+    }
 }
 
-template <>
-void data_ptr::operator=(const std::string &data)
+size_t impl::Arena::capacity() const
 {
-    ptr.reset(new DataValue(data));
+    size_t total = 0;
+    for (const Block &block : m_blocks)
+    {
+        total += block.size;
+    }
+    return total;
 }
 
-template <>
-void data_ptr::operator=(const data_map &data)
+impl::RenderContext::~RenderContext()
 {
-    ptr.reset(new DataMap(data));
+    if (lookups.hits || lookups.misses)
+    {
+        s_lookup_hits += lookups.hits;
+        s_lookup_misses += lookups.misses;
+    }
 }
 
-template <>
-void data_ptr::operator=(const data_list &data)
+//////////////////////////////////////////////////////////////////////////
+// SymbolTable
+//////////////////////////////////////////////////////////////////////////
+
+SymbolTable::SymbolTable()
+: m_index(nullptr)
+, m_current_index()
+, m_count(0)
+, m_allocated(0)
+, m_index_used(0)
+, m_readers(0)
+, m_removed()
+, m_old_indexes()
+, m_free()
+, m_mutex()
 {
-    ptr.reset(new DataList(data));
+    for (auto &block : m_blocks)
+    {
+        block.store(nullptr, std::memory_order_relaxed);
+    }
 }
 
-data_ptr &data_ptr::operator=(std::string &&data)
+SymbolTable::~SymbolTable()
 {
-    ptr.reset(new DataValue(std::move(data)));
-    return *this;
+    for (auto &block : m_blocks)
+    {
+        delete[] block.load(std::memory_order_relaxed);
+    }
 }
 
-data_ptr &data_ptr::operator=(data_map &&data)
+// Never destroyed, as maps in other static objects may release their keys at exit.
+SymbolTable &SymbolTable::global()
 {
-    ptr.reset(new DataMap(std::move(data)));
-    return *this;
+    static SymbolTable *s_table = new SymbolTable;
+    return *s_table;
 }
 
-data_ptr &data_ptr::operator=(data_list &&data)
+bool SymbolTable::find(boost::string_view name, symbol_t &symbol) const
 {
-    ptr.reset(new DataList(std::move(data)));
-    return *this;
+    return find(name, hash_key(name), symbol, false);
 }
 
-void data_ptr::push_back(const data_ptr &data)
+// With @a retain set, a reference is added to the symbol found. A symbol whose last
+// reference is being released isn't found, so that it isn't revived without the lock.
+bool SymbolTable::find(boost::string_view name, size_t hash, symbol_t &symbol, bool retain) const
 {
-    if (!ptr)
+    // Counting the lookup keeps the symbols and index it sees from being reused or freed.
+    // The count and the index are seq_cst so that reclaim() seeing no lookups running
+    // means any later lookup sees the symbols and indexes already removed.
+    m_readers.fetch_add(1, std::memory_order_seq_cst);
+    bool found = false;
+    const Index *index = m_index.load(std::memory_order_seq_cst);
+    for (size_t pos = index ? hash & index->mask : 0; index; pos = (pos + 1) & index->mask)
     {
-        ptr.reset(new DataList(data_list()));
+        uint32_t slot = index->slots[pos].load(std::memory_order_seq_cst);
+        if (!slot)
+        {
+            break;
+        }
+        if (slot == k_removed)
+        {
+            continue;
+        }
+        Symbol &candidate = symbol_at(slot - 1);
+        if (candidate.hash == hash && candidate.name.size() == name.size()
+            && !memcmp(candidate.name.data(), name.data(), name.size()))
+        {
+            uint32_t refs = candidate.refs.load(std::memory_order_relaxed);
+            while (retain && refs && !candidate.refs.compare_exchange_weak(refs, refs + 1, std::memory_order_relaxed))
+            {
+            }
+            found = !retain || refs;
+            symbol = slot - 1;
+            break;
+        }
     }
-    data_list &list = ptr->getlist();
-    list.push_back(data);
+    m_readers.fetch_sub(1, std::memory_order_release);
+    return found;
 }
 
-// base data
-std::string Data::getvalue()
+const std::string &SymbolTable::name(symbol_t symbol) const
 {
-    throw TemplateException("Data item is not a value");
+    return symbol_at(symbol).name;
 }
 
-data_list &Data::getlist()
-{
-    throw TemplateException("Data item is not a list");
-}
-data_map &Data::getmap()
-{
-    throw TemplateException("Data item is not a dictionary");
-}
-int Data::getint() const
+SymbolTable::symbol_t SymbolTable::intern(boost::string_view name)
 {
-    return 0;
+    size_t hash = hash_key(name);
+    symbol_t symbol;
+    if (find(name, hash, symbol, true))
+    {
+        return symbol;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (find(name, hash, symbol, false))
+    {
+        // Either new since the first look, or losing its last reference. In the latter
+        // case the releasing thread sees the new reference once it takes the lock.
+        symbol_at(symbol).refs.fetch_add(1, std::memory_order_relaxed);
+        return symbol;
+    }
+    return add(name, hash);
 }
-// data bool
-std::string DataBool::getvalue()
+
+// Stores a new symbol with one reference, reusing a removed symbol's number if one is
+// free. Expects m_mutex to be held.
+SymbolTable::symbol_t SymbolTable::add(boost::string_view name, size_t hash)
 {
-    return m_value ? "true" : "false";
-}
-bool DataBool::empty()
-{
-    return !m_value;
-}
-void DataBool::dump(int indent)
-{
-    std::cout << "(bool)" << getvalue() << std::endl;
-}
-int DataBool::getint() const
-{
-    return static_cast<int>(m_value);
+    reclaim();
+    symbol_t symbol;
+    if (!m_free.empty())
+    {
+        symbol = m_free.back();
+        m_free.pop_back();
+    }
+    else
+    {
+        // Allocate the symbol's block if needed.
+        symbol = m_allocated;
+        if (symbol == k_removed - 1)
+        {
+            throw TemplateException("too many data_map keys");
+        }
+        uint32_t block = symbol < 64 ? 0 : impl::highest_bit(symbol) - 5;
+        if (!m_blocks[block].load(std::memory_order_relaxed))
+        {
+            m_blocks[block].store(new Symbol[block == 0 ? 64 : (1u << (block + 5))], std::memory_order_release);
+        }
+        ++m_allocated;
+    }
+    Symbol &entry = symbol_at(symbol);
+    entry.name.assign(name.data(), name.size());
+    entry.hash = hash;
+    entry.refs.store(1, std::memory_order_relaxed);
+    entry.live = true;
+    uint32_t count = m_count.load(std::memory_order_relaxed) + 1;
+
+    // Publish it in the index. Once half the slots are used, including those of removed
+    // symbols, the index is replaced with one sized for the symbols left.
+    Index *index = m_current_index.get();
+    if (!index || (m_index_used + 1) * 2 > index->mask + 1)
+    {
+        size_t size = 256;
+        while (count * 4 > size)
+        {
+            size *= 2;
+        }
+        std::unique_ptr<Index> replacement(new Index{ size - 1, std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[size]) });
+        for (size_t i = 0; i < size; ++i)
+        {
+            replacement->slots[i].store(0, std::memory_order_relaxed);
+        }
+        for (uint32_t i = 0; i < m_allocated; ++i)
+        {
+            if (symbol_at(i).live)
+            {
+                add_to_index(*replacement, i);
+            }
+        }
+        m_index.store(replacement.get(), std::memory_order_seq_cst);
+        if (m_current_index)
+        {
+            m_old_indexes.push_back(std::move(m_current_index));
+        }
+        m_current_index = std::move(replacement);
+        m_index_used = count;
+    }
+    else
+    {
+        add_to_index(*index, symbol);
+        ++m_index_used;
+    }
+    m_count.store(count, std::memory_order_release);
+    return symbol;
 }
-// data int
-std::string DataInt::getvalue()
+
+void SymbolTable::add_to_index(Index &index, uint32_t i)
 {
-    std::ostringstream stream;
-    stream << m_value;
-    return stream.str();
+    size_t pos = symbol_at(i).hash & index.mask;
+    while (index.slots[pos].load(std::memory_order_relaxed))
+    {
+        pos = (pos + 1) & index.mask;
+    }
+    index.slots[pos].store(i + 1, std::memory_order_release);
 }
-bool DataInt::empty()
+
+// Removes a symbol whose references have all been released, unless it has been found
+// again since.
+void SymbolTable::remove(symbol_t symbol)
 {
-    return !m_value;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Symbol &entry = symbol_at(symbol);
+    if (!entry.live || entry.refs.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    entry.live = false;
+    Index &index = *m_current_index;
+    size_t pos = entry.hash & index.mask;
+    while (index.slots[pos].load(std::memory_order_relaxed) != symbol + 1)
+    {
+        pos = (pos + 1) & index.mask;
+    }
+    index.slots[pos].store(k_removed, std::memory_order_seq_cst);
+    m_removed.push_back(symbol);
+    m_count.fetch_sub(1, std::memory_order_release);
+    reclaim();
 }
-void DataInt::dump(int indent)
+
+// Makes removed symbols reusable and frees replaced indexes if no lock-free lookup is
+// running. A lookup starting later can't reach them. Expects m_mutex to be held.
+void SymbolTable::reclaim()
 {
-    std::cout << "(int)" << m_value << std::endl;
+    if (m_removed.empty() && m_old_indexes.empty())
+    {
+        return;
+    }
+    if (m_readers.load(std::memory_order_seq_cst))
+    {
+        return;
+    }
+    m_free.insert(m_free.end(), m_removed.begin(), m_removed.end());
+    m_removed.clear();
+    m_old_indexes.clear();
 }
-int DataInt::getint() const
+
+//////////////////////////////////////////////////////////////////////////
+// KeyPath
+//////////////////////////////////////////////////////////////////////////
+
+KeyPath::KeyPath(const std::string &path)
+: m_path(path)
+, m_segments()
 {
-    return m_value;
+    if (path.empty())
+    {
+        return;
+    }
+    boost::string_view rest(path);
+    while (true)
+    {
+        size_t index = rest.find('.');
+        boost::string_view name = rest.substr(0, index);
+        m_segments.push_back(Segment(name.to_string()));
+        if (index == boost::string_view::npos)
+        {
+            break;
+        }
+        rest.remove_prefix(index + 1);
+    }
 }
-// data value
-std::string DataValue::getvalue()
+
+//////////////////////////////////////////////////////////////////////////
+// data_map
+//////////////////////////////////////////////////////////////////////////
+
+// Spreads consecutive symbols over the index.
+inline size_t symbol_hash(SymbolTable::symbol_t symbol)
 {
-    return m_value;
+    return static_cast<uint32_t>(symbol * 2654435769u);
 }
-bool DataValue::empty()
+
+const uint32_t SymbolTable::k_removed;
+const SymbolTable::symbol_t SymbolRef::k_none;
+const uint32_t data_map::k_inline_entries;
+const uint32_t data_map::k_flat_limit;
+const uint32_t data_map::k_no_entry;
+
+data_map::data_map(const data_map &other)
+: m_inline()
+, m_table(nullptr)
+, m_size(0)
+, parent(nullptr)
+, m_parent_read_only(false)
 {
-    return m_value.empty();
+    copy_from(other);
 }
-int DataValue::getint() const
+
+data_map::data_map(data_map &&other) NOEXCEPT
+: m_inline()
+, m_table(nullptr)
+, m_size(0)
+, parent(nullptr)
+, m_parent_read_only(false)
 {
-    return static_cast<int>(std::strtol(m_value.c_str(), NULL, 0));
+    move_from(other);
 }
-void DataValue::dump(int indent)
+
+data_map::~data_map()
 {
-    std::string text = boost::algorithm::replace_all_copy(getvalue(), "\n", "\\n");
-    std::cout << "\"" << text << "\"" << std::endl;
+    reset();
 }
-// data list
-data_list &DataList::getlist()
+
+data_map &data_map::operator=(const data_map &other)
 {
-    return m_items;
+    if (this != &other)
+    {
+        reset();
+        copy_from(other);
+    }
+    return *this;
 }
 
-bool DataList::empty()
+data_map &data_map::operator=(data_map &&other) NOEXCEPT
 {
-    return m_items.empty();
+    if (this != &other)
+    {
+        reset();
+        move_from(other);
+    }
+    return *this;
 }
 
-void DataList::dump(int indent)
+// Both copy_from() and move_from() expect this map to be empty.
+void data_map::copy_from(const data_map &other)
 {
-    std::cout << "(list)" << std::endl;
-    int n = 0;
-    for (auto it : m_items)
+    for (uint32_t i = 0; i < std::min(other.m_size, k_inline_entries); ++i)
     {
-        std::cout << impl::indent(indent) << n << ": ";
-        it->dump(indent + 1);
-        ++n;
-    };
+        m_inline[i] = other.m_inline[i];
+    }
+    if (other.m_table && other.m_table->referenced)
+    {
+        m_table = other.copy_table();
+    }
+    else if (other.m_table)
+    {
+        m_table = other.m_table;
+        m_table->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_size = other.m_size;
+    parent = other.parent;
+    m_parent_read_only = other.m_parent_read_only;
 }
-// data map
-data_map &DataMap::getmap()
+
+void data_map::move_from(data_map &other)
 {
-    return m_items;
+    for (uint32_t i = 0; i < std::min(other.m_size, k_inline_entries); ++i)
+    {
+        m_inline[i] = std::move(other.m_inline[i]);
+    }
+    m_table = other.m_table;
+    m_size = other.m_size;
+    parent = other.parent;
+    m_parent_read_only = other.m_parent_read_only;
+    other.m_table = nullptr;
+    other.m_size = 0;
 }
-bool DataMap::empty()
+
+void data_map::reset()
 {
-    return m_items.empty();
+    for (uint32_t i = 0; i < std::min(m_size, k_inline_entries); ++i)
+    {
+        m_inline[i] = Entry();
+    }
+    if (m_table && m_table->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete m_table;
+    }
+    m_table = nullptr;
+    m_size = 0;
 }
-void DataMap::dump(int indent)
+
+// Gives this map its own copy of a shared table before the table is modified.
+void data_map::unshare()
 {
-    std::cout << "(map)" << std::endl;
-    for (auto it : m_items.data)
+    if (!m_table || m_table->refs.load(std::memory_order_acquire) == 1)
     {
-        std::cout << impl::indent(indent) << it.first << ": ";
-        it.second->dump(indent + 1);
-    };
+        return;
+    }
+    Table *table = copy_table();
+    if (m_table->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+    {
+        delete m_table;
+    }
+    m_table = table;
 }
 
-// data template
-DataTemplate::DataTemplate(const std::string &templateText)
+// Copies the entries past the inline ones, and the index, into a new unshared table.
+data_map::Table *data_map::copy_table() const
 {
-    // Parse the template
-    impl::TemplateParser(templateText, m_tree).parse();
+    std::unique_ptr<Table> table(new Table);
+    for (size_t b = 0; b < m_table->blocks.size(); ++b)
+    {
+        table->blocks.emplace_back(new Entry[4u << b]);
+    }
+    for (uint32_t i = k_inline_entries; i < m_size; ++i)
+    {
+        uint32_t bit = impl::highest_bit(i);
+        table->blocks[bit - 2][i - (1u << bit)] = entry(i);
+    }
+    table->index = m_table->index;
+    return table.release();
 }
 
-std::string DataTemplate::getvalue()
+uint32_t data_map::find_entry(SymbolTable::symbol_t symbol) const
 {
-    return "";
+    if (!m_table || m_table->index.empty())
+    {
+        for (uint32_t i = 0; i < m_size; ++i)
+        {
+            if (entry(i).symbol == symbol)
+            {
+                return i;
+            }
+        }
+        return k_no_entry;
+    }
+    const std::vector<uint32_t> &index = m_table->index;
+    size_t mask = index.size() - 1;
+    for (size_t pos = symbol_hash(symbol) & mask;; pos = (pos + 1) & mask)
+    {
+        uint32_t slot = index[pos];
+        if (!slot)
+        {
+            return k_no_entry;
+        }
+        if (entry(slot - 1).symbol == symbol)
+        {
+            return slot - 1;
+        }
+    }
 }
 
-bool DataTemplate::empty()
+data_ptr *data_map::find_local(SymbolTable::symbol_t symbol) const
 {
-    return false;
+    uint32_t i = find_entry(symbol);
+    return i == k_no_entry ? nullptr : &entry(i).value;
 }
 
-void DataTemplate::dump(int indent)
+// Like find(), but unshares the table of the map holding the value, so that it may be
+// modified.
+data_ptr *data_map::find_for_update(SymbolTable::symbol_t symbol)
 {
-    std::cout << "(template)\n";
+    for (data_map *map = this; map; map = map->parent)
+    {
+        uint32_t i = map->find_entry(symbol);
+        if (i != k_no_entry)
+        {
+            if (i >= k_inline_entries)
+            {
+                map->unshare();
+                map->m_table->referenced = true;
+            }
+            return &map->entry(i).value;
+        }
+        if (map->m_parent_read_only)
+        {
+            return map->parent->find(symbol) ? &map->insert_inherited(symbol) : nullptr;
+        }
+    }
+    return nullptr;
 }
 
-std::string DataTemplate::eval(data_map &data, data_list *param_values)
+// Indexes the first m_size entries in an index of @a size slots.
+void data_map::build_index(size_t size)
 {
-    std::ostringstream stream;
-    eval(stream, data, param_values);
-    return stream.str();
+    std::vector<uint32_t> &index = m_table->index;
+    index.assign(size, 0);
+    size_t mask = size - 1;
+    for (uint32_t i = 0; i < m_size; ++i)
+    {
+        size_t pos = symbol_hash(entry(i).symbol) & mask;
+        while (index[pos])
+        {
+            pos = (pos + 1) & mask;
+        }
+        index[pos] = i + 1;
+    }
 }
 
-void DataTemplate::eval(std::ostream &stream, data_map &data, data_list *param_values)
+// Adds a local entry, which must not already exist.
+data_ptr &data_map::insert(SymbolTable::symbol_t symbol)
 {
-    data_map *use_data = &data;
-
-    // Build map of param names to provided param values. The params map's
-    // parent is set to the main data_map. This will cause params to
-    // override keys in the main map, without modifying the main map.
-    data_map params_map;
-    if (param_values)
+    if (m_size >= k_inline_entries)
     {
-        // Check number of params.
-        if (param_values->size() > m_params.size())
+        if (!m_table)
         {
-            throw TemplateException("too many parameter(s) provided to subtemplate");
+            m_table = new Table;
         }
-
-        for (size_t i = 0; i < std::min(m_params.size(), param_values->size()); ++i)
+        unshare();
+        std::vector<std::unique_ptr<Entry[]> > &blocks = m_table->blocks;
+        if (m_size == (k_inline_entries << blocks.size()))
         {
-            const std::string &key = m_params[i];
-            data_ptr &value = (*param_values)[i];
-            params_map[key] = value;
+            blocks.emplace_back(new Entry[m_size]);
         }
+    }
 
-        params_map.set_parent(&data);
-        use_data = &params_map;
+    if (m_table)
+    {
+        m_table->referenced = true;
     }
+    Entry &e = entry(m_size++);
+    e.symbol = SymbolRef(symbol);
 
-    // Recursively calls gettext on each node in the tree.
-    // gettext returns the appropriate text for that node.
-    for (auto node : m_tree)
+    // Past the flat limit, keep an index at most half full.
+    if (m_size > k_flat_limit)
     {
-        node->gettext(stream, *use_data);
+        std::vector<uint32_t> &index = m_table->index;
+        if (m_size * 2 > index.size())
+        {
+            build_index(std::max<size_t>(k_flat_limit * 4, index.size() * 2));
+        }
+        else
+        {
+            size_t mask = index.size() - 1;
+            size_t pos = symbol_hash(symbol) & mask;
+            while (index[pos])
+            {
+                pos = (pos + 1) & mask;
+            }
+            index[pos] = m_size;
+        }
     }
+    return e.value;
 }
 
-bool data_ptr::is_template() const
+// Like operator[], a key missing everywhere is added to the outermost map, or to the
+// first map whose parent is read-only.
+data_ptr &data_map::get_or_insert(SymbolTable::symbol_t symbol)
 {
-    return (dynamic_cast<DataTemplate *>(ptr.get()) != nullptr);
+    uint32_t i = find_entry(symbol);
+    if (i != k_no_entry)
+    {
+        if (i >= k_inline_entries)
+        {
+            unshare();
+            m_table->referenced = true;
+        }
+        return entry(i).value;
+    }
+    if (!parent)
+    {
+        return insert(symbol);
+    }
+    return m_parent_read_only ? insert_inherited(symbol) : parent->get_or_insert(symbol);
 }
 
-TemplateException::TemplateException(size_t line, std::string reason)
-: std::exception()
-, m_line(0)
-, m_reason(reason)
+// Adds an entry for a key that may be in a read-only parent, starting with the parent's value.
+data_ptr &data_map::insert_inherited(SymbolTable::symbol_t symbol)
 {
-    set_line_if_missing(line);
+    data_ptr *inherited = parent->find(symbol);
+    data_ptr value = inherited ? *inherited : data_ptr();
+    data_ptr &entry = insert(symbol);
+    entry = std::move(value);
+    return entry;
 }
 
-void TemplateException::set_line_if_missing(size_t line)
+data_ptr &data_map::operator[](const std::string &key)
 {
-    if (!m_line)
+    SymbolRef symbol(key);
+    return get_or_insert(symbol);
+}
+data_ptr &data_map::operator[](const SymbolRef &key)
+{
+    return get_or_insert(key);
+}
+bool data_map::empty()
+{
+    return m_size == 0;
+}
+bool data_map::has(const std::string &key)
+{
+    return find(key) != nullptr;
+}
+
+data_ptr *data_map::find(boost::string_view key)
+{
+    // A key that was never interned can't be in any map. As the symbol found isn't
+    // referenced, it may have been removed and reused for another key since, so check
+    // the name of a key that is found.
+    SymbolTable::symbol_t symbol;
+    if (!SymbolTable::global().find(key, symbol))
     {
-        m_line = line;
-        m_reason = std::string("Line ") + boost::lexical_cast<std::string>(line) + ": " + m_reason;
+        return nullptr;
     }
+    data_ptr *value = find(symbol);
+    return value && SymbolTable::global().name(symbol) == key ? value : nullptr;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// parse_path
-//////////////////////////////////////////////////////////////////////////
-data_ptr &data_map::parse_path(const std::string &key, bool create)
+data_ptr *data_map::find(SymbolTable::symbol_t symbol)
 {
-    if (key.empty())
+    for (data_map *map = this; map; map = map->parent)
     {
-        throw key_error("empty map key");
+        if (data_ptr *value = map->find_local(symbol))
+        {
+            return value;
+        }
     }
+    return nullptr;
+}
 
-    // check for dotted notation, i.e [foo.bar]
-    size_t index = key.find(".");
-    if (index == std::string::npos)
+data_ptr *data_map::find(const KeyPath::Segment &segment, LookupStats *stats)
+{
+    uint32_t hint = segment.hint.load(std::memory_order_relaxed);
+    if (hint < m_size && entry(hint).symbol == segment.symbol)
     {
-        if (!has(key))
+        if (stats)
         {
-            if (!create)
-            {
-                printf("invalid map key: %s\n", key.c_str());
-                throw key_error("invalid map key");
-            }
-            data[key] = make_data("");
+            ++stats->hits;
         }
-        return operator[](key);
+        return &entry(hint).value;
     }
-
-    std::string sub_key = key.substr(0, index);
-    if (!has(sub_key))
+    if (stats)
     {
-        printf("invalid map key: %s\n", sub_key.c_str());
-        throw key_error("invalid map key");
+        ++stats->misses;
     }
 
-    return operator[](sub_key)->getmap().parse_path(key.substr(index + 1), create);
+    uint32_t i = find_entry(segment.symbol);
+    if (i != k_no_entry)
+    {
+        segment.hint.store(i, std::memory_order_relaxed);
+        return &entry(i).value;
+    }
+    return parent ? parent->find(segment.symbol) : nullptr;
 }
 
-void dump_data(data_ptr data)
+data_ptr *data_map::find_path(boost::string_view key)
 {
-    data->dump();
+    data_map *map = this;
+    while (true)
+    {
+        size_t index = key.find('.');
+        data_ptr *value = map->find(key.substr(0, index));
+        if (!value || index == boost::string_view::npos)
+        {
+            return value;
+        }
+        map = &value->getmap();
+        key.remove_prefix(index + 1);
+    }
 }
 
-namespace impl
-{
-std::string indent(int level)
+data_ptr *data_map::find_path(const KeyPath &path, LookupStats *stats)
 {
-    std::string result;
-    while (level--)
+    const std::vector<KeyPath::Segment> &segments = path.segments();
+    data_map *map = this;
+    for (size_t i = 0; i < segments.size(); ++i)
     {
-        result += "    ";
+        data_ptr *value = map->find(segments[i], stats);
+        if (!value || i + 1 == segments.size())
+        {
+            return value;
+        }
+        map = &value->getmap();
     }
-    return result;
+    return nullptr;
 }
 
-Token TokenIterator::s_endToken(END_TOKEN);
+bool data_map::try_lookup_path(boost::string_view key, data_ptr &result)
+{
+    data_map *map = this;
+    while (true)
+    {
+        size_t index = key.find('.');
+        data_ptr *value = map->find(key.substr(0, index));
+        if (!value)
+        {
+            return false;
+        }
+        if (index == boost::string_view::npos)
+        {
+            result = *value;
+            return true;
+        }
+        key.remove_prefix(index + 1);
 
-const Token *TokenIterator::get() const
+        // Members of a loop variable are read without converting it to a map.
+        if (value->kind() == data_ptr::LOOP)
+        {
+            return value->find_loop_member(key, result);
+        }
+        map = &value->getmap();
+    }
+}
+
+bool data_map::try_lookup_path(const KeyPath &path, data_ptr &result, LookupStats *stats)
 {
-    if (is_valid())
+    const std::vector<KeyPath::Segment> &segments = path.segments();
+    data_map *map = this;
+    for (size_t i = 0; i < segments.size(); ++i)
     {
-        return &m_tokens[m_index];
+        data_ptr *value = map->find(segments[i], stats);
+        if (!value)
+        {
+            return false;
+        }
+        if (i + 1 == segments.size())
+        {
+            result = *value;
+            return true;
+        }
+
+        // Members of a loop variable are read without converting it to a map. A member
+        // is always the last segment.
+        if (value->kind() == data_ptr::LOOP)
+        {
+            return i + 2 == segments.size() && value->find_loop_member(segments[i + 1].name, result);
+        }
+        map = &value->getmap();
     }
-    else
+    return false;
+}
+
+// data_ptr
+template <>
+void data_ptr::operator=(const data_map &data)
+{
+    release();
+    adopt(new DataMap(data), MAP);
+}
+
+template <>
+void data_ptr::operator=(const data_list &data)
+{
+    release();
+    adopt(new DataList(data), LIST);
+}
+
+data_ptr &data_ptr::operator=(std::string &&data)
+{
+    set_string(std::move(data));
+    return *this;
+}
+
+data_ptr &data_ptr::operator=(data_map &&data)
+{
+    release();
+    adopt(new DataMap(std::move(data)), MAP);
+    return *this;
+}
+
+data_ptr &data_ptr::operator=(data_list &&data)
+{
+    release();
+    adopt(new DataList(std::move(data)), LIST);
+    return *this;
+}
+
+void data_ptr::push_back(const data_ptr &data)
+{
+    if (kind() == NONE)
     {
-        return &s_endToken;
+        adopt(new DataList(data_list()), LIST);
     }
+    getlist().push_back(data);
 }
 
-const Token *TokenIterator::next()
+// Takes a reference to @a data; the previous value must already be released.
+void data_ptr::adopt(Data *data, Kind kind)
 {
-    if (m_index < size())
+    clear();
+    m_ptr = data;
+    set_kind(kind);
+    retain();
+}
+
+void data_ptr::set_string(const char *value, size_t length)
+{
+    if (length > k_inline_capacity)
     {
-        ++m_index;
+        set_string(std::string(value, length));
+        return;
     }
-    return get();
+    release();
+    clear();
+    std::memcpy(m_bytes, value, length);
+    m_bytes[k_size_byte] = static_cast<char>(length);
+    set_kind(STRING);
 }
 
-const Token *TokenIterator::match(TokenType tokenType, const char *failure_msg)
+void data_ptr::set_string(std::string &&value)
 {
-    const Token *result = get();
-    if (result->get_type() != tokenType)
+    if (value.size() <= k_inline_capacity)
     {
-        throw TemplateException(failure_msg ? failure_msg : "unexpected token");
+        set_string(value.data(), value.size());
+        return;
     }
-    next();
-    return result;
+    release();
+    adopt(new DataValue(std::move(value)), VALUE);
 }
 
-TokenIterator &TokenIterator::operator++()
+bool data_ptr::empty() const
 {
-    next();
-    return *this;
+    switch (kind())
+    {
+        case NONE:
+            return true;
+        case LOOP:
+            return false;
+        case BOOL:
+            return !m_bool;
+        case INT:
+            return !m_int;
+        case STRING:
+            return !m_bytes[k_size_byte];
+        default:
+            return m_ptr->empty();
+    }
 }
 
-inline bool is_key_path_char(char c)
+std::string data_ptr::getvalue() const
 {
-    return (isalnum(c) || c == '.' || c == '_');
+    switch (kind())
+    {
+        case NONE:
+            return std::string();
+        case BOOL:
+            return m_bool ? "true" : "false";
+        case INT:
+            return std::to_string(m_int);
+        case STRING:
+            return std::string(m_bytes, m_bytes[k_size_byte]);
+        case LOOP:
+            throw TemplateException("Data item is not a value");
+        default:
+            return m_ptr->getvalue();
+    }
 }
 
-const KeywordDef k_keywords[] = { { TRUE_TOKEN, "true" },     { FALSE_TOKEN, "false" }, { FOR_TOKEN, "for" },
-                                  { IN_TOKEN, "in" },         { IF_TOKEN, "if" },       { ELIF_TOKEN, "elif" },
-                                  { ELSE_TOKEN, "else" },     { DEF_TOKEN, "def" },     { SET_TOKEN, "set" },
-                                  { ENDFOR_TOKEN, "endfor" }, { ENDIF_TOKEN, "endif" }, { ENDDEF_TOKEN, "enddef" },
-                                  { AND_TOKEN, "and" },       { OR_TOKEN, "or" },       { NOT_TOKEN, "not" },
-                                  { INVALID_TOKEN } };
+boost::string_view data_ptr::getview(std::string &buffer) const
+{
+    switch (kind())
+    {
+        case STRING:
+            return boost::string_view(m_bytes, m_bytes[k_size_byte]);
+        case VALUE:
+            return static_cast<const DataValue *>(m_ptr)->value();
+        default:
+            buffer = getvalue();
+            return buffer;
+    }
+}
 
-TokenType get_keyword_token(const std::string &s)
+data_list &data_ptr::getlist()
 {
-    const KeywordDef *k = k_keywords;
-    for (; k->tok != INVALID_TOKEN; ++k)
+    if (!is_shared())
     {
-        if (s == k->keyword)
+        throw TemplateException("Data item is not a list");
+    }
+    return m_ptr->getlist();
+}
+
+data_map &data_ptr::getmap()
+{
+    if (kind() == LOOP)
+    {
+        data_map loop;
+        const char *members[] = { "index", "index0", "first", "last", "even", "odd", "count", "addNewLineIfNotLast" };
+        for (const char *member : members)
         {
-            return k->tok;
+            loop[member] = loop_member(member);
         }
+        *this = std::move(loop);
     }
-    return INVALID_TOKEN;
+    if (!is_shared())
+    {
+        throw TemplateException("Data item is not a dictionary");
+    }
+    return m_ptr->getmap();
 }
 
-void create_id_token(token_vector &tokens, const std::string &s)
+std::shared_ptr<Data> data_ptr::get()
 {
-    TokenType t = get_keyword_token(s);
-    if (t == INVALID_TOKEN)
+    switch (kind())
     {
-        // Create key path token.
-        tokens.emplace_back(KEY_PATH_TOKEN, s);
+        case NONE:
+            return std::shared_ptr<Data>();
+        case BOOL:
+            return std::make_shared<DataBool>(m_bool);
+        case INT:
+            return std::make_shared<DataInt>(m_int);
+        case STRING:
+            return std::make_shared<DataValue>(getvalue());
+        case LOOP:
+            getmap();
+            break;
+        default:
+            break;
+    }
+
+    // The handle holds a reference of its own, released when its last copy goes away.
+    retain();
+    return std::shared_ptr<Data>(m_ptr, [](Data *data) {
+        if (data->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete data;
+        }
+    });
+}
+
+data_ptr data_ptr::make_loop(uint32_t index, uint32_t count)
+{
+    data_ptr result;
+    result.m_loop.index = index;
+    result.m_loop.count = count;
+    result.set_kind(LOOP);
+    return result;
+}
+
+data_ptr data_ptr::loop_member(const std::string &name) const
+{
+    data_ptr result;
+    if (!find_loop_member(name, result))
+    {
+        throw data_map::key_error("invalid map key");
+    }
+    return result;
+}
+
+bool data_ptr::find_loop_member(boost::string_view name, data_ptr &result) const
+{
+    if (kind() != LOOP)
+    {
+        return false;
+    }
+
+    uint32_t i = m_loop.index;
+    uint32_t count = m_loop.count;
+    // index, index0 and count have always been strings.
+    if (name == "index")
+    {
+        result = std::to_string(i + 1);
+    }
+    else if (name == "index0")
+    {
+        result = std::to_string(i);
+    }
+    else if (name == "first")
+    {
+        result = i == 0;
+    }
+    else if (name == "last")
+    {
+        result = i == count - 1;
+    }
+    else if (name == "even")
+    {
+        result = (i + 1) % 2 == 0;
+    }
+    else if (name == "odd")
+    {
+        result = (i + 1) % 2 == 1;
+    }
+    else if (name == "count")
+    {
+        result = std::to_string(count);
+    }
+    else if (name == "addNewLineIfNotLast")
+    {
+        result = std::string(i != count - 1 ? "\n" : "");
     }
     else
     {
-        tokens.emplace_back(t);
+        return false;
     }
+    return true;
 }
 
-int append_string_escape(std::string &str, std::function<char(unsigned)> peek)
+int data_ptr::getint() const
 {
-    char esc = peek(1);
-    std::string hex;
-    int n = 2;
-    switch (esc)
+    switch (kind())
     {
-        // standard C escape sequences
-        case 'a':
-            esc = '\a';
-            break;
-        case 'b':
-            esc = '\b';
-            break;
-        case 'f':
-            esc = '\f';
-            break;
-        case 'n':
-            esc = '\n';
-            break;
-        case 'r':
-            esc = '\r';
+        case NONE:
+        case LOOP:
+            return 0;
+        case BOOL:
+            return static_cast<int>(m_bool);
+        case INT:
+            return m_int;
+        case STRING:
+        {
+            char buffer[k_inline_capacity + 1];
+            std::memcpy(buffer, m_bytes, m_bytes[k_size_byte]);
+            buffer[static_cast<size_t>(m_bytes[k_size_byte])] = 0;
+            return static_cast<int>(std::strtol(buffer, NULL, 0));
+        }
+        default:
+            return m_ptr->getint();
+    }
+}
+
+void data_ptr::dump(int indent) const
+{
+    switch (kind())
+    {
+        case NONE:
+            std::cout << "(null)" << std::endl;
             break;
-        case 't':
-            esc = '\t';
+        case BOOL:
+            std::cout << "(bool)" << getvalue() << std::endl;
             break;
-        case 'v':
-            esc = '\v';
+        case INT:
+            std::cout << "(int)" << m_int << std::endl;
             break;
-        case '0':
-            esc = '\0';
+        case LOOP:
+        {
+            data_ptr loop = *this;
+            loop.getmap();
+            loop.dump(indent);
             break;
-        // handle hex escapes like \x2a
-        case 'x':
-            for (; std::isxdigit(peek(n)); ++n)
-            {
-                hex += peek(n);
-            }
-            esc = static_cast<char>(hex.empty() ? 0 : std::strtoul(hex.c_str(), nullptr, 16));
+        }
+        case STRING:
+        {
+            std::string text = boost::algorithm::replace_all_copy(getvalue(), "\n", "\\n");
+            std::cout << "\"" << text << "\"" << std::endl;
             break;
+        }
+        default:
+            m_ptr->dump(indent);
     }
-    str += esc;
-    return n - 1;
 }
 
-token_vector tokenize_statement(const std::string &text)
+// base data
+std::string Data::getvalue()
 {
-    token_vector tokens;
-    lexer_state_t state = INIT_STATE;
-    unsigned i = 0;
-    uint32_t pos = 0;
-    char str_open_quote = 0;
-    std::string literal;
-    bool is_hex_literal = false;
-
-    // closure to get the next char without advancing
-    auto peek = [&](unsigned n)
-    {
-        return i + n < text.size() ? text[i + n] : 0;
-    };
-
-    for (; i < text.size(); ++i)
-    {
-        char c = text[i];
+    throw TemplateException("Data item is not a value");
+}
 
-        switch (state)
-        {
-            case INIT_STATE:
-                // Skip any whitespace
-                if (isspace(c))
-                {
-                    continue;
-                }
-                else if (isdigit(c))
-                {
-                    literal = c;
-                    if (c == '0' && peek(1) == 'x')
-                    {
-                        literal += "x";
-                        is_hex_literal = true;
-                        ++i;
-                    }
-                    else
-                    {
-                        is_hex_literal = false;
-                    }
-                    state = INT_LITERAL_STATE;
-                }
-                else if (is_key_path_char(c))
-                {
-                    pos = i;
-                    state = KEY_PATH_STATE;
-                }
-                else if (c == '(' || c == ')' || c == ',' || c == '+' || c == '*' || c == '/' || c == '%')
-                {
-                    tokens.emplace_back(static_cast<TokenType>(c));
+data_list &Data::getlist()
+{
+    throw TemplateException("Data item is not a list");
+}
+data_map &Data::getmap()
+{
+    throw TemplateException("Data item is not a dictionary");
+}
+int Data::getint() const
+{
+    return 0;
+}
+// data bool
+std::string DataBool::getvalue()
+{
+    return m_value ? "true" : "false";
+}
+bool DataBool::empty()
+{
+    return !m_value;
+}
+void DataBool::dump(int indent)
+{
+    std::cout << "(bool)" << getvalue() << std::endl;
+}
+int DataBool::getint() const
+{
+    return static_cast<int>(m_value);
+}
+// data int
+std::string DataInt::getvalue()
+{
+    std::ostringstream stream;
+    stream << m_value;
+    return stream.str();
+}
+bool DataInt::empty()
+{
+    return !m_value;
+}
+void DataInt::dump(int indent)
+{
+    std::cout << "(int)" << m_value << std::endl;
+}
+int DataInt::getint() const
+{
+    return m_value;
+}
+// data value
+std::string DataValue::getvalue()
+{
+    return m_value;
+}
+bool DataValue::empty()
+{
+    return m_value.empty();
+}
+int DataValue::getint() const
+{
+    return static_cast<int>(std::strtol(m_value.c_str(), NULL, 0));
+}
+void DataValue::dump(int indent)
+{
+    std::string text = boost::algorithm::replace_all_copy(getvalue(), "\n", "\\n");
+    std::cout << "\"" << text << "\"" << std::endl;
+}
+// data list
+data_list &DataList::getlist()
+{
+    return m_items;
+}
+
+bool DataList::empty()
+{
+    return m_items.empty();
+}
+
+void DataList::dump(int indent)
+{
+    std::cout << "(list)" << std::endl;
+    int n = 0;
+    for (auto it : m_items)
+    {
+        std::cout << impl::indent(indent) << n << ": ";
+        it->dump(indent + 1);
+        ++n;
+    };
+}
+// data map
+data_map &DataMap::getmap()
+{
+    return m_items;
+}
+bool DataMap::empty()
+{
+    return m_items.empty();
+}
+void DataMap::dump(int indent)
+{
+    std::cout << "(map)" << std::endl;
+    m_items.for_each([indent](const std::string &key, data_ptr &value)
+    {
+        std::cout << impl::indent(indent) << key << ": ";
+        value->dump(indent + 1);
+    });
+}
+
+// data template
+DataTemplate::DataTemplate(const std::string &templateText)
+: m_output_hint(0)
+, m_pool(nullptr)
+, m_parallel_min_items(0)
+{
+    // Parse the template
+    impl::TemplateParser(templateText, m_tree).parse();
+    m_may_stop = impl::may_stop_on_key_error(m_tree);
+}
+
+DataTemplate::DataTemplate(const impl::node_vector &tree)
+: m_tree(tree)
+, m_output_hint(0)
+, m_pool(nullptr)
+, m_parallel_min_items(0)
+, m_may_stop(impl::may_stop_on_key_error(m_tree))
+{
+}
+
+DataTemplate::DataTemplate(impl::node_vector &&tree)
+: m_tree(std::move(tree))
+, m_output_hint(0)
+, m_pool(nullptr)
+, m_parallel_min_items(0)
+, m_may_stop(impl::may_stop_on_key_error(m_tree))
+{
+}
+
+DataTemplate::DataTemplate(const impl::node_vector &tree, const impl::program_ptr &program)
+: m_tree(tree)
+, m_program(program)
+, m_output_hint(0)
+, m_pool(nullptr)
+, m_parallel_min_items(0)
+, m_may_stop(impl::may_stop_on_key_error(m_tree))
+{
+}
+
+std::string DataTemplate::getvalue()
+{
+    return "";
+}
+
+bool DataTemplate::empty()
+{
+    return false;
+}
+
+void DataTemplate::dump(int indent)
+{
+    std::cout << "(template)\n";
+}
+
+std::string DataTemplate::eval(data_map &data, data_list *param_values)
+{
+    std::string output;
+    eval(output, data, param_values);
+    return output;
+}
+
+void DataTemplate::eval(std::string &output, data_map &data, data_list *param_values)
+{
+    output.clear();
+    reserve_output(output);
+    {
+        StringSink sink(output);
+        eval(sink, data, param_values);
+    }
+    update_output_hint(output.size());
+}
+
+std::vector<BatchResult> DataTemplate::eval_batch(std::vector<data_map> &items, ThreadPool &pool)
+{
+    compile();
+    std::vector<BatchResult> results(items.size());
+    pool.parallel_for(items.size(), [&](size_t i) { eval_batch_item(items[i], results[i]); });
+    return results;
+}
+
+void DataTemplate::eval_batch(std::vector<data_map> &items, ThreadPool &pool,
+                              const std::function<void(size_t index, const BatchResult &result)> &consume)
+{
+    compile();
+    const size_t window = (pool.size() + 1) * 8;
+    std::vector<BatchResult> results(std::min(window, items.size()));
+    for (size_t first = 0; first < items.size(); first += window)
+    {
+        size_t count = std::min(window, items.size() - first);
+        pool.parallel_for(count, [&](size_t i) { eval_batch_item(items[first + i], results[i]); });
+        for (size_t i = 0; i < count; ++i)
+        {
+            consume(first + i, results[i]);
+        }
+    }
+}
+
+// Renders like eval(), except that maps shared with other items are copied rather than
+// assigned to, as other renders may be reading them.
+void DataTemplate::eval_batch_item(data_map &data, BatchResult &result)
+{
+    result.error = nullptr;
+    result.output.clear();
+    reserve_output(result.output);
+    try
+    {
+        {
+            StringSink sink(result.output);
+            impl::RenderContext context;
+            context.pool = m_pool;
+            context.parallel_min_items = m_parallel_min_items;
+            context.copy_shared = true;
+            eval(sink, data, nullptr, 0, context);
+            sink.flush();
+        }
+        update_output_hint(result.output.size());
+    }
+    catch (...)
+    {
+        result.error = std::current_exception();
+    }
+}
+
+// Reserves a little more than the expected size, so that renders slightly larger than
+// usual still fit. Before C++20 reserve() may shrink the string, so only ever grow it.
+void DataTemplate::reserve_output(std::string &output) const
+{
+    size_t hint = output_size_hint();
+    size_t wanted = output.size() + hint + hint / 8;
+    if (hint && output.capacity() < wanted)
+    {
+        output.reserve(wanted);
+    }
+}
+
+// Moves the estimate a quarter of the way towards the latest size. Concurrent renders
+// may overwrite each other's updates, which only costs a little accuracy.
+void DataTemplate::update_output_hint(size_t size)
+{
+    size_t hint = m_output_hint.load(std::memory_order_relaxed);
+    if (hint)
+    {
+        hint = hint - hint / 4 + size / 4;
+    }
+    else
+    {
+        hint = size;
+    }
+    m_output_hint.store(hint, std::memory_order_relaxed);
+}
+
+void DataTemplate::eval(std::ostream &stream, data_map &data, data_list *param_values)
+{
+    StreamSink sink(stream);
+    eval(sink, data, param_values);
+}
+
+void DataTemplate::eval(OutputSink &sink, data_map &data, data_list *param_values)
+{
+    impl::RenderContext context;
+    context.pool = m_pool;
+    context.parallel_min_items = m_parallel_min_items;
+    if (param_values)
+    {
+        // An empty list still gives the template its own params map.
+        static const data_ptr s_no_params;
+        eval(sink, data, param_values->empty() ? &s_no_params : param_values->data(), param_values->size(), context);
+    }
+    else
+    {
+        eval(sink, data, nullptr, 0, context);
+    }
+    sink.flush();
+}
+
+std::string DataTemplate::eval(data_map &data, const data_ptr *param_values, size_t param_count, impl::RenderContext &context)
+{
+    std::string output;
+    StringSink sink(output);
+    eval(sink, data, param_values, param_count, context);
+    sink.flush();
+    return output;
+}
+
+void DataTemplate::eval(OutputSink &sink, data_map &data, const data_ptr *param_values, size_t param_count, impl::RenderContext &context)
+{
+    data_map *use_data = &data;
+
+    // Build map of param names to provided param values. The params map's
+    // parent is set to the main data_map. This will cause params to
+    // override keys in the main map, without modifying the main map.
+    data_map params_map;
+    if (param_values)
+    {
+        // Check number of params.
+        if (param_count > m_params.size())
+        {
+            throw TemplateException("too many parameter(s) provided to subtemplate");
+        }
+
+        // Use the symbols interned by the def, unless the names were changed since.
+        const std::vector<SymbolRef> *symbols = m_param_symbols.get();
+        for (size_t i = 0; i < param_count; ++i)
+        {
+            if (symbols && i < symbols->size() && SymbolTable::global().name((*symbols)[i]) == m_params[i])
+            {
+                params_map[(*symbols)[i]] = param_values[i];
+            }
+            else
+            {
+                params_map[m_params[i]] = param_values[i];
+            }
+        }
+
+        params_map.set_parent(&data);
+        use_data = &params_map;
+    }
+
+    if (m_program && !context.profiler)
+    {
+        m_program->run(sink, *use_data, context);
+        return;
+    }
+
+    // Recursively calls gettext on each node in the tree.
+    // gettext returns the appropriate text for that node.
+    for (auto &node : m_tree)
+    {
+        impl::render_node(node.get(), sink, *use_data, context);
+    }
+}
+
+std::string DataTemplate::eval(data_map &data, Profiler &profiler)
+{
+    std::string output;
+    reserve_output(output);
+    {
+        StringSink sink(output);
+        eval(sink, data, profiler);
+    }
+    update_output_hint(output.size());
+    return output;
+}
+
+void DataTemplate::eval(std::ostream &stream, data_map &data, Profiler &profiler)
+{
+    StreamSink sink(stream);
+    eval(sink, data, profiler);
+}
+
+void DataTemplate::eval(OutputSink &sink, data_map &data, Profiler &profiler)
+{
+    impl::RenderContext context;
+    context.profiler = &profiler;
+    eval(sink, data, nullptr, 0, context);
+    sink.flush();
+}
+
+void DataTemplate::compile()
+{
+    if (!m_program)
+    {
+        m_program = std::make_shared<impl::Program>(m_tree);
+    }
+}
+
+TemplateException::TemplateException(size_t line, std::string reason)
+: std::exception()
+, m_line(0)
+, m_reason(reason)
+{
+    set_line_if_missing(line);
+}
+
+void TemplateException::set_line_if_missing(size_t line)
+{
+    if (!m_line)
+    {
+        m_line = line;
+        m_reason = std::string("Line ") + boost::lexical_cast<std::string>(line) + ": " + m_reason;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// parse_path
+//////////////////////////////////////////////////////////////////////////
+data_ptr &data_map::parse_path(const std::string &key, bool create)
+{
+    return parse_path(KeyPath(key), create);
+}
+
+data_ptr &data_map::parse_path(const KeyPath &path, bool create, bool copy_shared)
+{
+    if (path.empty())
+    {
+        throw key_error("empty map key");
+    }
+
+    const std::vector<KeyPath::Segment> &segments = path.segments();
+    data_map *map = this;
+    for (size_t i = 0; i + 1 < segments.size(); ++i)
+    {
+        data_ptr *value = map->find_for_update(segments[i].symbol);
+        if (!value)
+        {
+            throw key_error("invalid map key");
+        }
+        if (copy_shared && value->kind() == data_ptr::MAP && !value->unique())
+        {
+            data_map copy = value->getmap();
+            *value = std::move(copy);
+        }
+        map = &value->getmap();
+    }
+
+    const KeyPath::Segment &last = segments.back();
+    if (data_ptr *value = map->find_for_update(last.symbol))
+    {
+        return *value;
+    }
+    if (!create)
+    {
+        throw key_error("invalid map key");
+    }
+    data_ptr &value = map->insert(last.symbol);
+    value = make_data("");
+    return value;
+}
+
+data_ptr data_map::lookup_path(const std::string &key)
+{
+    data_ptr result;
+    if (!try_lookup_path(key, result))
+    {
+        throw key_error(key.empty() ? "empty map key" : "invalid map key");
+    }
+    return result;
+}
+
+void dump_data(data_ptr data)
+{
+    data->dump();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Output sinks
+//////////////////////////////////////////////////////////////////////////
+
+StringSink::StringSink(std::string &output)
+: m_output(output)
+{
+    char *end = &m_output[0] + m_output.size();
+    set_buffer(end, end);
+}
+
+StringSink::~StringSink()
+{
+    flush();
+}
+
+// Trims the string to the output written so far.
+void StringSink::flush()
+{
+    m_output.resize(m_pos - &m_output[0]);
+    char *end = &m_output[0] + m_output.size();
+    set_buffer(end, end);
+}
+
+void StringSink::overflow(const char *data, size_t size)
+{
+    // Grow the string to at least double its length, and use its whole capacity.
+    size_t length = m_pos - &m_output[0];
+    m_output.resize(std::max(length + size, std::max<size_t>(length * 2, 256)));
+    m_output.resize(m_output.capacity());
+    std::memcpy(&m_output[length], data, size);
+    set_buffer(&m_output[length + size], &m_output[0] + m_output.size());
+}
+
+BufferSink::BufferSink(char *buffer, size_t size)
+: m_begin(buffer)
+, m_truncated(false)
+{
+    set_buffer(buffer, buffer + size);
+}
+
+void BufferSink::overflow(const char *data, size_t)
+{
+    size_t room = m_end - m_pos;
+    std::memcpy(m_pos, data, room);
+    m_pos += room;
+    m_truncated = true;
+}
+
+FileSink::FileSink(int fd)
+: m_fd(fd)
+{
+    set_buffer(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+FileSink::~FileSink()
+{
+    try
+    {
+        flush();
+    }
+    catch (TemplateException &)
+    {
+    }
+}
+
+void FileSink::flush()
+{
+    size_t size = m_pos - m_buffer;
+    set_buffer(m_buffer, m_buffer + sizeof(m_buffer));
+    write_file(m_buffer, size);
+}
+
+void FileSink::write_file(const char *data, size_t size)
+{
+    while (size)
+    {
+#if _WIN32
+        int written = ::_write(m_fd, data, static_cast<unsigned int>(size));
+#else
+        ssize_t written = ::write(m_fd, data, size);
+#endif
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw TemplateException("error writing output: " + std::string(std::strerror(errno)));
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+void FileSink::overflow(const char *data, size_t size)
+{
+    flush();
+    if (size >= sizeof(m_buffer))
+    {
+        // Large writes go straight to the file.
+        write_file(data, size);
+        return;
+    }
+    std::memcpy(m_pos, data, size);
+    m_pos += size;
+}
+
+const size_t SegmentSink::k_min_borrowed;
+const size_t SegmentSink::k_first_chunk;
+
+SegmentSink::SegmentSink()
+: m_segments()
+, m_chunks()
+, m_run(nullptr)
+, m_size(0)
+{
+    add_chunk(k_first_chunk);
+}
+
+void SegmentSink::write_static(const char *data, size_t size)
+{
+    if (size < k_min_borrowed)
+    {
+        write(data, size);
+        return;
+    }
+    flush();
+    add_segment(data, size);
+}
+
+// Ends the run of output copied into the current chunk.
+void SegmentSink::flush()
+{
+    if (m_pos != m_run)
+    {
+        add_segment(m_run, m_pos - m_run);
+        m_run = m_pos;
+    }
+}
+
+void SegmentSink::overflow(const char *data, size_t size)
+{
+    // Start a new chunk rather than splitting the write across two segments.
+    flush();
+    add_chunk(std::max(size, m_chunks.back().size * 2));
+    std::memcpy(m_pos, data, size);
+    m_pos += size;
+}
+
+void SegmentSink::add_chunk(size_t size)
+{
+    m_chunks.push_back(Chunk{ std::unique_ptr<char[]>(new char[size]), size });
+    char *begin = m_chunks.back().data.get();
+    set_buffer(begin, begin + size);
+    m_run = begin;
+}
+
+void SegmentSink::add_segment(const char *data, size_t size)
+{
+    m_segments.push_back(Segment{ data, size });
+    m_size += size;
+}
+
+std::string SegmentSink::str() const
+{
+    std::string result;
+    result.reserve(m_size);
+    for (const Segment &segment : m_segments)
+    {
+        result.append(segment.data, segment.size);
+    }
+    return result;
+}
+
+void SegmentSink::clear()
+{
+    m_segments.clear();
+    m_chunks.resize(1);
+    char *begin = m_chunks.back().data.get();
+    set_buffer(begin, begin + m_chunks.back().size);
+    m_run = begin;
+    m_size = 0;
+}
+
+StreamSink::StreamSink(std::ostream &stream)
+: m_stream(stream)
+{
+    set_buffer(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+StreamSink::~StreamSink()
+{
+    // The stream throws if its exceptions are enabled, which may be for any error.
+    try
+    {
+        flush();
+    }
+    catch (...)
+    {
+    }
+}
+
+void StreamSink::flush()
+{
+    m_stream.write(m_buffer, m_pos - m_buffer);
+    set_buffer(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+void StreamSink::overflow(const char *data, size_t size)
+{
+    flush();
+    if (size >= sizeof(m_buffer))
+    {
+        m_stream.write(data, size);
+        return;
+    }
+    std::memcpy(m_pos, data, size);
+    m_pos += size;
+}
+
+namespace impl
+{
+std::string indent(int level)
+{
+    std::string result;
+    while (level--)
+    {
+        result += "    ";
+    }
+    return result;
+}
+
+Token TokenIterator::s_endToken(END_TOKEN);
+
+const Token *TokenIterator::get() const
+{
+    if (is_valid())
+    {
+        return &m_tokens[m_index];
+    }
+    else
+    {
+        return &s_endToken;
+    }
+}
+
+const Token *TokenIterator::next()
+{
+    if (m_index < size())
+    {
+        ++m_index;
+    }
+    return get();
+}
+
+const Token *TokenIterator::match(TokenType tokenType, const char *failure_msg)
+{
+    const Token *result = get();
+    if (result->get_type() != tokenType)
+    {
+        throw TemplateException(failure_msg ? failure_msg : "unexpected token");
+    }
+    next();
+    return result;
+}
+
+TokenIterator &TokenIterator::operator++()
+{
+    next();
+    return *this;
+}
+
+inline bool is_key_path_char(char c)
+{
+    return (isalnum(c) || c == '.' || c == '_');
+}
+
+const KeywordDef k_keywords[] = { { TRUE_TOKEN, "true" },     { FALSE_TOKEN, "false" }, { FOR_TOKEN, "for" },
+                                  { IN_TOKEN, "in" },         { IF_TOKEN, "if" },       { ELIF_TOKEN, "elif" },
+                                  { ELSE_TOKEN, "else" },     { DEF_TOKEN, "def" },     { SET_TOKEN, "set" },
+                                  { ENDFOR_TOKEN, "endfor" }, { ENDIF_TOKEN, "endif" }, { ENDDEF_TOKEN, "enddef" },
+                                  { AND_TOKEN, "and" },       { OR_TOKEN, "or" },       { NOT_TOKEN, "not" },
+                                  { INVALID_TOKEN } };
+
+TokenType get_keyword_token(boost::string_view s)
+{
+    const KeywordDef *k = k_keywords;
+    for (; k->tok != INVALID_TOKEN; ++k)
+    {
+        if (s == k->keyword)
+        {
+            return k->tok;
+        }
+    }
+    return INVALID_TOKEN;
+}
+
+void create_id_token(token_vector &tokens, boost::string_view s)
+{
+    TokenType t = get_keyword_token(s);
+    if (t == INVALID_TOKEN)
+    {
+        // Create key path token.
+        tokens.emplace_back(KEY_PATH_TOKEN, s);
+    }
+    else
+    {
+        tokens.emplace_back(t);
+    }
+}
+
+int append_string_escape(std::string &str, std::function<char(unsigned)> peek)
+{
+    char esc = peek(1);
+    std::string hex;
+    int n = 2;
+    switch (esc)
+    {
+        // standard C escape sequences
+        case 'a':
+            esc = '\a';
+            break;
+        case 'b':
+            esc = '\b';
+            break;
+        case 'f':
+            esc = '\f';
+            break;
+        case 'n':
+            esc = '\n';
+            break;
+        case 'r':
+            esc = '\r';
+            break;
+        case 't':
+            esc = '\t';
+            break;
+        case 'v':
+            esc = '\v';
+            break;
+        case '0':
+            esc = '\0';
+            break;
+        // handle hex escapes like \x2a
+        case 'x':
+            for (; std::isxdigit(peek(n)); ++n)
+            {
+                hex += peek(n);
+            }
+            esc = static_cast<char>(hex.empty() ? 0 : std::strtoul(hex.c_str(), nullptr, 16));
+            break;
+    }
+    str += esc;
+    return n - 1;
+}
+
+token_vector tokenize_statement(boost::string_view text)
+{
+    token_vector tokens;
+    lexer_state_t state = INIT_STATE;
+    unsigned i = 0;
+    uint32_t pos = 0;
+    char str_open_quote = 0;
+    std::string literal;
+    bool is_hex_literal = false;
+    bool has_escape = false;
+
+    // closure to get the next char without advancing
+    auto peek = [&](unsigned n)
+    {
+        return i + n < text.size() ? text[i + n] : 0;
+    };
+
+    for (; i < text.size(); ++i)
+    {
+        char c = text[i];
+
+        switch (state)
+        {
+            case INIT_STATE:
+                // Skip any whitespace
+                if (isspace(c))
+                {
+                    continue;
+                }
+                else if (isdigit(c))
+                {
+                    pos = i;
+                    if (c == '0' && peek(1) == 'x')
+                    {
+                        is_hex_literal = true;
+                        ++i;
+                    }
+                    else
+                    {
+                        is_hex_literal = false;
+                    }
+                    state = INT_LITERAL_STATE;
+                }
+                else if (is_key_path_char(c))
+                {
+                    pos = i;
+                    state = KEY_PATH_STATE;
+                }
+                else if (c == '(' || c == ')' || c == ',' || c == '+' || c == '*' || c == '/' || c == '%')
+                {
+                    tokens.emplace_back(static_cast<TokenType>(c));
                 }
                 else if (c == '\"' || c == '\'')
                 {
                     str_open_quote = c;
-                    literal.clear();
+                    pos = i + 1;
+                    has_escape = false;
                     state = STRING_LITERAL_STATE;
                 }
                 else if (c == '=')
@@ -974,1136 +2892,2499 @@ token_vector tokenize_statement(const std::string &text)
                 }
                 else if (c == '&')
                 {
-                    if (peek(1) == '&')
-                    {
-                        tokens.emplace_back(AND_TOKEN);
-                        ++i;
-                    }
-                    else
+                    if (peek(1) == '&')
+                    {
+                        tokens.emplace_back(AND_TOKEN);
+                        ++i;
+                    }
+                    else
+                    {
+                        tokens.emplace_back(CONCAT_TOKEN);
+                    }
+                }
+                else if (c == '|' && peek(1) == '|')
+                {
+                    tokens.emplace_back(OR_TOKEN);
+                    ++i;
+                }
+                else if (c == '-')
+                {
+                    if (peek(1) == '-')
+                    {
+                        state = COMMENT_STATE;
+                    }
+                    else
+                    {
+                        tokens.emplace_back(MINUS_TOKEN);
+                    }
+                }
+                else
+                {
+                    std::string msg = "unexpected character '";
+                    msg += c;
+                    msg += "'";
+                    throw TemplateException(msg);
+                }
+                break;
+
+            case KEY_PATH_STATE:
+                if (!is_key_path_char(c))
+                {
+                    create_id_token(tokens, text.substr(pos, i - pos));
+
+                    // Reprocess this char in the initial state.
+                    state = INIT_STATE;
+                    --i;
+                }
+                break;
+
+            case STRING_LITERAL_STATE:
+                if (c == str_open_quote)
+                {
+                    // Create the string literal token and return to init state. Only a
+                    // literal with escapes needs its own copy of the value.
+                    if (has_escape)
+                    {
+                        tokens.emplace_back(STRING_LITERAL_TOKEN, std::move(literal));
+                        literal.clear();
+                    }
+                    else
+                    {
+                        tokens.emplace_back(STRING_LITERAL_TOKEN, text.substr(pos, i - pos));
+                    }
+                    state = INIT_STATE;
+                }
+                else if (c == '\\')
+                {
+                    if (!has_escape)
+                    {
+                        literal.assign(text.data() + pos, i - pos);
+                        has_escape = true;
+                    }
+                    i += append_string_escape(literal, peek);
+                }
+                else if (has_escape)
+                {
+                    literal += c;
+                }
+                break;
+
+            case INT_LITERAL_STATE:
+                if (!(is_hex_literal ? isxdigit(c) : isdigit(c)))
+                {
+                    tokens.emplace_back(INT_LITERAL_TOKEN, text.substr(pos, i - pos));
+                    state = INIT_STATE;
+                    --i;
+                }
+                break;
+
+            case COMMENT_STATE:
+                if (c == '\n')
+                {
+                    state = INIT_STATE;
+                }
+                break;
+        }
+    }
+
+    // Handle a key path terminated by end of string.
+    if (state == KEY_PATH_STATE)
+    {
+        create_id_token(tokens, text.substr(pos, i - pos));
+    }
+    else if (state == STRING_LITERAL_STATE)
+    {
+        throw TemplateException("unterminated string literal");
+    }
+    else if (state == INT_LITERAL_STATE)
+    {
+        tokens.emplace_back(INT_LITERAL_TOKEN, text.substr(pos, i - pos));
+    }
+
+    return tokens;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Expr parser
+//////////////////////////////////////////////////////////////////////////
+
+// Expression grammar
+//
+// expr         ::= oterm [ "if" oterm "else" oterm ]
+// oterm        ::= bterm ( "or" bterm )*
+// bterm        ::= bfactor ( "and" bfactor )*
+// bfactor      ::= gfactor [ ( "==" | "!=" ) gfactor ]
+// gfactor      ::= afactor [ ( ">" | ">=" | "<" | "<=" ) afactor ]
+// afactor      ::= mfactor [ ( "&" | "+" | "-" ) afactor ]
+// mfactor      ::= factor [ ( "*" | "/" | "%" ) mfactor ]
+// factor       ::= "not" expr
+//              |   "-" expr
+//              |   "(" expr ")"
+//              |   ( "true" | "false" )
+//              |   KEY_PATH [ args ]
+//              |   INT
+// args         ::= "(" [ expr ( "," expr )* ")"
+
+struct FunctionDef
+{
+    FunctionType fn;
+    const char *name;
+    size_t param_count;
+};
+
+const FunctionDef k_functions[] = { { COUNT_FN, "count", 1 },       { EMPTY_FN, "empty", 1 }, { DEFINED_FN, "defined", 1 },
+                                    { ADD_INDENT_FN, "addIndent", 2 }, { INT_FN, "int", 1 },     { STR_FN, "str", 1 },
+                                    { UPPER_FN, "upper", 1 },       { LOWER_FN, "lower", 1 },  { COUNT_FN, nullptr, 0 } };
+
+expr_ptr ExprParser::parse_factor()
+{
+    TokenType tokType = m_tok->get_type();
+    expr_ptr result;
+    switch (tokType)
+    {
+        case NOT_TOKEN:
+        case MINUS_TOKEN:
+            m_tok.next();
+            result.reset(new ExprUnary(tokType, parse_expr()));
+            break;
+        case OPEN_PAREN_TOKEN:
+            m_tok.next();
+            result = parse_expr();
+            m_tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
+            break;
+        case STRING_LITERAL_TOKEN:
+            result.reset(new ExprLiteral(m_tok.match(STRING_LITERAL_TOKEN)->get_value().to_string()));
+            break;
+        case TRUE_TOKEN:
+            m_tok.next();
+            result.reset(new ExprLiteral(true));
+            break;
+        case FALSE_TOKEN:
+            m_tok.next();
+            result.reset(new ExprLiteral(false));
+            break;
+        case INT_LITERAL_TOKEN:
+        {
+            const Token *literal = m_tok.match(INT_LITERAL_TOKEN, "expected int literal");
+            result.reset(new ExprLiteral(make_data((int)std::strtol(literal->get_value().to_string().c_str(), NULL, 0))));
+            break;
+        }
+        case KEY_PATH_TOKEN:
+            result = parse_key_path(m_tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string());
+            break;
+        default:
+            throw TemplateException("syntax error");
+    }
+    return result;
+}
+
+expr_ptr ExprParser::parse_key_path(const std::string &path)
+{
+    expr_vector args;
+    if (m_tok->get_type() == OPEN_PAREN_TOKEN)
+    {
+        m_tok.match(OPEN_PAREN_TOKEN);
+
+        while (m_tok->get_type() != CLOSE_PAREN_TOKEN)
+        {
+            args.push_back(parse_expr());
+
+            if (m_tok->get_type() != CLOSE_PAREN_TOKEN)
+            {
+                m_tok.match(COMMA_TOKEN, "expected comma");
+            }
+        }
+        m_tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
+    }
+
+    // Check if this is a pseudo function.
+    for (const FunctionDef *f = k_functions; f->name; ++f)
+    {
+        if (path == f->name)
+        {
+            if (args.size() != f->param_count)
+            {
+                throw TemplateException("function " + path + " requires " +
+                                        boost::lexical_cast<std::string>(f->param_count) +
+                                        (f->param_count == 1 ? " parameter" : " parameters"));
+            }
+            return expr_ptr(new ExprFunction(f->fn, std::move(args)));
+        }
+    }
+
+    return expr_ptr(new ExprKeyPath(path, std::move(args)));
+}
+
+expr_ptr ExprParser::parse_bfactor()
+{
+    expr_ptr ldata = parse_gfactor();
+
+    TokenType tokType = m_tok->get_type();
+    if (tokType == EQ_TOKEN || tokType == NEQ_TOKEN)
+    {
+        m_tok.next();
+
+        expr_ptr rdata = parse_gfactor();
+        ldata.reset(new ExprBinary(tokType, std::move(ldata), std::move(rdata)));
+    }
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_gfactor()
+{
+    expr_ptr ldata = parse_afactor();
+
+    TokenType tokType = m_tok->get_type();
+    if (tokType == GT_TOKEN || tokType == GE_TOKEN || tokType == LT_TOKEN || tokType == LE_TOKEN)
+    {
+        m_tok.next();
+
+        expr_ptr rdata = parse_afactor();
+        ldata.reset(new ExprBinary(tokType, std::move(ldata), std::move(rdata)));
+    }
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_afactor()
+{
+    expr_ptr ldata = parse_mfactor();
+
+    TokenType tokType = m_tok->get_type();
+    if (tokType == PLUS_TOKEN || tokType == MINUS_TOKEN || tokType == CONCAT_TOKEN)
+    {
+        m_tok.next();
+
+        expr_ptr rdata = parse_afactor();
+        ldata.reset(new ExprBinary(tokType, std::move(ldata), std::move(rdata)));
+    }
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_mfactor()
+{
+    expr_ptr ldata = parse_factor();
+
+    TokenType tokType = m_tok->get_type();
+    if (tokType == TIMES_TOKEN || tokType == DIVIDE_TOKEN || tokType == MOD_TOKEN)
+    {
+        m_tok.next();
+
+        expr_ptr rdata = parse_mfactor();
+        ldata.reset(new ExprBinary(tokType, std::move(ldata), std::move(rdata)));
+    }
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_bterm()
+{
+    expr_ptr ldata = parse_bfactor();
+
+    while (m_tok->get_type() == AND_TOKEN)
+    {
+        m_tok.match(AND_TOKEN);
+
+        expr_ptr rdata = parse_bfactor();
+        ldata.reset(new ExprBinary(AND_TOKEN, std::move(ldata), std::move(rdata)));
+    }
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_oterm()
+{
+    expr_ptr ldata = parse_bterm();
+
+    while (m_tok->get_type() == OR_TOKEN)
+    {
+        m_tok.match(OR_TOKEN);
+
+        expr_ptr rdata = parse_bterm();
+        ldata.reset(new ExprBinary(OR_TOKEN, std::move(ldata), std::move(rdata)));
+    }
+
+    return ldata;
+}
+
+expr_ptr ExprParser::parse_expr()
+{
+    expr_ptr ldata = parse_oterm();
+
+    if (m_tok->get_type() == IF_TOKEN)
+    {
+        m_tok.match(IF_TOKEN);
+        expr_ptr predicate = parse_oterm();
+        m_tok.match(ELSE_TOKEN);
+        expr_ptr rdata = parse_oterm();
+
+        ldata.reset(new ExprInlineIf(std::move(ldata), std::move(predicate), std::move(rdata)));
+    }
+
+    return ldata;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Expr classes
+//////////////////////////////////////////////////////////////////////////
+
+// ExprLiteral
+data_ptr ExprLiteral::eval(data_map &, RenderContext &)
+{
+    return m_value;
+}
+
+// ExprKeyPath
+// Expr
+bool write_value(OutputSink &sink, const data_ptr &value, RenderContext &context)
+{
+    std::string buffer;
+    boost::string_view str = value.getview(buffer);
+
+#if __CYGWIN__ || _WIN32
+    buffer = str.to_string();
+    normalize_eol(buffer);
+    str = buffer;
+#endif
+
+    sink.write(str.data(), str.size());
+    context.output_size += str.size();
+    return !str.empty();
+}
+
+bool Expr::write(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    return write_value(sink, eval(data, context), context);
+}
+
+// ExprKeyPath
+// Arguments to pass to a subtemplate. A call without any still passes a pointer, as
+// with DataTemplate::eval(), so the subtemplate gets its own params map for set to write.
+static const data_ptr *call_args(const temp_list &params)
+{
+    static const data_ptr s_no_args;
+    return params.empty() ? &s_no_args : params.data();
+}
+
+data_ptr ExprKeyPath::eval(data_map &data, RenderContext &context)
+{
+    ArenaScope scope(context.arena);
+    temp_list params(ArenaAllocator<data_ptr>(context.arena));
+    params.reserve(m_args.size());
+    for (auto &arg : m_args)
+    {
+        params.push_back(arg->eval(data, context));
+    }
+
+    // Return an empty string for invalid key so it will eval to false.
+    data_ptr result;
+    if (!data.try_lookup_path(m_path, result, &context.lookups))
+    {
+        return "";
+    }
+
+    // Handle subtemplates.
+    if (result.is_template())
+    {
+        if (context.parallel_chunk)
+        {
+            throw SubtemplateInParallelLoop();
+        }
+        try
+        {
+            ProfileScope profile(context, this, "call", 0, m_path.str().c_str());
+            DataTemplate *tmpl = static_cast<DataTemplate *>(result.raw());
+            result = tmpl->eval(data, call_args(params), params.size(), context);
+        }
+        catch (data_map::key_error &)
+        {
+            return "";
+        }
+    }
+
+    return result;
+}
+
+// A subtemplate renders directly into the sink rather than into a string first.
+bool ExprKeyPath::write(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    ArenaScope scope(context.arena);
+    temp_list params(ArenaAllocator<data_ptr>(context.arena));
+    params.reserve(m_args.size());
+    for (auto &arg : m_args)
+    {
+        params.push_back(arg->eval(data, context));
+    }
+
+    data_ptr value;
+    if (!data.try_lookup_path(m_path, value, &context.lookups))
+    {
+        return false;
+    }
+    if (!value.is_template())
+    {
+        return write_value(sink, value, context);
+    }
+
+    // A subtemplate that may stop partway through is rendered into a buffer first, so
+    // that it writes nothing if it does, just as when it is evaluated to a string.
+    if (context.parallel_chunk)
+    {
+        throw SubtemplateInParallelLoop();
+    }
+    DataTemplate *tmpl = static_cast<DataTemplate *>(value.raw());
+    size_t start_size = context.output_size;
+    std::string buffer;
+    try
+    {
+        ProfileScope profile(context, this, "call", 0, m_path.str().c_str());
+        if (!tmpl->m_may_stop)
+        {
+            tmpl->eval(sink, data, call_args(params), params.size(), context);
+            return context.output_size != start_size;
+        }
+        StringSink buffer_sink(buffer);
+        tmpl->eval(buffer_sink, data, call_args(params), params.size(), context);
+    }
+    catch (data_map::key_error &)
+    {
+        context.output_size = start_size;
+        return false;
+    }
+    sink.write(buffer);
+    return !buffer.empty();
+}
+
+// ExprFunction
+data_ptr ExprFunction::eval(data_map &data, RenderContext &context)
+{
+    ArenaScope scope(context.arena);
+    temp_list params(ArenaAllocator<data_ptr>(context.arena));
+    params.reserve(m_args.size());
+    for (auto &arg : m_args)
+    {
+        params.push_back(arg->eval(data, context));
+    }
+
+    data_ptr result;
+    switch (m_fn)
+    {
+        case COUNT_FN:
+            result = params[0]->getlist().size();
+            break;
+        case EMPTY_FN:
+            result = params[0]->empty();
+            break;
+        case DEFINED_FN:
+            // TODO: handle undefined case for defined fn
+            result = true;
+            break;
+        case ADD_INDENT_FN:
+        {
+            std::stringstream ss(params[1]->getvalue());
+            if (!ss.eof())
+            {
+                std::string line;
+                std::string resultValue;
+                int c = 0;
+                while (std::getline(ss, line))
+                {
+                    ++c;
+                    if (c > 1)
                     {
-                        tokens.emplace_back(CONCAT_TOKEN);
+                        resultValue += '\n';
                     }
+                    resultValue += params[0]->getvalue() + line;
                 }
-                else if (c == '|' && peek(1) == '|')
-                {
-                    tokens.emplace_back(OR_TOKEN);
-                    ++i;
-                }
-                else if (c == '-')
+                result = resultValue;
+            }
+            break;
+        }
+        case INT_FN:
+            result = params[0]->getint();
+            break;
+        case STR_FN:
+            result = params[0]->getvalue();
+            break;
+        case UPPER_FN:
+        {
+            std::string s = params[0]->getvalue();
+            std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
+                           {
+                               return std::toupper(c);
+                           });
+            result = s;
+            break;
+        }
+        case LOWER_FN:
+        {
+            std::string s = params[0]->getvalue();
+            std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
+                           {
+                               return std::tolower(c);
+                           });
+            result = s;
+            break;
+        }
+    }
+    return result;
+}
+
+// ExprUnary
+data_ptr ExprUnary::eval(data_map &data, RenderContext &context)
+{
+    data_ptr value = m_expr->eval(data, context);
+    if (m_op == NOT_TOKEN)
+    {
+        return value->empty();
+    }
+    return -(value->getint());
+}
+
+// ExprBinary
+data_ptr ExprBinary::eval(data_map &data, RenderContext &context)
+{
+    data_ptr ldata = m_left->eval(data, context);
+
+    // "and" and "or" only evaluate the right operand if it decides the result.
+    switch (m_op)
+    {
+        case AND_TOKEN:
+            return !ldata->empty() && !m_right->eval(data, context)->empty();
+        case OR_TOKEN:
+            return ldata->empty() ? m_right->eval(data, context) : ldata;
+        default:
+            break;
+    }
+
+    data_ptr rdata = m_right->eval(data, context);
+
+    // Strings are compared and concatenated in place rather than copied out first.
+    std::string lbuffer;
+    std::string rbuffer;
+    switch (m_op)
+    {
+        case EQ_TOKEN:
+            return ldata.getview(lbuffer) == rdata.getview(rbuffer);
+        case NEQ_TOKEN:
+            return ldata.getview(lbuffer) != rdata.getview(rbuffer);
+        case GT_TOKEN:
+        case GE_TOKEN:
+        case LT_TOKEN:
+        case LE_TOKEN:
+        {
+            if (ldata.kind() == data_ptr::INT && rdata.kind() == data_ptr::INT)
+            {
+                int l = ldata->getint();
+                int r = rdata->getint();
+                switch (m_op)
                 {
-                    if (peek(1) == '-')
-                    {
-                        state = COMMENT_STATE;
-                    }
-                    else
-                    {
-                        tokens.emplace_back(MINUS_TOKEN);
-                    }
+                    case GT_TOKEN:
+                        return (l > r);
+                    case GE_TOKEN:
+                        return (l >= r);
+                    case LT_TOKEN:
+                        return (l < r);
+                    default:
+                        return (l <= r);
                 }
-                else
+            }
+            else
+            {
+                boost::string_view lhs = ldata.getview(lbuffer);
+                boost::string_view rhs = rdata.getview(rbuffer);
+                switch (m_op)
                 {
-                    literal = "unexpected character '";
-                    literal += c;
-                    literal += "'";
-                    throw TemplateException(literal);
+                    case GT_TOKEN:
+                        return (lhs > rhs);
+                    case GE_TOKEN:
+                        return (lhs >= rhs);
+                    case LT_TOKEN:
+                        return (lhs < rhs);
+                    default:
+                        return (lhs <= rhs);
                 }
-                break;
+            }
+        }
+        case CONCAT_TOKEN:
+        {
+            boost::string_view lhs = ldata.getview(lbuffer);
+            boost::string_view rhs = rdata.getview(rbuffer);
+            std::string result;
+            result.reserve(lhs.size() + rhs.size());
+            result.append(lhs.data(), lhs.size()).append(rhs.data(), rhs.size());
+            return data_ptr(std::move(result));
+        }
+        case PLUS_TOKEN:
+            return ldata->getint() + rdata->getint();
+        case MINUS_TOKEN:
+            return ldata->getint() - rdata->getint();
+        case TIMES_TOKEN:
+            return ldata->getint() * rdata->getint();
+        case DIVIDE_TOKEN:
+            return ldata->getint() / rdata->getint();
+        case MOD_TOKEN:
+            return ldata->getint() % rdata->getint();
+        default:
+            throw TemplateException("syntax error");
+    }
+}
+
+bool ExprBinary::write(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    if (m_op != OR_TOKEN)
+    {
+        return Expr::write(sink, data, context);
+    }
+
+    data_ptr ldata = m_left->eval(data, context);
+    if (ldata->empty())
+    {
+        return m_right->write(sink, data, context);
+    }
+    return write_value(sink, ldata, context);
+}
+
+// ExprInlineIf
+data_ptr ExprInlineIf::eval(data_map &data, RenderContext &context)
+{
+    // Only the selected arm is evaluated.
+    if (m_predicate->eval(data, context)->empty())
+    {
+        return m_else->eval(data, context);
+    }
+    return m_value->eval(data, context);
+}
+
+bool ExprInlineIf::write(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    if (m_predicate->eval(data, context)->empty())
+    {
+        return m_else->write(sink, data, context);
+    }
+    return m_value->write(sink, data, context);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Node classes
+//////////////////////////////////////////////////////////////////////////
+
+// defaults, overridden by subclasses with children
+void Node::set_children(node_vector &)
+{
+    throw TemplateException(get_line(), "This node type cannot have children");
+}
+
+node_vector &Node::get_children()
+{
+    throw TemplateException(get_line(), "This node type cannot have children");
+}
+
+// NodeText
+NodeType NodeText::gettype()
+{
+    return NODE_TYPE_TEXT;
+}
+
+#if __CYGWIN__ || _WIN32
+void normalize_eol(std::string &str)
+{
+    std::string str2 = "";
+    for (int i = 0; i < str.size(); i++)
+    {
+        if (str[i] == '\n')
+        {
+            str2 += "\r\n";
+        }
+        else if (str[i] != '\r')
+        {
+            str2 += str[i];
+        }
+    }
+    str = str2;
+}
+#endif
 
-            case KEY_PATH_STATE:
-                if (!is_key_path_char(c))
-                {
-                    create_id_token(tokens, text.substr(pos, i - pos));
+void NodeText::gettext(OutputSink &sink, data_map &, RenderContext &context)
+{
+    boost::string_view text = m_text;
+    if (context.remove_newline && !text.empty() && text[0] == '\n')
+    {
+        text.remove_prefix(1);
+    }
+    context.remove_newline = false;
 
-                    // Reprocess this char in the initial state.
-                    state = INIT_STATE;
-                    --i;
-                }
-                break;
+#if __CYGWIN__ || _WIN32
+    std::string str = text.to_string();
+    normalize_eol(str);
+    sink.write(str.data(), str.size());
+#else
+    sink.write_static(text.data(), text.size());
+#endif
+    context.output_size += text.size();
+}
 
-            case STRING_LITERAL_STATE:
-                if (c == str_open_quote)
-                {
-                    // Create the string literal token and return to init state.
-                    tokens.emplace_back(STRING_LITERAL_TOKEN, literal);
-                    state = INIT_STATE;
-                }
-                else if (c == '\\')
-                {
-                    i += append_string_escape(literal, peek);
-                }
-                else
-                {
-                    literal += c;
-                }
-                break;
+// NodeVar
+NodeVar::NodeVar(const token_vector &expr, uint32_t line, bool removeNewLine)
+: Node(line)
+, m_removeNewLine(removeNewLine)
+{
+    TokenIterator it(expr);
+    m_expr = ExprParser(it).parse_expr();
+}
 
-            case INT_LITERAL_STATE:
-                if (is_hex_literal ? isxdigit(c) : isdigit(c))
-                {
-                    literal += c;
-                }
-                else
-                {
-                    tokens.emplace_back(INT_LITERAL_TOKEN, literal);
-                    state = INIT_STATE;
-                    --i;
-                }
-                break;
+NodeType NodeVar::gettype()
+{
+    return NODE_TYPE_VAR;
+}
 
-            case COMMENT_STATE:
-                if (c == '\n')
+void NodeVar::gettext(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    try
+    {
+        if (!m_expr->write(sink, data, context) && m_removeNewLine)
+        {
+            context.remove_newline = true;
+        }
+    }
+    catch (TemplateException &e)
+    {
+        e.set_line_if_missing(get_line());
+        throw;
+    }
+}
+
+// NodeVar
+void NodeParent::set_children(node_vector &children)
+{
+    m_children.assign(children.begin(), children.end());
+}
+
+node_vector &NodeParent::get_children()
+{
+    return m_children;
+}
+
+// NodeFor
+NodeFor::NodeFor(const token_vector &tokens, bool is_top, uint32_t line)
+: NodeParent(line)
+, m_is_top(is_top)
+, m_calls_subtemplate(false)
+{
+    TokenIterator tok(tokens);
+    tok.match(FOR_TOKEN, "expected 'for'");
+    m_val = tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string();
+    tok.match(IN_TOKEN, "expected 'in'");
+    m_key = KeyPath(tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string());
+    if (tok->get_type() != END_TOKEN)
+    {
+        tok.match(IF_TOKEN, "expected 'if'");
+        m_predicate = ExprParser(tok).parse_expr();
+    }
+    else
+    {
+        tok.match(END_TOKEN, "expected end of statement");
+    }
+}
+
+NodeType NodeFor::gettype()
+{
+    return NODE_TYPE_FOR;
+}
+
+void NodeFor::gettext(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    ArenaScope scope(context.arena);
+    try
+    {
+        // If the list's key doesn't exist, the loop doesn't execute at all.
+        LoopState state;
+        if (!begin_loop(data, state, context) || render_parallel(sink, data, state, context))
+        {
+            return;
+        }
+        while (next_iteration(data, state))
+        {
+            for (size_t j = 0; j < m_children.size(); ++j)
+            {
+                render_node(m_children[j].get(), sink, data, context);
+            }
+            ++state.index;
+        }
+        end_loop(data, state, context);
+    }
+    catch (data_map::key_error &)
+    {
+        // ignore exception - a key path in the loop body couldn't be created, so end
+        // the loop
+    }
+    catch (TemplateException &e)
+    {
+        e.set_line_if_missing(get_line());
+        throw;
+    }
+}
+
+// Look up the list and apply the filter predicate. Returns false if the list's key
+// path doesn't exist.
+bool NodeFor::begin_loop(data_map &data, LoopState &state, RenderContext &context)
+{
+    data_ptr *list = data.find_path(m_key, &context.lookups);
+    if (!list)
+    {
+        return false;
+    }
+    state.value = *list;
+    if (!m_is_top)
+    {
+        state.saved_loop = data["loop"];
+    }
+    data_list &items = state.value->getlist();
+    state.items = items.data();
+    state.count = items.size();
+    state.loop_slot = &data["loop"];
+    state.item_slot = &data[m_val];
+    state.arena_mark = context.arena.mark();
+    if (m_predicate)
+    {
+        state.filtered = static_cast<uint32_t *>(context.arena.allocate(items.size() * sizeof(uint32_t)));
+        state.count = 0;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            *state.loop_slot = data_ptr::make_loop(i, items.size());
+            *state.item_slot = items[i];
+            if (!m_predicate->eval(data, context)->empty())
+            {
+                state.filtered[state.count++] = static_cast<uint32_t>(i);
+            }
+        }
+    }
+    state.index = 0;
+    return true;
+}
+
+// Whether rendering @a node may assign to the data, through set or def statements.
+static bool writes_data(Node *node);
+
+static bool writes_data(const node_vector &nodes)
+{
+    for (const node_ptr &node : nodes)
+    {
+        if (writes_data(node.get()))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool writes_data(Node *node)
+{
+    switch (node->gettype())
+    {
+        case NODE_TYPE_SET:
+        case NODE_TYPE_DEF:
+            return true;
+
+        case NODE_TYPE_IF:
+        case NODE_TYPE_ELIF:
+        case NODE_TYPE_ELSE:
+        {
+            NodeIf *branch = static_cast<NodeIf *>(node);
+            return writes_data(branch->get_children())
+                || (branch->get_else_if() && writes_data(branch->get_else_if().get()));
+        }
+
+        case NODE_TYPE_FOR:
+            return writes_data(node->get_children());
+
+        default:
+            return false;
+    }
+}
+
+// Whether rendering @a nodes may end early by throwing data_map::key_error. That happens
+// when a set or def assigns through a missing key outside of any for loop, which would
+// otherwise catch it and just end the loop.
+static bool may_stop_on_key_error(Node *node)
+{
+    switch (node->gettype())
+    {
+        case NODE_TYPE_SET:
+        case NODE_TYPE_DEF:
+            return true;
+
+        case NODE_TYPE_IF:
+        case NODE_TYPE_ELIF:
+        case NODE_TYPE_ELSE:
+        {
+            NodeIf *branch = static_cast<NodeIf *>(node);
+            return may_stop_on_key_error(branch->get_children())
+                || (branch->get_else_if() && may_stop_on_key_error(branch->get_else_if().get()));
+        }
+
+        default:
+            return false;
+    }
+}
+
+bool may_stop_on_key_error(const node_vector &nodes)
+{
+    for (const node_ptr &node : nodes)
+    {
+        if (may_stop_on_key_error(node.get()))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Renders the remaining iterations of a started loop on the render's thread pool, then
+// ends the loop. Returns false without having written anything if the loop has to run
+// serially: there is no pool, the loop is too small, or its body may assign to the
+// data, which later iterations could depend on. The body assigns through set and def
+// statements, and possibly through any subtemplate it calls. Whether an expression
+// calls a subtemplate is only known once it is evaluated, so a chunk that is about to
+// call one gives up, and the loop is then rendered serially from the start. This is
+// remembered, and later renders of the loop don't try the pool again, even if the
+// value called is no longer a subtemplate.
+//
+// The iterations are split into chunks, each rendered into its own buffer with its own
+// context. The loop variables are set in a map per chunk whose parent, the render's
+// data, is only read. The buffers are then written out in order.
+bool NodeFor::render_parallel(OutputSink &sink, data_map &data, LoopState &state, RenderContext &context)
+{
+    const size_t k_min_chunk_items = 64;
+    if (!context.pool || !context.pool->size() || context.profiler || state.count < context.parallel_min_items
+        || state.count < 2 * k_min_chunk_items || m_calls_subtemplate.load(std::memory_order_relaxed)
+        || writes_data(m_children))
+    {
+        return false;
+    }
+
+    struct Chunk
+    {
+        size_t begin;
+        size_t end;
+        std::string output;
+        size_t reached;           //!< Iteration that threw the error.
+        bool remove_newline;      //!< Newline flag at the end of the chunk.
+        bool calls_subtemplate;   //!< The chunk gave up on calling a subtemplate.
+        std::exception_ptr error;
+    };
+
+    auto render_chunk = [&](Chunk &chunk, bool remove_newline) {
+        chunk.output.clear();
+        chunk.calls_subtemplate = false;
+        chunk.error = nullptr;
+        StringSink chunk_sink(chunk.output);
+        RenderContext chunk_context;
+        chunk_context.remove_newline = remove_newline;
+        chunk_context.parallel_chunk = true;
+        data_map scope;
+        scope.set_parent(&data, true);
+        data_ptr &loop_slot = scope["loop"];
+        data_ptr &item_slot = scope[m_val];
+        size_t i = chunk.begin;
+        try
+        {
+            for (; i < chunk.end; ++i)
+            {
+                loop_slot = data_ptr::make_loop(i, state.count);
+                item_slot = state.item(i);
+                for (size_t j = 0; j < m_children.size(); ++j)
                 {
-                    state = INIT_STATE;
+                    render_node(m_children[j].get(), chunk_sink, scope, chunk_context);
                 }
-                break;
+            }
+        }
+        catch (SubtemplateInParallelLoop &)
+        {
+            chunk.calls_subtemplate = true;
+        }
+        catch (...)
+        {
+            chunk.error = std::current_exception();
+        }
+        chunk.reached = i;
+        chunk.remove_newline = chunk_context.remove_newline;
+    };
+
+    size_t chunk_count = std::min(state.count / k_min_chunk_items, (context.pool->size() + 1) * 4);
+    std::vector<Chunk> chunks(chunk_count);
+    for (size_t k = 0; k < chunk_count; ++k)
+    {
+        chunks[k].begin = state.count * k / chunk_count;
+        chunks[k].end = state.count * (k + 1) / chunk_count;
+    }
+    context.pool->parallel_for(chunk_count, [&](size_t k) { render_chunk(chunks[k], false); });
+    for (const Chunk &chunk : chunks)
+    {
+        if (chunk.calls_subtemplate)
+        {
+            m_calls_subtemplate.store(true, std::memory_order_relaxed);
+            return false;
+        }
+    }
+
+    // Each chunk was rendered as if the newline flag was clear at its start. The rare
+    // chunk that follows one ending with the flag set is rendered again.
+    for (Chunk &chunk : chunks)
+    {
+        if (context.remove_newline)
+        {
+            render_chunk(chunk, true);
+        }
+        sink.write(chunk.output.data(), chunk.output.size());
+        context.output_size += chunk.output.size();
+        context.remove_newline = chunk.remove_newline;
+        if (chunk.error)
+        {
+            // Leave the loop variables as a serial loop stopping at the error would.
+            state.index = chunk.reached;
+            next_iteration(data, state);
+            std::rethrow_exception(chunk.error);
+        }
+    }
+
+    // As after a serial loop, the loop variables hold the last iteration's values.
+    state.index = state.count - 1;
+    next_iteration(data, state);
+    end_loop(data, state, context);
+    return true;
+}
+
+// Set the loop variables for the current index. Returns false once all items have
+// been visited.
+bool NodeFor::next_iteration(data_map &, LoopState &state)
+{
+    if (state.index >= state.count)
+    {
+        return false;
+    }
+    *state.loop_slot = data_ptr::make_loop(state.index, state.count);
+    *state.item_slot = state.item();
+    return true;
+}
+
+void NodeFor::end_loop(data_map &data, LoopState &state, RenderContext &context)
+{
+    if (!m_is_top)
+    {
+        data["loop"] = state.saved_loop;
+    }
+    context.arena.rewind(state.arena_mark);
+}
+
+// NodeIf
+NodeIf::NodeIf(const token_vector &expr, uint32_t line)
+: NodeParent(line)
+, m_expr()
+, m_else_if(nullptr)
+, m_if_type(NODE_TYPE_IF)
+{
+    TokenIterator it(expr);
+    if (it->get_type() == ELIF_TOKEN)
+    {
+        m_if_type = NODE_TYPE_ELIF;
+        it.match(ELIF_TOKEN, "expected 'elif' keyword");
+    }
+    else if (it->get_type() == ELSE_TOKEN)
+    {
+        // An else has no expression and is always true.
+        m_if_type = NODE_TYPE_ELSE;
+        it.match(ELSE_TOKEN, "expected 'else' keyword");
+        it.match(END_TOKEN, "expected end of statement");
+        return;
+    }
+    else
+    {
+        it.match(IF_TOKEN, "expected 'if' keyword");
+    }
+    m_expr = ExprParser(it).parse_expr();
+    it.match(END_TOKEN, "expected end of statement");
+}
+
+NodeType NodeIf::gettype()
+{
+    return m_if_type;
+}
+
+void NodeIf::set_else_if(node_ptr else_if)
+{
+    m_else_if = else_if;
+}
+
+void NodeIf::gettext(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    if (is_true(data, context))
+    {
+        for (size_t j = 0; j < m_children.size(); ++j)
+        {
+            render_node(m_children[j].get(), sink, data, context);
         }
     }
+    else if (m_else_if)
+    {
+        m_else_if->gettext(sink, data, context);
+    }
+}
 
-    // Handle a key path terminated by end of string.
-    if (state == KEY_PATH_STATE)
+bool NodeIf::is_true(data_map &data, RenderContext &context)
+{
+    if (!m_expr)
     {
-        create_id_token(tokens, text.substr(pos, i - pos));
+        return true;
     }
-    else if (state == STRING_LITERAL_STATE)
+
+    try
     {
-        throw TemplateException("unterminated string literal");
+        return !m_expr->eval(data, context)->empty();
     }
-    else if (state == INT_LITERAL_STATE)
+    catch (TemplateException &e)
     {
-        tokens.emplace_back(INT_LITERAL_TOKEN, literal);
+        e.set_line_if_missing(get_line());
+        throw;
     }
+}
 
-    return tokens;
+bool NodeIf::is_else()
+{
+    return m_if_type == NODE_TYPE_ELSE;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// Expr parser
-//////////////////////////////////////////////////////////////////////////
+// NodeDef
+NodeDef::NodeDef(const token_vector &expr, uint32_t line)
+: NodeParent(line)
+{
+    TokenIterator tok(expr);
+    tok.match(DEF_TOKEN, "expected 'def'");
 
-// Expression grammar
-//
-// expr         ::= oterm [ "if" oterm "else" oterm ]
-// oterm        ::= bterm ( "or" bterm )*
-// bterm        ::= bfactor ( "and" bfactor )*
-// bfactor      ::= gfactor [ ( "==" | "!=" ) gfactor ]
-// gfactor      ::= afactor [ ( ">" | ">=" | "<" | "<=" ) afactor ]
-// afactor      ::= mfactor [ ( "&" | "+" | "-" ) afactor ]
-// mfactor      ::= factor [ ( "*" | "/" | "%" ) mfactor ]
-// factor       ::= "not" expr
-//              |   "-" expr
-//              |   "(" expr ")"
-//              |   ( "true" | "false" )
-//              |   KEY_PATH [ args ]
-//              |   INT
-// args         ::= "(" [ expr ( "," expr )* ")"
+    m_name = KeyPath(tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string());
 
-data_ptr ExprParser::get_var_value(const std::string &path, data_list &params)
-{
-    // Check if this is a pseudo function.
-    bool is_fn = false;
-    if (path == "count" || path == "empty" || path == "defined" || path == "addIndent" || path == "int" ||
-        path == "str" || path == "upper" || path == "lower")
+    if (tok->get_type() == OPEN_PAREN_TOKEN)
     {
-        is_fn = true;
-    }
+        tok.match(OPEN_PAREN_TOKEN);
 
-    try
-    {
-        data_ptr result;
-        if (is_fn)
+        while (tok->get_type() != CLOSE_PAREN_TOKEN)
         {
-            if (params.size() != 1 && path != "addIndent")
-            {
-                throw TemplateException("function " + path + " requires 1 parameter");
-            }
-            else if (params.size() != 2 && path == "addIndent")
-            {
-                throw TemplateException("function " + path + " requires 2 parameters");
-            }
+            m_params.push_back(tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string());
 
-            if (path == "count")
-            {
-                result = params[0]->getlist().size();
-            }
-            else if (path == "empty")
-            {
-                result = params[0]->empty();
-            }
-            else if (path == "defined")
-            {
-                // TODO: handle undefined case for defined fn
-                result = true;
-            }
-            else if (path == "addIndent")
-            {
-                std::stringstream ss(params[1]->getvalue());
-                if (!ss.eof())
-                {
-                    std::string line;
-                    std::string resultValue;
-                    int c = 0;
-                    while (std::getline(ss, line))
-                    {
-                        ++c;
-                        if (c > 1)
-                        {
-                            resultValue += '\n';
-                        }
-                        resultValue += params[0]->getvalue() + line;
-                    }
-                    result = resultValue;
-                }
-            }
-            else if (path == "int")
-            {
-                result = params[0]->getint();
-            }
-            else if (path == "str")
-            {
-                result = params[0]->getvalue();
-            }
-            else if (path == "upper")
-            {
-                std::string s = params[0]->getvalue();
-                std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
-                               {
-                                   return std::toupper(c);
-                               });
-                result = s;
-            }
-            else if (path == "lower")
+            if (tok->get_type() != CLOSE_PAREN_TOKEN)
             {
-                std::string s = params[0]->getvalue();
-                std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
-                               {
-                                   return std::tolower(c);
-                               });
-                result = s;
+                tok.match(COMMA_TOKEN, "expected comma");
             }
         }
-        else
-        {
-            result = m_data.parse_path(path);
+        tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
+    }
+    tok.match(END_TOKEN, "expected end of statement");
 
-            // Handle subtemplates.
-            if (result.is_template())
-            {
-                std::shared_ptr<Data> tmplData = result.get();
-                DataTemplate *tmpl = dynamic_cast<DataTemplate *>(tmplData.get());
-                assert(tmpl);
-                result = tmpl->eval(m_data, &params);
-            }
-        }
+    // Intern the params once, rather than each time the subtemplate is called.
+    std::vector<SymbolRef> symbols;
+    for (const std::string &param : m_params)
+    {
+        symbols.push_back(SymbolRef(param));
+    }
+    m_param_symbols = std::make_shared<const std::vector<SymbolRef> >(std::move(symbols));
+}
+
+NodeType NodeDef::gettype()
+{
+    return NODE_TYPE_DEF;
+}
+
+void NodeDef::gettext(OutputSink &, data_map &data, RenderContext &context)
+{
+    define(data, program_ptr(), context);
+}
+
+void NodeDef::define(data_map &data, const program_ptr &program, const RenderContext &context)
+{
+    // Follow the key path.
+    data_ptr &target = data.parse_path(m_name, true, context.copy_shared);
+
+    // Set the map entry's value to a newly created template. The nodes were already
+    // parsed and set as our m_children vector. The names of the template's parameters
+    // are set from the param names we parsed in the ctor. If the enclosing template
+    // was compiled, the subtemplate shares the program compiled for our children.
+    DataTemplate *tmpl = new DataTemplate(m_children, program);
+    tmpl->params() = m_params;
+    tmpl->m_param_symbols = m_param_symbols;
+    target = data_ptr(tmpl);
+}
+
+// NodeSet
+NodeSet::NodeSet(const token_vector &expr, uint32_t line)
+: Node(line)
+{
+    TokenIterator tok(expr);
+    tok.match(SET_TOKEN, "expected 'set'");
+    m_path = KeyPath(tok.match(KEY_PATH_TOKEN, "expected key path")->get_value().to_string());
+    tok.match(ASSIGN_TOKEN);
+    m_expr = ExprParser(tok).parse_expr();
+    tok.match(END_TOKEN, "expected end of statement");
+}
+
+NodeType NodeSet::gettype()
+{
+    return NODE_TYPE_SET;
+}
+
+void NodeSet::gettext(OutputSink &, data_map &data, RenderContext &context)
+{
+    data_ptr value = m_expr->eval(data, context);
+
+    // Follow the key path, creating the key if missing.
+    data_ptr &target = data.parse_path(m_path, true, context.copy_shared);
+    target = value;
+}
 
-        return result;
+// Renders a child node, timing it if the render is being profiled. An elif or else
+// renders as part of the if it belongs to.
+void render_node(Node *node, OutputSink &sink, data_map &data, RenderContext &context)
+{
+    if (!context.profiler)
+    {
+        node->gettext(sink, data, context);
+        return;
     }
-    catch (data_map::key_error &)
+    ProfileScope scope(context, node, node_kind_name(node->gettype()), node->get_line());
+    node->gettext(sink, data, context);
+}
+
+const char *node_kind_name(NodeType type)
+{
+    switch (type)
     {
-        // Return an empty string for invalid key so it will eval to false.
-        return "";
+        case NODE_TYPE_TEXT:
+            return "text";
+        case NODE_TYPE_VAR:
+            return "var";
+        case NODE_TYPE_IF:
+            return "if";
+        case NODE_TYPE_ELIF:
+            return "elif";
+        case NODE_TYPE_ELSE:
+            return "else";
+        case NODE_TYPE_FOR:
+            return "for";
+        case NODE_TYPE_DEF:
+            return "def";
+        case NODE_TYPE_SET:
+            return "set";
+        default:
+            return "node";
     }
 }
 
-data_ptr ExprParser::parse_factor()
+//////////////////////////////////////////////////////////////////////////
+// Program
+// flattens a node tree into a linear instruction stream and executes it
+//////////////////////////////////////////////////////////////////////////
+
+Program::Program(const node_vector &tree)
+: m_loop_depth(0)
 {
-    TokenType tokType = m_tok->get_type();
-    data_ptr result;
-    switch (tokType)
+    compile(tree);
+
+    uint32_t depth = 0;
+    for (const Instruction &inst : m_code)
     {
-        case NOT_TOKEN:
-            m_tok.next();
-            result = parse_expr()->empty();
-            break;
-        case MINUS_TOKEN:
-            m_tok.next();
-            result = -(parse_expr()->getint());
-            break;
-        case OPEN_PAREN_TOKEN:
-            m_tok.next();
-            result = parse_expr();
-            m_tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
-            break;
-        case STRING_LITERAL_TOKEN:
-            result = m_tok.match(STRING_LITERAL_TOKEN)->get_value();
-            break;
-        case TRUE_TOKEN:
-            m_tok.next();
-            result = true;
-            break;
-        case FALSE_TOKEN:
-            m_tok.next();
-            result = false;
-            break;
-        case INT_LITERAL_TOKEN:
+        if (inst.op == FOR_BEGIN_OP)
         {
-            const Token *literal = m_tok.match(INT_LITERAL_TOKEN, "expected int literal");
-            return new DataInt((int)std::strtol(literal->get_value().c_str(), NULL, 0));
-            break;
+            m_loop_depth = std::max(m_loop_depth, ++depth);
         }
-        case KEY_PATH_TOKEN:
+        else if (inst.op == FOR_NEXT_OP)
         {
-            const Token *path = m_tok.match(KEY_PATH_TOKEN, "expected key path");
-
-            data_list params;
-            if (m_tok->get_type() == OPEN_PAREN_TOKEN)
-            {
-                m_tok.match(OPEN_PAREN_TOKEN);
-
-                while (m_tok->get_type() != CLOSE_PAREN_TOKEN)
-                {
-                    params.push_back(parse_expr());
-
-                    if (m_tok->get_type() != CLOSE_PAREN_TOKEN)
-                    {
-                        m_tok.match(COMMA_TOKEN, "expected comma");
-                    }
-                }
-                m_tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
-            }
-
-            return get_var_value(path->get_value(), params);
+            --depth;
         }
-        default:
-            throw TemplateException("syntax error");
     }
-    return result;
 }
 
-data_ptr ExprParser::parse_bfactor()
+uint32_t Program::emit(OpCode op, Node *node, uint32_t arg)
 {
-    data_ptr ldata = parse_gfactor();
+    Instruction inst = { op, arg, node };
+    m_code.push_back(inst);
+    return static_cast<uint32_t>(m_code.size() - 1);
+}
 
-    TokenType tokType = m_tok->get_type();
-    if (tokType == EQ_TOKEN || tokType == NEQ_TOKEN)
+void Program::compile(const node_vector &nodes)
+{
+    for (auto &node : nodes)
     {
-        m_tok.next();
+        switch (node->gettype())
+        {
+            case NODE_TYPE_TEXT:
+                emit(TEXT_OP, node.get());
+                break;
 
-        data_ptr rdata = parse_gfactor();
+            case NODE_TYPE_VAR:
+                emit(VAR_OP, node.get());
+                break;
 
-        std::string lhs = ldata->getvalue();
-        std::string rhs = rdata->getvalue();
-        switch (tokType)
-        {
-            case EQ_TOKEN:
-                ldata = (lhs == rhs);
+            case NODE_TYPE_SET:
+                emit(SET_OP, node.get());
                 break;
-            case NEQ_TOKEN:
-                ldata = (lhs != rhs);
+
+            case NODE_TYPE_DEF:
+                // The def body becomes its own program, shared by every subtemplate
+                // instance the def creates.
+                m_defs.push_back(std::make_shared<Program>(node->get_children()));
+                emit(DEF_OP, node.get(), static_cast<uint32_t>(m_defs.size() - 1));
                 break;
-            default:
+
+            case NODE_TYPE_IF:
+                compile_if(static_cast<NodeIf *>(node.get()));
+                break;
+
+            case NODE_TYPE_FOR:
+            {
+                uint32_t begin = emit(FOR_BEGIN_OP, node.get());
+                compile(node->get_children());
+                emit(FOR_NEXT_OP, node.get(), begin + 1);
+                m_code[begin].arg = static_cast<uint32_t>(m_code.size());
                 break;
+            }
+
+            default:
+                throw TemplateException(node->get_line(), "unexpected node type");
         }
     }
-    return ldata;
 }
 
-data_ptr ExprParser::parse_gfactor()
+void Program::compile_if(NodeIf *node)
 {
-    data_ptr ldata = parse_afactor();
-
-    TokenType tokType = m_tok->get_type();
-    if (tokType == GT_TOKEN || tokType == GE_TOKEN || tokType == LT_TOKEN || tokType == LE_TOKEN)
+    // Each if or elif tests its expression and jumps to the next branch when false.
+    // The end of every branch but the last jumps past the rest of the chain.
+    std::vector<uint32_t> exits;
+    for (NodeIf *branch = node; branch; branch = static_cast<NodeIf *>(branch->get_else_if().get()))
     {
-        m_tok.next();
-
-        data_ptr rdata = parse_afactor();
+        bool has_test = !branch->is_else();
+        uint32_t test = has_test ? emit(JUMP_IF_FALSE_OP, branch) : 0;
+        compile(branch->get_children());
+        if (branch->get_else_if())
+        {
+            exits.push_back(emit(JUMP_OP, branch));
+        }
+        if (has_test)
+        {
+            m_code[test].arg = static_cast<uint32_t>(m_code.size());
+        }
+    }
+    for (uint32_t exit : exits)
+    {
+        m_code[exit].arg = static_cast<uint32_t>(m_code.size());
+    }
+}
 
-        std::shared_ptr<DataInt> li = std::dynamic_pointer_cast<DataInt>(ldata.get());
-        std::shared_ptr<DataInt> ri = std::dynamic_pointer_cast<DataInt>(rdata.get());
+// An active for loop in a running program.
+struct LoopFrame
+{
+    NodeFor *node;
+    uint32_t end;
+    LoopState state;
+
+    LoopFrame(NodeFor *forNode, uint32_t endPc)
+    : node(forNode)
+    , end(endPc)
+    , state()
+    {
+    }
+};
 
-        if (li && ri)
+// The node methods are invoked with qualified names so there is no virtual dispatch.
+void Program::run(OutputSink &sink, data_map &data, RenderContext &context)
+{
+    // The loop stack is reserved up front, so it never moves within the arena.
+    ArenaScope scope(context.arena);
+    std::vector<LoopFrame, ArenaAllocator<LoopFrame> > loops(ArenaAllocator<LoopFrame>(context.arena));
+    loops.reserve(m_loop_depth);
+    const uint32_t count = static_cast<uint32_t>(m_code.size());
+    uint32_t pc = 0;
+    while (pc < count)
+    {
+        const Instruction &inst = m_code[pc];
+        try
         {
-            int l = li->getint();
-            int r = ri->getint();
-            switch (tokType)
+            switch (inst.op)
             {
-                case GT_TOKEN:
-                    ldata = (l > r);
-                    break;
-                case GE_TOKEN:
-                    ldata = (l >= r);
+                case TEXT_OP:
+                    static_cast<NodeText *>(inst.node)->NodeText::gettext(sink, data, context);
+                    ++pc;
                     break;
-                case LT_TOKEN:
-                    ldata = (l < r);
-                    break;
-                case LE_TOKEN:
-                    ldata = (l <= r);
+
+                case VAR_OP:
+                    static_cast<NodeVar *>(inst.node)->NodeVar::gettext(sink, data, context);
+                    ++pc;
                     break;
-                default:
+
+                case SET_OP:
+                    static_cast<NodeSet *>(inst.node)->NodeSet::gettext(sink, data, context);
+                    ++pc;
                     break;
-            }
-        }
-        else
-        {
-            std::string lhs = ldata->getvalue();
-            std::string rhs = rdata->getvalue();
-            switch (tokType)
-            {
-                case GT_TOKEN:
-                    ldata = (lhs > rhs);
+
+                case DEF_OP:
+                    static_cast<NodeDef *>(inst.node)->define(data, m_defs[inst.arg], context);
+                    ++pc;
                     break;
-                case GE_TOKEN:
-                    ldata = (lhs >= rhs);
+
+                case JUMP_IF_FALSE_OP:
+                    pc = static_cast<NodeIf *>(inst.node)->is_true(data, context) ? pc + 1 : inst.arg;
                     break;
-                case LT_TOKEN:
-                    ldata = (lhs < rhs);
+
+                case JUMP_OP:
+                    pc = inst.arg;
                     break;
-                case LE_TOKEN:
-                    ldata = (lhs <= rhs);
+
+                case FOR_BEGIN_OP:
+                {
+                    NodeFor *node = static_cast<NodeFor *>(inst.node);
+                    loops.emplace_back(node, inst.arg);
+                    LoopState &state = loops.back().state;
+                    if (!node->begin_loop(data, state, context))
+                    {
+                        // The list doesn't exist, so the loop doesn't execute at all.
+                        loops.pop_back();
+                        pc = inst.arg;
+                    }
+                    else if (node->render_parallel(sink, data, state, context))
+                    {
+                        loops.pop_back();
+                        pc = inst.arg;
+                    }
+                    else if (node->next_iteration(data, state))
+                    {
+                        ++pc;
+                    }
+                    else
+                    {
+                        node->end_loop(data, state, context);
+                        loops.pop_back();
+                        pc = inst.arg;
+                    }
                     break;
-                default:
+                }
+
+                case FOR_NEXT_OP:
+                {
+                    LoopFrame &frame = loops.back();
+                    ++frame.state.index;
+                    if (frame.node->next_iteration(data, frame.state))
+                    {
+                        pc = inst.arg;
+                    }
+                    else
+                    {
+                        frame.node->end_loop(data, frame.state, context);
+                        loops.pop_back();
+                        ++pc;
+                    }
                     break;
+                }
             }
         }
-    }
-    return ldata;
-}
-
-data_ptr ExprParser::parse_afactor()
-{
-    data_ptr ldata = parse_mfactor();
-
-    TokenType tokType = m_tok->get_type();
-    if (tokType == PLUS_TOKEN || tokType == MINUS_TOKEN || tokType == CONCAT_TOKEN)
-    {
-        m_tok.next();
-
-        data_ptr rdata = parse_afactor();
-
-        switch (tokType)
+        catch (data_map::key_error &)
+        {
+            // As in NodeFor::gettext(), a key path that can't be created ends the
+            // innermost loop.
+            if (loops.empty())
+            {
+                throw;
+            }
+            pc = loops.back().end;
+            context.arena.rewind(loops.back().state.arena_mark);
+            loops.pop_back();
+        }
+        catch (TemplateException &e)
         {
-            case CONCAT_TOKEN:
-                ldata = ldata->getvalue() + rdata->getvalue();
-                break;
-            case PLUS_TOKEN:
-                ldata = ldata->getint() + rdata->getint();
-                break;
-            case MINUS_TOKEN:
-                ldata = ldata->getint() - rdata->getint();
-                break;
-            default:
-                break;
+            if (!loops.empty())
+            {
+                e.set_line_if_missing(loops.back().node->get_line());
+            }
+            throw;
         }
     }
-    return ldata;
 }
 
-data_ptr ExprParser::parse_mfactor()
+inline size_t count_newlines(boost::string_view text)
 {
-    data_ptr ldata = parse_factor();
-
-    TokenType tokType = m_tok->get_type();
-    if (tokType == TIMES_TOKEN || tokType == DIVIDE_TOKEN || tokType == MOD_TOKEN)
-    {
-        m_tok.next();
+    return std::count(text.begin(), text.end(), '\n');
+}
 
-        data_ptr rdata = parse_mfactor();
+//////////////////////////////////////////////////////////////////////////
+// Tag scanning
+//////////////////////////////////////////////////////////////////////////
 
-        switch (tokType)
-        {
-            case TIMES_TOKEN:
-                ldata = ldata->getint() * rdata->getint();
-                break;
-            case DIVIDE_TOKEN:
-                ldata = ldata->getint() / rdata->getint();
-                break;
-            case MOD_TOKEN:
-                ldata = ldata->getint() % rdata->getint();
-                break;
-            default:
-                break;
-        }
-    }
-    return ldata;
+inline bool is_tag_char(char c)
+{
+    return c == '$' || c == '%' || c == '#';
 }
 
-data_ptr ExprParser::parse_bterm()
+size_t find_tag_scalar(boost::string_view text, uint32_t &newlines)
 {
-    data_ptr ldata = parse_bfactor();
-
-    while (m_tok->get_type() == AND_TOKEN)
+    const char *p = text.data();
+    size_t n = text.size();
+    uint32_t lines = 0;
+    for (size_t i = 0; i < n; ++i)
     {
-        m_tok.match(AND_TOKEN);
-
-        data_ptr rdata = parse_bfactor();
-
-        ldata = (!ldata->empty() && !rdata->empty());
+        if (p[i] == '\n')
+        {
+            ++lines;
+        }
+        else if (p[i] == '{' && i + 1 < n && is_tag_char(p[i + 1]))
+        {
+            newlines = lines;
+            return i;
+        }
     }
-    return ldata;
+    newlines = lines;
+    return boost::string_view::npos;
 }
 
-data_ptr ExprParser::parse_oterm()
+#if CPPTEMPL_X86_SIMD
+// Both vector scanners compare each block against '{' and the block shifted by one byte
+// against the tag characters, so a tag is found in a single pass along with the newlines
+// preceding it. Blocks stop one byte short of the end so the shifted load stays in bounds;
+// the scalar scanner handles the remainder.
+size_t find_tag_sse2(boost::string_view text, uint32_t &newlines)
 {
-    data_ptr ldata = parse_bterm();
-
-    while (m_tok->get_type() == OR_TOKEN)
+    const char *p = text.data();
+    size_t n = text.size();
+    uint32_t lines = 0;
+    size_t i = 0;
+
+    const __m128i brace = _mm_set1_epi8('{');
+    const __m128i dollar = _mm_set1_epi8('$');
+    const __m128i percent = _mm_set1_epi8('%');
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i eol = _mm_set1_epi8('\n');
+
+    for (; i + 16 < n; i += 16)
     {
-        m_tok.match(OR_TOKEN);
-
-        data_ptr rdata = parse_bterm();
-
-        if (ldata->empty())
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 1));
+        __m128i tag_next = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(next, dollar),
+            _mm_cmpeq_epi8(next, percent)), _mm_cmpeq_epi8(next, hash));
+        uint32_t tags = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, brace), tag_next));
+        uint32_t eols = _mm_movemask_epi8(_mm_cmpeq_epi8(v, eol));
+        if (tags)
         {
-            ldata = rdata;
+            uint32_t bit = __builtin_ctz(tags);
+            newlines = lines + __builtin_popcount(eols & ((1u << bit) - 1));
+            return i + bit;
         }
+        lines += __builtin_popcount(eols);
     }
 
-    return ldata;
+    uint32_t tail_lines;
+    size_t pos = find_tag_scalar(text.substr(i), tail_lines);
+    newlines = lines + tail_lines;
+    return pos == boost::string_view::npos ? pos : i + pos;
 }
 
-data_ptr ExprParser::parse_expr()
+__attribute__((target("avx2")))
+size_t find_tag_avx2(boost::string_view text, uint32_t &newlines)
 {
-    data_ptr ldata = parse_oterm();
-
-    if (m_tok->get_type() == IF_TOKEN)
+    const char *p = text.data();
+    size_t n = text.size();
+    uint32_t lines = 0;
+    size_t i = 0;
+
+    const __m256i brace = _mm256_set1_epi8('{');
+    const __m256i dollar = _mm256_set1_epi8('$');
+    const __m256i percent = _mm256_set1_epi8('%');
+    const __m256i hash = _mm256_set1_epi8('#');
+    const __m256i eol = _mm256_set1_epi8('\n');
+
+    for (; i + 32 < n; i += 32)
     {
-        m_tok.match(IF_TOKEN);
-        data_ptr predicate = parse_oterm();
-        m_tok.match(ELSE_TOKEN);
-        data_ptr rdata = parse_oterm();
-
-        if (predicate->empty())
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 1));
+        __m256i tag_next = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(next, dollar),
+            _mm256_cmpeq_epi8(next, percent)), _mm256_cmpeq_epi8(next, hash));
+        uint32_t tags = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(v, brace), tag_next));
+        uint32_t eols = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, eol));
+        if (tags)
         {
-            ldata = rdata;
+            uint32_t bit = __builtin_ctz(tags);
+            newlines = lines + __builtin_popcount(eols & ((1ull << bit) - 1));
+            return i + bit;
         }
+        lines += __builtin_popcount(eols);
     }
 
-    return ldata;
+    uint32_t tail_lines;
+    size_t pos = find_tag_sse2(text.substr(i), tail_lines);
+    newlines = lines + tail_lines;
+    return pos == boost::string_view::npos ? pos : i + pos;
 }
+#endif // CPPTEMPL_X86_SIMD
 
-//////////////////////////////////////////////////////////////////////////
-// Node classes
-//////////////////////////////////////////////////////////////////////////
-
-// defaults, overridden by subclasses with children
-void Node::set_children(node_vector &)
+//! Returns the scanners usable on this CPU, best first, terminated by a null entry.
+const TagScanner *get_tag_scanners()
 {
-    throw TemplateException(get_line(), "This node type cannot have children");
+    static const TagScanner *s_scanners = []()
+    {
+        static TagScanner scanners[4] = {};
+        int count = 0;
+#if CPPTEMPL_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+        {
+            scanners[count++] = { "avx2", find_tag_avx2 };
+        }
+        scanners[count++] = { "sse2", find_tag_sse2 };
+#endif
+        scanners[count++] = { "scalar", find_tag_scalar };
+        return scanners;
+    }();
+    return s_scanners;
 }
 
-node_vector &Node::get_children()
+size_t find_tag(boost::string_view text, uint32_t &newlines)
 {
-    throw TemplateException(get_line(), "This node type cannot have children");
+    static const tag_scanner_t s_scan = get_tag_scanners()[0].scan;
+    return s_scan(text, newlines);
 }
 
-// NodeText
-NodeType NodeText::gettype()
+//////////////////////////////////////////////////////////////////////////
+// tokenize
+// parses a template into nodes (text, for, if, variable, def)
+//////////////////////////////////////////////////////////////////////////
+
+TemplateParser::TemplateParser(const std::string &text, node_vector &nodes)
+: m_source(std::make_shared<const std::string>(text))
+, m_text(*m_source)
+, m_top_nodes(nodes)
+, m_current_line(1)
+, m_node_stack()
+, m_current_node()
+, m_current_nodes(&m_top_nodes)
+, m_eol_precedes(true)
+, m_last_was_eol(true)
+, m_until(INVALID_TOKEN)
 {
-    return NODE_TYPE_TEXT;
 }
 
-#if __CYGWIN__ || _WIN32
-void normalize_eol(std::string &str)
+node_vector &TemplateParser::parse()
 {
-    std::string str2 = "";
-    for (int i = 0; i < str.size(); i++)
+    try
     {
-        if (str[i] == '\n')
-        {
-            str2 += "\r\n";
-        }
-        else if (str[i] != '\r')
+        while (!m_text.empty())
         {
-            str2 += str[i];
+            // search for the start of a block
+            uint32_t newlines;
+            size_t pos = find_tag(m_text, newlines);
+            if (pos == boost::string_view::npos)
+            {
+                if (!m_text.empty())
+                {
+                    m_current_nodes->push_back(node_ptr(new NodeText(m_source, m_text, m_current_line)));
+                }
+                return m_top_nodes;
+            }
+            boost::string_view pre_text = m_text.substr(0, pos);
+            m_current_line += newlines;
+
+            // Track whether there was an EOL prior to this open brace.
+            bool newLastWasEol = pos > 0 && m_text[pos - 1] == '\n';
+            m_eol_precedes = (pos == 0 && m_last_was_eol) || newLastWasEol;
+            if (pos > 0)
+            {
+                m_last_was_eol = newLastWasEol;
+            }
+
+            bool has_kill_ws = m_text.size() > pos + 2 && m_text[pos + 2] == '<';
+            if (has_kill_ws)
+            {
+                // remove whitespace back to the last newline
+                while (!pre_text.empty() && std::isspace(pre_text.back()) && pre_text.back() != '\n')
+                {
+                    pre_text.remove_suffix(1);
+                }
+            }
+
+            if (!pre_text.empty())
+            {
+                m_current_nodes->push_back(node_ptr(new NodeText(m_source, pre_text, m_current_line)));
+            }
+
+            // process a block; find_tag() only stops on a brace followed by a tag char
+            m_text.remove_prefix(pos + 1);
+            switch (m_text[0])
+            {
+                case '$':
+                    parse_var();
+                    break;
+                case '%':
+                    parse_stmt();
+                    break;
+                case '#':
+                    parse_comment();
+                    break;
+            }
         }
+
+        return m_top_nodes;
+    }
+    catch (TemplateException &e)
+    {
+        e.set_line_if_missing(m_current_line);
+        throw;
     }
-    str = str2;
 }
-#endif
 
-void NodeText::gettext(std::ostream &stream, data_map &)
+void TemplateParser::parse_var()
 {
-    std::string str;
-    if (s_removeNewLine && m_text[0] == '\n')
+    size_t pos = m_text.find('}');
+    if (pos == boost::string_view::npos)
     {
-        if (m_text.size() > 1)
-        {
-            str = m_text.substr(1, m_text.size() - 1);
-        }
+        throw TemplateException(m_current_line, "unterminated variable block");
     }
-    else
+
+    boost::string_view var_text = m_text.substr(1, pos - 1);
+
+    bool has_kill_newline_if_empty = !var_text.empty() && var_text[0] == '>' && var_text.size() > 2;
+    if (has_kill_newline_if_empty)
+    {
+        var_text = var_text.substr(1, pos - 2);
+    }
+
+    bool has_kill_newline = !var_text.empty() && var_text.back() == '>';
+    if (has_kill_newline)
     {
-        str = m_text;
+        var_text.remove_suffix(1);
     }
-    s_removeNewLine = false;
 
-#if __CYGWIN__ || _WIN32
-    normalize_eol(str);
-#endif
+    bool eol_follows = m_text.size() > pos + 1 && m_text[pos + 1] == '\n';
+    m_text.remove_prefix(pos + 1 + (has_kill_newline && eol_follows ? 1 : 0));
+
+    token_vector stmt_tokens = tokenize_statement(var_text);
+    m_current_nodes->push_back(node_ptr(new NodeVar(stmt_tokens, m_current_line, has_kill_newline_if_empty)));
 
-    stream << str;
+    m_current_line += count_newlines(var_text);
+    m_last_was_eol = false;
 }
 
-// NodeVar
-NodeType NodeVar::gettype()
+void TemplateParser::push_node(Node *new_node, TokenType until)
 {
-    return NODE_TYPE_VAR;
+    m_node_stack.push(std::make_pair(m_current_node, m_until));
+    m_current_node = node_ptr(new_node);
+    m_current_nodes->push_back(m_current_node);
+    m_current_nodes = &m_current_node->get_children();
+    m_until = until;
 }
 
-void NodeVar::gettext(std::ostream &stream, data_map &data)
-{
-    try
-    {
-        TokenIterator it(m_expr);
-        ExprParser expr(it, data);
-        data_ptr result = expr.parse_expr();
-        std::string str = result->getvalue();
-        if (str == "" && m_removeNewLine)
-        {
-            s_removeNewLine = true;
+void TemplateParser::parse_stmt()
+{
+    size_t pos = m_text.find("%}");
+    if (pos == boost::string_view::npos)
+    {
+        throw TemplateException(m_current_line, "unterminated statement block");
+    }
+
+    boost::string_view stmt_text = m_text.substr(1, pos - 1);
+    bool has_kill_newline = !stmt_text.empty() && stmt_text.back() == '>';
+    if (has_kill_newline)
+    {
+        stmt_text.remove_suffix(1);
+    }
+    uint32_t lineCount = count_newlines(stmt_text);
+
+    // Tokenize the control statement.
+    token_vector stmt_tokens = tokenize_statement(stmt_text);
+    if (!stmt_tokens.empty())
+    {
+        TokenType first_token_type = stmt_tokens[0].get_type();
+
+        // Create control statement nodes.
+        switch (first_token_type)
+        {
+            case FOR_TOKEN:
+                push_node(new NodeFor(stmt_tokens, m_node_stack.empty(), m_current_line), ENDFOR_TOKEN);
+                break;
+
+            case IF_TOKEN:
+                push_node(new NodeIf(stmt_tokens, m_current_line), ENDIF_TOKEN);
+                break;
+
+            case ELIF_TOKEN:
+            case ELSE_TOKEN:
+            {
+                auto current_if = dynamic_cast<NodeIf *>(m_current_node.get());
+                if (!current_if)
+                {
+                    throw TemplateException(m_current_line, "else/elif without if");
+                }
+
+                if (current_if->is_else())
+                {
+                    throw TemplateException(m_current_line, "if already has else");
+                }
+
+                m_current_node = node_ptr(new NodeIf(stmt_tokens, m_current_line));
+                current_if->set_else_if(m_current_node);
+                m_current_nodes = &m_current_node->get_children();
+                break;
+            }
+
+            case DEF_TOKEN:
+                push_node(new NodeDef(stmt_tokens, m_current_line), ENDDEF_TOKEN);
+                break;
+
+            case SET_TOKEN:
+                m_current_nodes->push_back(node_ptr(new NodeSet(stmt_tokens, m_current_line)));
+                break;
+
+            case ENDFOR_TOKEN:
+            case ENDIF_TOKEN:
+            case ENDDEF_TOKEN:
+                if (m_until == first_token_type)
+                {
+                    assert(!m_node_stack.empty());
+                    auto top = m_node_stack.top();
+                    m_node_stack.pop();
+                    if (top.first)
+                    {
+                        m_current_node = top.first;
+                        m_current_nodes = &m_current_node->get_children();
+                        m_until = top.second;
+                    }
+                    else
+                    {
+                        m_current_node.reset();
+                        m_current_nodes = &m_top_nodes;
+                        m_until = INVALID_TOKEN;
+                    }
+                }
+                else
+                {
+                    throw TemplateException(m_current_line, "unexpected end statement");
+                }
+                break;
+
+            default:
+                throw TemplateException(m_current_line, "invalid control statement");
         }
-
-#if __CYGWIN__ || _WIN32
-        normalize_eol(str);
-#endif
-
-        stream << str;
-    }
-    catch (TemplateException e)
-    {
-        e.set_line_if_missing(get_line());
-        throw e;
     }
-}
 
-// NodeVar
-void NodeParent::set_children(node_vector &children)
-{
-    m_children.assign(children.begin(), children.end());
-}
+    // Chop off following eol if this control statement is on a line by itself.
+    check_omit_eol(pos, has_kill_newline);
 
-node_vector &NodeParent::get_children()
-{
-    return m_children;
+    m_current_line += lineCount;
 }
 
-// NodeFor
-NodeFor::NodeFor(const token_vector &tokens, bool is_top, uint32_t line)
-: NodeParent(line)
-, m_is_top(is_top)
-, m_has_predicate(false)
+void TemplateParser::parse_comment()
 {
-    TokenIterator tok(tokens);
-    tok.match(FOR_TOKEN, "expected 'for'");
-    m_val = tok.match(KEY_PATH_TOKEN, "expected key path")->get_value();
-    tok.match(IN_TOKEN, "expected 'in'");
-    m_key = tok.match(KEY_PATH_TOKEN, "expected key path")->get_value();
-    if (tok->get_type() != END_TOKEN)
+    size_t pos = m_text.find("#}");
+    if (pos == boost::string_view::npos)
     {
-        tok.match(IF_TOKEN, "expected 'if'");
-        while (tok->get_type() != END_TOKEN)
-        {
-            m_predicate_tokens.push_back(*tok.get());
-            ++tok;
-        }
-        m_has_predicate = true;
+        return;
     }
-    tok.match(END_TOKEN, "expected end of statement");
-}
 
-NodeType NodeFor::gettype()
-{
-    return NODE_TYPE_FOR;
-}
+    boost::string_view comment_text = m_text.substr(1, pos - 1);
+    m_current_line += count_newlines(comment_text);
 
-data_map NodeFor::build_loop_map(size_t i, size_t count)
-{
-    data_map loop;
-    loop["index"] = make_data(i + 1);
-    loop["index0"] = make_data(i);
-    loop["first"] = make_data(i == 0);
-    loop["last"] = make_data(i == count - 1);
-    loop["even"] = make_data((i + 1) % 2 == 0);
-    loop["odd"] = make_data((i + 1) % 2 == 1);
-    loop["count"] = make_data(count);
-    loop["addNewLineIfNotLast"] = (i != count - 1) ? "\n" : "";
-    return loop;
+    check_omit_eol(pos, false);
 }
 
-void NodeFor::gettext(std::ostream &stream, data_map &data)
+void TemplateParser::check_omit_eol(size_t pos, bool force_omit)
 {
-    try
-    {
-        data_ptr saved_loop;
-        if (!m_is_top)
-        {
-            saved_loop = data["loop"];
-        }
-        data_ptr value = data.parse_path(m_key);
-        data_list filtered_items;
-        if (m_has_predicate)
-        {
-            data_list &items_to_filter = value->getlist();
-            for (size_t i = 0; i < items_to_filter.size(); ++i)
-            {
-                data["loop"] = make_data(build_loop_map(i, items_to_filter.size()));
-                data[m_val] = items_to_filter[i];
-                TokenIterator it(m_predicate_tokens);
-                ExprParser parser(it, data);
-                data_ptr d = parser.parse_expr();
-                if (!d->empty())
-                {
-                    filtered_items.push_back(items_to_filter[i]);
-                }
-            }
-        }
-        data_list &items = m_has_predicate ? filtered_items : value->getlist();
-        for (size_t i = 0; i < items.size(); ++i)
-        {
-            data["loop"] = make_data(build_loop_map(i, items.size()));
-            data[m_val] = items[i];
-            for (size_t j = 0; j < m_children.size(); ++j)
-            {
-                m_children[j]->gettext(stream, data);
-            }
-        }
-        if (!m_is_top)
-        {
-            data["loop"] = saved_loop;
-        }
-    }
-    catch (data_map::key_error &)
-    {
-        // ignore exception - the for loop key variable doesn't exist, so just
-        // don't execute the for loop at all
-    }
-    catch (TemplateException e)
+    pos += 2;
+    bool eol_follows = m_text.size() > pos && m_text[pos] == '\n';
+
+    // Chop off following eol if this block is on a line by itself.
+    if ((force_omit || m_eol_precedes) && eol_follows)
     {
-        e.set_line_if_missing(get_line());
-        throw e;
+        ++pos;
+        ++m_current_line;
+        m_last_was_eol = true;
     }
+
+    m_text.remove_prefix(pos);
 }
 
-// NodeIf
-NodeIf::NodeIf(const token_vector &expr, uint32_t line)
-: NodeParent(line)
-, m_expr(expr)
-, m_else_if(nullptr)
-, m_if_type(NODE_TYPE_IF)
+} // namespace impl
+
+/************************************************************************
+* parse
+*
+*  1. tokenizes template
+*  2. parses tokens into tree
+*  3. resolves template
+*  4. returns converted text
+************************************************************************/
+std::string parse(const std::string &templ_text, data_map &data)
 {
-    if (expr[0].get_type() == ELIF_TOKEN)
-    {
-        m_if_type = NODE_TYPE_ELIF;
-    }
-    else if (expr[0].get_type() == ELSE_TOKEN)
-    {
-        m_if_type = NODE_TYPE_ELSE;
-    }
+    return TemplateCache::global().get(templ_text)->eval(data);
 }
-
-NodeType NodeIf::gettype()
+void parse(std::ostream &stream, const std::string &templ_text, data_map &data)
 {
-    return m_if_type;
+    TemplateCache::global().get(templ_text)->eval(stream, data);
 }
 
-void NodeIf::set_else_if(node_ptr else_if)
+//////////////////////////////////////////////////////////////////////////
+// TemplateCache
+//////////////////////////////////////////////////////////////////////////
+
+TemplateCache::TemplateCache(size_t capacity)
+: m_mutex()
+, m_capacity(capacity)
+, m_entries()
+, m_by_text()
+, m_by_name()
+, m_stats()
 {
-    m_else_if = else_if;
 }
 
-void NodeIf::gettext(std::ostream &stream, data_map &data)
+template_ptr TemplateCache::get(const std::string &text)
 {
-    if (is_true(data))
+    size_t hash = hash_key(text);
     {
-        for (size_t j = 0; j < m_children.size(); ++j)
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (template_ptr tmpl = lookup(find_text(text, hash)))
         {
-            m_children[j]->gettext(stream, data);
+            return tmpl;
         }
     }
-    else if (m_else_if)
-    {
-        m_else_if->gettext(stream, data);
-    }
+
+    // Parse without holding the lock. If another thread parses the same text
+    // meanwhile, the later insert simply replaces the earlier one.
+    template_ptr tmpl = std::make_shared<DataTemplate>(text);
+    tmpl->compile();
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    insert(find_text(text, hash), Entry{ false, hash, text, tmpl });
+    return tmpl;
 }
 
-bool NodeIf::is_true(data_map &data)
+template_ptr TemplateCache::add(const std::string &name, const std::string &text)
 {
-    try
-    {
-        TokenIterator it(m_expr);
-        if (m_if_type == NODE_TYPE_IF)
-        {
-            it.match(IF_TOKEN, "expected 'if' keyword");
-        }
-        else if (m_if_type == NODE_TYPE_ELIF)
-        {
-            it.match(ELIF_TOKEN, "expected 'elif' keyword");
-        }
-        else if (m_if_type == NODE_TYPE_ELSE)
-        {
-            it.match(ELSE_TOKEN, "expected 'else' keyword");
-            it.match(END_TOKEN, "expected end of statement");
-            return true;
-        }
-        ExprParser parser(it, data);
-        data_ptr d = parser.parse_expr();
-        it.match(END_TOKEN, "expected end of statement");
+    template_ptr tmpl = std::make_shared<DataTemplate>(text);
+    tmpl->compile();
 
-        return !d->empty();
-    }
-    catch (TemplateException e)
-    {
-        e.set_line_if_missing(get_line());
-        throw e;
-    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    insert(find_name(name), Entry{ true, 0, name, tmpl });
+    return tmpl;
 }
 
-bool NodeIf::is_else()
+template_ptr TemplateCache::find(const std::string &name)
 {
-    return m_if_type == NODE_TYPE_ELSE;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return lookup(find_name(name));
 }
 
-// NodeDef
-NodeDef::NodeDef(const token_vector &expr, uint32_t line)
-: NodeParent(line)
+void TemplateCache::set_capacity(size_t capacity)
 {
-    TokenIterator tok(expr);
-    tok.match(DEF_TOKEN, "expected 'def'");
-
-    m_name = tok.match(KEY_PATH_TOKEN, "expected key path")->get_value();
-
-    if (tok->get_type() == OPEN_PAREN_TOKEN)
-    {
-        tok.match(OPEN_PAREN_TOKEN);
-
-        while (tok->get_type() != CLOSE_PAREN_TOKEN)
-        {
-            m_params.push_back(tok.match(KEY_PATH_TOKEN, "expected key path")->get_value());
-
-            if (tok->get_type() != CLOSE_PAREN_TOKEN)
-            {
-                tok.match(COMMA_TOKEN, "expected comma");
-            }
-        }
-        tok.match(CLOSE_PAREN_TOKEN, "expected close paren");
-    }
-    tok.match(END_TOKEN, "expected end of statement");
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = capacity;
+    trim();
 }
 
-NodeType NodeDef::gettype()
+size_t TemplateCache::capacity() const
 {
-    return NODE_TYPE_DEF;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_capacity;
 }
 
-void NodeDef::gettext(std::ostream &stream, data_map &data)
+void TemplateCache::clear()
 {
-    // Follow the key path.
-    data_ptr &target = data.parse_path(m_name, true);
-
-    // Set the map entry's value to a newly created template. The nodes were already
-    // parsed and set as our m_children vector. The names of the template's parameters
-    // are set from the param names we parsed in the ctor.
-    DataTemplate *tmpl = new DataTemplate(m_children);
-    tmpl->params() = m_params;
-    target = data_ptr(tmpl);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_entries.clear();
+    m_by_text.clear();
+    m_by_name.clear();
+    m_stats = Stats();
 }
 
-// NodeSet
-NodeType NodeSet::gettype()
+TemplateCache::Stats TemplateCache::stats() const
 {
-    return NODE_TYPE_SET;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Stats result = m_stats;
+    result.size = m_entries.size();
+    return result;
 }
 
-void NodeSet::gettext(std::ostream &stream, data_map &data)
+TemplateCache &TemplateCache::global()
 {
-    TokenIterator tok(m_expr);
-    tok.match(SET_TOKEN, "expected 'set'");
-    std::string path = tok.match(KEY_PATH_TOKEN, "expected key path")->get_value();
-    tok.match(ASSIGN_TOKEN);
-    ExprParser parser(tok, data);
-    data_ptr value = parser.parse_expr();
-    tok.match(END_TOKEN, "expected end of statement");
+    static TemplateCache s_cache;
+    return s_cache;
+}
 
-    // Follow the key path, creating the key if missing.
-    data_ptr &target = data.parse_path(path, true);
-    target = value;
+// Must be called with the mutex held. Returns m_entries.end() if there is no entry for
+// @a text. Texts whose hashes collide share a bucket and are told apart by the entry's text.
+TemplateCache::entry_list::iterator TemplateCache::find_text(const std::string &text, size_t hash)
+{
+    auto range = m_by_text.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it)
+    {
+        if (it->second->key == text)
+        {
+            return it->second;
+        }
+    }
+    return m_entries.end();
 }
 
-inline size_t count_newlines(const std::string &text)
+// Must be called with the mutex held. Returns m_entries.end() if @a name isn't registered.
+TemplateCache::entry_list::iterator TemplateCache::find_name(const std::string &name)
 {
-    return std::count(text.begin(), text.end(), '\n');
+    auto it = m_by_name.find(name);
+    return it == m_by_name.end() ? m_entries.end() : it->second;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// tokenize
-// parses a template into nodes (text, for, if, variable, def)
-//////////////////////////////////////////////////////////////////////////
+// Must be called with the mutex held. Moves a found entry to the front of the LRU list.
+template_ptr TemplateCache::lookup(entry_list::iterator it)
+{
+    if (it == m_entries.end())
+    {
+        ++m_stats.misses;
+        return template_ptr();
+    }
+    ++m_stats.hits;
+    m_entries.splice(m_entries.begin(), m_entries, it);
+    return it->tmpl;
+}
 
-TemplateParser::TemplateParser(const std::string &text, node_vector &nodes)
-: m_text(text)
-, m_top_nodes(nodes)
-, m_current_line(1)
-, m_node_stack()
-, m_current_node()
-, m_current_nodes(&m_top_nodes)
-, m_eol_precedes(true)
-, m_last_was_eol(true)
-, m_until(INVALID_TOKEN)
+// Must be called with the mutex held. @a it is the existing entry with the same key,
+// or m_entries.end().
+void TemplateCache::insert(entry_list::iterator it, Entry &&entry)
 {
+    if (it != m_entries.end())
+    {
+        it->tmpl = std::move(entry.tmpl);
+        m_entries.splice(m_entries.begin(), m_entries, it);
+        return;
+    }
+    m_entries.push_front(std::move(entry));
+    Entry &added = m_entries.front();
+    if (added.is_named)
+    {
+        m_by_name.emplace(added.key, m_entries.begin());
+    }
+    else
+    {
+        m_by_text.emplace(added.hash, m_entries.begin());
+    }
+    trim();
 }
 
-node_vector &TemplateParser::parse()
+// Must be called with the mutex held.
+void TemplateCache::trim()
 {
-    try
+    while (m_entries.size() > m_capacity)
     {
-        while (!m_text.empty())
+        auto oldest = std::prev(m_entries.end());
+        if (oldest->is_named)
         {
-            // search for the start of a block
-            size_t pos = m_text.find("{");
-            if (pos == std::string::npos)
-            {
-                if (!m_text.empty())
-                {
-                    m_current_nodes->push_back(node_ptr(new NodeText(m_text, m_current_line)));
-                }
-                return m_top_nodes;
-            }
-            std::string pre_text = m_text.substr(0, pos);
-            m_current_line += count_newlines(pre_text);
-
-            // Track whether there was an EOL prior to this open brace.
-            bool newLastWasEol = pos > 0 && m_text[pos - 1] == '\n';
-            m_eol_precedes = (pos == 0 && m_last_was_eol) || newLastWasEol;
-            if (pos > 0)
-            {
-                m_last_was_eol = newLastWasEol;
-            }
-
-            bool has_kill_ws = m_text.size() > pos + 2 && m_text[pos + 2] == '<';
-            if (has_kill_ws)
-            {
-                // remove whitespace back to the last newline
-                while (std::isspace(pre_text.back()) && pre_text.back() != '\n')
-                {
-                    pre_text.pop_back();
-                }
-            }
-
-            if (!pre_text.empty())
-            {
-                m_current_nodes->push_back(node_ptr(new NodeText(pre_text, m_current_line)));
-            }
-
-            m_text = m_text.substr(pos + 1);
-            if (m_text.empty())
-            {
-                m_current_nodes->push_back(node_ptr(new NodeText("{", m_current_line)));
-                return m_top_nodes;
-            }
-
-            // process a block
-            switch (m_text[0])
-            {
-                case '$':
-                    parse_var();
-                    break;
-                case '%':
-                    parse_stmt();
-                    break;
-                case '#':
-                    parse_comment();
+            m_by_name.erase(oldest->key);
+        }
+        else
+        {
+            auto range = m_by_text.equal_range(oldest->hash);
+            for (auto it = range.first; it != range.second; ++it)
+            {
+                if (it->second == oldest)
+                {
+                    m_by_text.erase(it);
                     break;
-                default:
-                    m_current_nodes->push_back(node_ptr(new NodeText("{", m_current_line)));
+                }
             }
         }
+        m_entries.pop_back();
+        ++m_stats.evictions;
+    }
+}
 
-        return m_top_nodes;
+//////////////////////////////////////////////////////////////////////////
+// Profiler
+//////////////////////////////////////////////////////////////////////////
+
+static uint64_t profiler_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+void Profiler::enter(const void *key, const char *kind, uint32_t line, const char *name, size_t output_size)
+{
+    // A subtemplate call doesn't know its line; use that of the node making the call.
+    if (!line && !m_stack.empty())
+    {
+        line = m_frames[m_stack.back().frame].line;
+    }
+
+    // Find or create the frame for this node under the current stack.
+    if (m_frames.empty())
+    {
+        m_frames.push_back(Frame{ nullptr, 0, std::string(), 0, 0, {} });
     }
-    catch (TemplateException e)
+    size_t parent = m_stack.empty() ? 0 : m_stack.back().frame;
+    size_t frame = 0;
+    for (size_t child : m_frames[parent].children)
     {
-        e.set_line_if_missing(m_current_line);
-        throw e;
+        if (m_frames[child].key == key)
+        {
+            frame = child;
+            break;
+        }
+    }
+    if (!frame)
+    {
+        std::string label = kind;
+        label += ':';
+        label += name ? std::string(name) : std::to_string(line);
+        frame = m_frames.size();
+        m_frames[parent].children.push_back(frame);
+        m_frames.push_back(Frame{ key, parent, label, line, 0, {} });
+
+        if (!m_entries.count(label))
+        {
+            m_entries[label] = Entry{ label, line, 0, 0, 0, 0 };
+        }
     }
+
+    m_stack.push_back(Active{ frame, profiler_now_ns(), 0, output_size });
 }
 
-void TemplateParser::parse_var()
+void Profiler::leave(size_t output_size)
 {
-    size_t pos = m_text.find("}");
-    if (pos == std::string::npos)
+    Active active = m_stack.back();
+    m_stack.pop_back();
+    uint64_t elapsed = profiler_now_ns() - active.start_ns;
+    uint64_t exclusive = elapsed > active.child_ns ? elapsed - active.child_ns : 0;
+
+    Frame &frame = m_frames[active.frame];
+    frame.exclusive_ns += exclusive;
+    if (!m_stack.empty())
     {
-        throw TemplateException(m_current_line, "unterminated variable block");
+        m_stack.back().child_ns += elapsed;
     }
 
-    std::string var_text = m_text.substr(1, pos - 1);
+    Entry &entry = m_entries[frame.label];
+    ++entry.calls;
+    entry.exclusive_ns += exclusive;
 
-    bool has_kill_newline_if_empty = !var_text.empty() && var_text[0] == '>' && var_text.size() > 2;
-    if (has_kill_newline_if_empty)
+    // Only the outermost of recursive calls adds to the inclusive totals.
+    bool is_outermost = true;
+    for (const Active &outer : m_stack)
     {
-        var_text = var_text.substr(1, pos - 2);
+        if (m_frames[outer.frame].label == frame.label)
+        {
+            is_outermost = false;
+            break;
+        }
     }
-
-    bool has_kill_newline = !var_text.empty() && var_text.back() == '>';
-    if (has_kill_newline)
+    if (is_outermost)
     {
-        var_text.pop_back();
+        entry.inclusive_ns += elapsed;
+        entry.bytes += output_size - active.start_output;
     }
+}
 
-    bool eol_follows = m_text.size() > pos + 1 && m_text[pos + 1] == '\n';
-    m_text = m_text.substr(pos + 1 + (has_kill_newline && eol_follows ? 1 : 0));
+std::vector<Profiler::Entry> Profiler::entries() const
+{
+    std::vector<Entry> result;
+    for (auto &it : m_entries)
+    {
+        result.push_back(it.second);
+    }
+    std::sort(result.begin(), result.end(), [](const Entry &a, const Entry &b)
+    {
+        return a.exclusive_ns != b.exclusive_ns ? a.exclusive_ns > b.exclusive_ns : a.line < b.line;
+    });
+    return result;
+}
 
-    token_vector stmt_tokens = tokenize_statement(var_text);
-    m_current_nodes->push_back(node_ptr(new NodeVar(stmt_tokens, m_current_line, has_kill_newline_if_empty)));
+void Profiler::report(std::ostream &stream) const
+{
+    stream << std::left << std::setw(24) << "node" << std::right << std::setw(8) << "line" << std::setw(12) << "calls"
+           << std::setw(14) << "incl ms" << std::setw(14) << "excl ms" << std::setw(14) << "bytes" << "\n";
+    for (const Entry &entry : entries())
+    {
+        stream << std::left << std::setw(24) << entry.label << std::right << std::setw(8) << entry.line
+               << std::setw(12) << entry.calls << std::fixed << std::setprecision(3) << std::setw(14)
+               << entry.inclusive_ns / 1e6 << std::setw(14) << entry.exclusive_ns / 1e6 << std::setw(14)
+               << entry.bytes << "\n";
+    }
+}
 
-    m_current_line += count_newlines(var_text);
-    m_last_was_eol = false;
+void Profiler::write_folded(std::ostream &stream) const
+{
+    for (size_t i = 1; i < m_frames.size(); ++i)
+    {
+        std::string stack = m_frames[i].label;
+        for (size_t parent = m_frames[i].parent; parent; parent = m_frames[parent].parent)
+        {
+            stack = m_frames[parent].label + ";" + stack;
+        }
+        stream << stack << " " << m_frames[i].exclusive_ns / 1000 << "\n";
+    }
 }
 
-void TemplateParser::push_node(Node *new_node, TokenType until)
+void Profiler::clear()
 {
-    m_node_stack.push(std::make_pair(m_current_node, m_until));
-    m_current_node = node_ptr(new_node);
-    m_current_nodes->push_back(m_current_node);
-    m_current_nodes = &m_current_node->get_children();
-    m_until = until;
+    m_frames.clear();
+    m_stack.clear();
+    m_entries.clear();
 }
 
-void TemplateParser::parse_stmt()
+//////////////////////////////////////////////////////////////////////////
+// ThreadPool
+//////////////////////////////////////////////////////////////////////////
+
+// The calls of a parallel_for(). Each thread taking part owns a range of calls, which it
+// works through from the front. Once its own range is empty it steals the back half of
+// another thread's range. Ranges are packed into one word, begin in the high half, so
+// that they can be updated with a single compare and swap.
+struct ThreadPool::Job
 {
-    size_t pos = m_text.find("%}");
-    if (pos == std::string::npos)
+    Job(size_t count, size_t slots, const std::function<void(size_t)> &fn)
+    : fn(fn)
+    , count(count)
+    , slots(slots)
+    , ranges(new std::atomic<uint64_t>[slots])
+    , joined(0)
+    , done(0)
     {
-        throw TemplateException(m_current_line, "unterminated statement block");
+        for (size_t i = 0; i < slots; ++i)
+        {
+            ranges[i] = pack(count * i / slots, count * (i + 1) / slots);
+        }
     }
 
-    std::string stmt_text = m_text.substr(1, pos - 1);
-    bool has_kill_newline = !stmt_text.empty() && stmt_text.back() == '>';
-    if (has_kill_newline)
+    static uint64_t pack(uint64_t begin, uint64_t end) { return begin << 32 | end; }
+    static uint32_t begin(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+    static uint32_t end(uint64_t range) { return static_cast<uint32_t>(range); }
+
+    bool has_work() const;
+    bool take(size_t slot, size_t &call);
+    bool steal(size_t slot, size_t &first, size_t &last);
+
+    const std::function<void(size_t)> &fn;
+    size_t count;
+    size_t slots;
+    std::unique_ptr<std::atomic<uint64_t>[]> ranges;
+    std::atomic<size_t> joined; //!< Number of threads that have taken part, and so claimed a slot.
+    std::atomic<size_t> done;   //!< Number of calls finished.
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::exception_ptr error;
+};
+
+bool ThreadPool::Job::has_work() const
+{
+    for (size_t i = 0; i < slots; ++i)
     {
-        stmt_text.pop_back();
+        uint64_t range = ranges[i].load();
+        if (begin(range) < end(range))
+        {
+            return true;
+        }
     }
-    uint32_t lineCount = count_newlines(stmt_text);
+    return false;
+}
 
-    // Tokenize the control statement.
-    token_vector stmt_tokens = tokenize_statement(stmt_text);
-    if (!stmt_tokens.empty())
+// Takes the first call of a slot's range.
+bool ThreadPool::Job::take(size_t slot, size_t &call)
+{
+    uint64_t range = ranges[slot].load();
+    while (begin(range) < end(range))
     {
-        TokenType first_token_type = stmt_tokens[0].get_type();
-
-        // Create control statement nodes.
-        switch (first_token_type)
+        if (ranges[slot].compare_exchange_weak(range, pack(begin(range) + 1, end(range))))
         {
-            case FOR_TOKEN:
-                push_node(new NodeFor(stmt_tokens, m_node_stack.empty(), m_current_line), ENDFOR_TOKEN);
-                break;
-
-            case IF_TOKEN:
-                push_node(new NodeIf(stmt_tokens, m_current_line), ENDIF_TOKEN);
-                break;
+            call = begin(range);
+            return true;
+        }
+    }
+    return false;
+}
 
-            case ELIF_TOKEN:
-            case ELSE_TOKEN:
+// Takes the back half of the first non-empty range after @a slot, leaving the front
+// half, which its owner is working towards, in place. Returns false once no calls
+// are left to start.
+bool ThreadPool::Job::steal(size_t slot, size_t &first, size_t &last)
+{
+    for (size_t i = 1; i <= slots; ++i)
+    {
+        size_t victim = (slot + i) % slots;
+        uint64_t range = ranges[victim].load();
+        while (begin(range) < end(range))
+        {
+            uint32_t middle = begin(range) + (end(range) - begin(range)) / 2;
+            if (ranges[victim].compare_exchange_weak(range, pack(begin(range), middle)))
             {
-                auto current_if = dynamic_cast<NodeIf *>(m_current_node.get());
-                if (!current_if)
-                {
-                    throw TemplateException(m_current_line, "else/elif without if");
-                }
-
-                if (current_if->is_else())
-                {
-                    throw TemplateException(m_current_line, "if already has else");
-                }
-
-                m_current_node = node_ptr(new NodeIf(stmt_tokens, m_current_line));
-                current_if->set_else_if(m_current_node);
-                m_current_nodes = &m_current_node->get_children();
-                break;
+                first = middle;
+                last = end(range);
+                return true;
             }
+        }
+    }
+    return false;
+}
 
-            case DEF_TOKEN:
-                push_node(new NodeDef(stmt_tokens, m_current_line), ENDDEF_TOKEN);
-                break;
-
-            case SET_TOKEN:
-                m_current_nodes->push_back(node_ptr(new NodeSet(stmt_tokens, m_current_line)));
-                break;
+ThreadPool::ThreadPool()
+: m_stopping(false)
+{
+    unsigned cores = std::thread::hardware_concurrency();
+    start(cores > 1 ? cores - 1 : 0);
+}
 
-            case ENDFOR_TOKEN:
-            case ENDIF_TOKEN:
-            case ENDDEF_TOKEN:
-                if (m_until == first_token_type)
-                {
-                    assert(!m_node_stack.empty());
-                    auto top = m_node_stack.top();
-                    m_node_stack.pop();
-                    if (top.first)
-                    {
-                        m_current_node = top.first;
-                        m_current_nodes = &m_current_node->get_children();
-                        m_until = top.second;
-                    }
-                    else
-                    {
-                        m_current_node.reset();
-                        m_current_nodes = &m_top_nodes;
-                        m_until = INVALID_TOKEN;
-                    }
-                }
-                else
-                {
-                    throw TemplateException(m_current_line, "unexpected end statement");
-                }
-                break;
+ThreadPool::ThreadPool(size_t threads)
+: m_stopping(false)
+{
+    start(threads);
+}
 
-            default:
-                throw TemplateException(m_current_line, "invalid control statement");
-        }
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
     }
+    m_wake.notify_all();
+    for (std::thread &thread : m_threads)
+    {
+        thread.join();
+    }
+}
 
-    // Chop off following eol if this control statement is on a line by itself.
-    check_omit_eol(pos, has_kill_newline);
-
-    m_current_line += lineCount;
+void ThreadPool::start(size_t threads)
+{
+    m_threads.reserve(threads);
+    for (size_t i = 0; i < threads; ++i)
+    {
+        m_threads.emplace_back(&ThreadPool::worker, this);
+    }
 }
 
-void TemplateParser::parse_comment()
+void ThreadPool::parallel_for(size_t count, const std::function<void(size_t)> &fn)
 {
-    size_t pos = m_text.find("#}");
-    if (pos == std::string::npos)
+    if (count == 0)
     {
         return;
     }
+    if (count > UINT32_MAX)
+    {
+        throw std::length_error("too many calls for ThreadPool::parallel_for");
+    }
+    bool shared = !m_threads.empty() && count > 1;
+    std::shared_ptr<Job> job = std::make_shared<Job>(count, shared ? m_threads.size() + 1 : 1, fn);
+    if (shared)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back(job);
+        }
+        m_wake.notify_all();
+    }
 
-    std::string comment_text = m_text.substr(1, pos - 1);
-    m_current_line += count_newlines(comment_text);
+    run_job(*job);
 
-    check_omit_eol(pos, false);
+    // Every call has been started, so the job no longer needs to be offered to workers.
+    if (shared)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_jobs.begin(), m_jobs.end(), job);
+        if (it != m_jobs.end())
+        {
+            m_jobs.erase(it);
+        }
+    }
+    {
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&]() { return job->done.load() == count; });
+    }
+    if (job->error)
+    {
+        std::rethrow_exception(job->error);
+    }
 }
 
-void TemplateParser::check_omit_eol(size_t pos, bool force_omit)
+// Makes calls until none are left to start.
+void ThreadPool::run_job(Job &job)
 {
-    pos += 2;
-    bool eol_follows = m_text.size() > pos && m_text[pos] == '\n';
-
-    // Chop off following eol if this block is on a line by itself.
-    if ((force_omit || m_eol_precedes) && eol_follows)
+    // A thread joining after all slots are taken only steals. Its stolen calls are
+    // then not visible to others, which is fine as every thread is already busy.
+    size_t slot = job.joined.fetch_add(1);
+    bool owns_slot = slot < job.slots;
+    if (!owns_slot)
     {
-        ++pos;
-        ++m_current_line;
-        m_last_was_eol = true;
+        slot %= job.slots;
     }
+    size_t first = 0;
+    size_t last = 0;
+    for (;;)
+    {
+        size_t call;
+        if (owns_slot ? job.take(slot, call) : first < last)
+        {
+            if (!owns_slot)
+            {
+                call = first++;
+            }
+        }
+        else if (job.steal(slot, first, last))
+        {
+            call = first++;
+            if (owns_slot)
+            {
+                // Make the rest of the stolen range available to other thieves.
+                job.ranges[slot].store(Job::pack(first, last));
+            }
+        }
+        else
+        {
+            return;
+        }
 
-    m_text = m_text.substr(pos);
+        try
+        {
+            job.fn(call);
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            if (!job.error)
+            {
+                job.error = std::current_exception();
+            }
+        }
+        if (job.done.fetch_add(1) + 1 == job.count)
+        {
+            std::lock_guard<std::mutex> lock(job.mutex);
+            job.finished.notify_all();
+        }
+    }
 }
 
-} // namespace impl
-
-/************************************************************************
-* parse
-*
-*  1. tokenizes template
-*  2. parses tokens into tree
-*  3. resolves template
-*  4. returns converted text
-************************************************************************/
-std::string parse(const std::string &templ_text, data_map &data)
-{
-    return DataTemplate(templ_text).eval(data);
-}
-void parse(std::ostream &stream, const std::string &templ_text, data_map &data)
+void ThreadPool::worker()
 {
-    DataTemplate(templ_text).eval(stream, data);
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        // Help with the oldest job that still has calls to start.
+        std::shared_ptr<Job> job;
+        for (const std::shared_ptr<Job> &queued : m_jobs)
+        {
+            if (queued->has_work())
+            {
+                job = queued;
+                break;
+            }
+        }
+        if (job)
+        {
+            lock.unlock();
+            run_job(*job);
+            lock.lock();
+        }
+        else if (m_stopping)
+        {
+            return;
+        }
+        else
+        {
+            m_wake.wait(lock);
+        }
+    }
 }
 }
 
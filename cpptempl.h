@@ -46,8 +46,19 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
 #include <unordered_map>
+#include <list>
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <exception>
 #include <boost/lexical_cast.hpp>
+#include <boost/utility/string_view.hpp>
 
 #include <iostream>
 
@@ -65,6 +76,15 @@ typedef std::vector<data_ptr> data_list;
 class Data
 {
 public:
+    Data()
+    : m_refs(0)
+    {
+    }
+    Data(const Data &)
+    : m_refs(0)
+    {
+    }
+    Data &operator=(const Data &) { return *this; }
     virtual ~Data() = default;
     virtual bool empty() = 0;
     virtual std::string getvalue();
@@ -72,6 +92,11 @@ public:
     virtual data_map &getmap();
     virtual int getint() const;
     virtual void dump(int indent = 0) = 0;
+
+private:
+    std::atomic<uint32_t> m_refs; //!< Number of data_ptrs referencing this object.
+
+    friend class data_ptr;
 };
 
 class DataBool : public Data
@@ -122,6 +147,7 @@ public:
     {
     }
     std::string getvalue();
+    const std::string &value() const { return m_value; }
     virtual int getint() const;
     bool empty();
     virtual void dump(int indent = 0);
@@ -145,46 +171,448 @@ public:
     void dump(int indent = 0);
 };
 
+//! @brief Handle to a template data value.
+//!
+//! A data_ptr is a 16-byte tagged value. Bools, ints and strings of up to 14 characters
+//! are stored inline without any allocation. Longer strings, lists, maps and templates
+//! live in a reference-counted Data object on the heap.
+//!
+//! The Data accessors are also provided by data_ptr, and operator-> returns the
+//! data_ptr itself, so code written as "data->getvalue()" works for every kind of value.
+//! Code that needs the Data object itself can still get an owning handle from get().
 class data_ptr
 {
 public:
-    data_ptr() {}
+    enum Kind : uint8_t
+    {
+        NONE,
+        BOOL,
+        INT,
+        STRING,   //!< Inline string.
+        LOOP,     //!< Inline "loop" variable, read like a map.
+        VALUE,    //!< Heap DataValue; this and the following kinds are reference counted.
+        LIST,
+        MAP,
+        TEMPLATE,
+    };
+
+    data_ptr() { clear(); }
     template <typename T>
     data_ptr(const T &data)
     {
+        clear();
         this->operator=(data);
     }
+    data_ptr(std::string &&data)
+    {
+        clear();
+        this->operator=(std::move(data));
+    }
+    data_ptr(const char *data)
+    {
+        clear();
+        set_string(data, std::strlen(data));
+    }
+    data_ptr(data_map &&data)
+    {
+        clear();
+        this->operator=(std::move(data));
+    }
+    data_ptr(data_list &&data)
+    {
+        clear();
+        this->operator=(std::move(data));
+    }
     data_ptr(DataBool *data);
     data_ptr(DataInt *data);
     data_ptr(DataValue *data);
     data_ptr(DataList *data);
     data_ptr(DataMap *data);
     data_ptr(DataTemplate *data);
-    data_ptr(const data_ptr &data) { ptr = data.ptr; }
-    data_ptr(data_ptr &&data) { ptr = std::move(data.ptr); }
+    data_ptr(const data_ptr &data)
+    {
+        std::memcpy(m_bytes, data.m_bytes, sizeof(m_bytes));
+        retain();
+    }
+    data_ptr(data_ptr &&data)
+    {
+        std::memcpy(m_bytes, data.m_bytes, sizeof(m_bytes));
+        data.clear();
+    }
     data_ptr &operator=(const data_ptr &data)
     {
-        ptr = data.ptr;
+        data.retain();
+        release();
+        std::memcpy(m_bytes, data.m_bytes, sizeof(m_bytes));
         return *this;
     }
     data_ptr &operator=(data_ptr &&data)
     {
-        ptr = std::move(data.ptr);
+        if (this != &data)
+        {
+            release();
+            std::memcpy(m_bytes, data.m_bytes, sizeof(m_bytes));
+            data.clear();
+        }
         return *this;
     }
     data_ptr &operator=(std::string &&data);
+    data_ptr &operator=(const char *data)
+    {
+        set_string(data, std::strlen(data));
+        return *this;
+    }
     data_ptr &operator=(data_map &&data);
     data_ptr &operator=(data_list &&data);
     template <typename T>
     void operator=(const T &data);
     void push_back(const data_ptr &data);
-    virtual ~data_ptr() {}
-    Data *operator->() { return ptr.get(); }
-    std::shared_ptr<Data> get() { return ptr; }
-    bool is_template() const;
+    ~data_ptr() { release(); }
+
+    data_ptr *operator->() { return this; }
+    const data_ptr *operator->() const { return this; }
+
+    //! @brief Creates the "loop" variable for iteration @a index of @a count.
+    //!
+    //! The members (index, first, count, etc.) are computed when looked up, so creating a
+    //! loop value does not allocate. getmap() converts it into a real map in place.
+    static data_ptr make_loop(uint32_t index, uint32_t count);
+
+    //! Returns the named member of a LOOP value. Throws data_map::key_error if there is none.
+    data_ptr loop_member(const std::string &name) const;
+
+    //! Reads the named member of a LOOP value into @a result. Returns false if there is none.
+    bool find_loop_member(boost::string_view name, data_ptr &result) const;
+
+    Kind kind() const { return static_cast<Kind>(m_bytes[k_kind_byte]); }
+    bool is_template() const { return kind() == TEMPLATE; }
+
+    //! @brief Returns a handle to the Data object holding the value.
+    //!
+    //! A value stored on the heap is shared with the handle. An inline value is copied
+    //! into a new Data object, except a "loop" value, which is first converted into a
+    //! map in place. Returns an empty handle if there is no value.
+    std::shared_ptr<Data> get();
+
+    //! Returns the heap object holding the value, or nullptr for inline values.
+    Data *raw() const { return is_shared() ? m_ptr : nullptr; }
+
+    //! Returns false if the heap object holding the value is also held by another data_ptr.
+    bool unique() const { return !is_shared() || m_ptr->m_refs.load(std::memory_order_acquire) == 1; }
+
+    // Data accessors.
+    bool empty() const;
+    std::string getvalue() const;
+
+    //! @brief Returns the value as text without copying a stored string.
+    //!
+    //! Other values are formatted into @a buffer, which the result then refers to. The
+    //! result is valid until this value or @a buffer changes.
+    boost::string_view getview(std::string &buffer) const;
+    data_list &getlist();
+    data_map &getmap();
+    int getint() const;
+    void dump(int indent = 0) const;
+
+private:
+    static const size_t k_inline_capacity = 14; //!< Max length of an inline string.
+    static const size_t k_size_byte = 14;       //!< Byte holding the inline string length.
+    static const size_t k_kind_byte = 15;       //!< Byte holding the Kind.
+
+    union
+    {
+        Data *m_ptr;
+        int m_int;
+        bool m_bool;
+        struct
+        {
+            uint32_t index;
+            uint32_t count;
+        } m_loop;
+        char m_bytes[16];
+    };
+
+    bool is_shared() const { return kind() >= VALUE; }
+    void set_kind(Kind kind) { m_bytes[k_kind_byte] = kind; }
+    void clear()
+    {
+        std::memset(m_bytes, 0, sizeof(m_bytes));
+    }
+    void retain() const
+    {
+        if (is_shared())
+        {
+            m_ptr->m_refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    void release()
+    {
+        if (is_shared() && m_ptr->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            delete m_ptr;
+        }
+    }
+    void adopt(Data *data, Kind kind);
+    void set_bool(bool value)
+    {
+        release();
+        clear();
+        m_bool = value;
+        set_kind(BOOL);
+    }
+    void set_int(int value)
+    {
+        release();
+        clear();
+        m_int = value;
+        set_kind(INT);
+    }
+    void set_string(const char *value, size_t length);
+    void set_string(std::string &&value);
+};
+
+//! @brief Hash of a data_map key string.
+size_t hash_key(boost::string_view key);
+
+namespace impl
+{
+inline uint32_t highest_bit(uint32_t x)
+{
+#if defined(__GNUC__)
+    return 31 - __builtin_clz(x);
+#else
+    uint32_t bit = 0;
+    while (x >>= 1)
+    {
+        ++bit;
+    }
+    return bit;
+#endif
+}
+}
+
+//! @brief Process-wide table of interned data_map keys.
+//!
+//! Every key stored in a data_map, and every key named by a template, is interned here
+//! once and referred to by its 32-bit symbol from then on. Maps store symbols instead of
+//! key strings, and templates look keys up by symbol. Symbols are reference counted:
+//! maps hold a reference for each of their keys and templates for each key they name,
+//! and a symbol is removed when its last reference is released. Its number is then
+//! reused for a later key, so keys taken from runtime values, such as the IDs keying a
+//! map of users, don't accumulate. Looking up an existing symbol takes no lock, so the
+//! table may be used from any number of threads.
+class SymbolTable
+{
+public:
+    typedef uint32_t symbol_t;
+
+    SymbolTable();
+    ~SymbolTable();
+
+    //! @brief Returns the symbol for @a name, adding it if it is new.
+    //!
+    //! The caller holds a reference on the symbol and must release() it when done.
+    symbol_t intern(boost::string_view name);
+
+    //! @brief Looks up the symbol for @a name without adding it. Returns false if none.
+    //!
+    //! No reference is added, so the symbol may be removed, and its number reused for
+    //! another key, unless something else holds a reference on it.
+    bool find(boost::string_view name, symbol_t &symbol) const;
+
+    //! @brief Returns the key string of a symbol, which must be referenced.
+    const std::string &name(symbol_t symbol) const;
+
+    //! @brief Adds a reference to a symbol that already has one.
+    void retain(symbol_t symbol)
+    {
+        symbol_at(symbol).refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    //! @brief Releases a reference, removing the symbol if it was the last.
+    void release(symbol_t symbol)
+    {
+        if (symbol_at(symbol).refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            remove(symbol);
+        }
+    }
+
+    //! @brief Number of symbols in the table.
+    size_t size() const { return m_count.load(std::memory_order_acquire); }
+
+    static SymbolTable &global();
+
+private:
+    struct Symbol
+    {
+        Symbol()
+        : name()
+        , hash(0)
+        , refs(0)
+        , live(false)
+        {
+        }
+        std::string name;
+        size_t hash;
+        std::atomic<uint32_t> refs;
+        bool live; //!< In the index. Only used with m_mutex held.
+    };
+
+    // Open-addressed index of symbol + 1, or k_removed for a removed symbol. A full
+    // index is replaced by a larger one.
+    struct Index
+    {
+        size_t mask;
+        std::unique_ptr<std::atomic<uint32_t>[]> slots;
+    };
+
+    static const uint32_t k_block_count = 27;
+    static const uint32_t k_removed = UINT32_MAX;
+
+    //! Symbol storage. Block 0 holds 64 symbols and each later block doubles the
+    //! capacity, so symbols never move once added.
+    std::atomic<Symbol *> m_blocks[k_block_count];
+    std::atomic<Index *> m_index;
+    std::unique_ptr<Index> m_current_index;
+    std::atomic<uint32_t> m_count;
+    uint32_t m_allocated;  //!< Symbol numbers handed out so far, including free ones.
+    uint32_t m_index_used; //!< Slots of the current index in use, including removed ones.
+
+    //! Removed symbols and replaced indexes are only reused or freed once no lock-free
+    //! lookup is running, as one may have found them just before they were removed.
+    mutable std::atomic<uint32_t> m_readers;
+    std::vector<symbol_t> m_removed;
+    std::vector<std::unique_ptr<Index> > m_old_indexes;
+    std::vector<symbol_t> m_free;
+    std::mutex m_mutex; //!< Serializes adding and removing symbols.
+
+    Symbol &symbol_at(uint32_t i) const
+    {
+        if (i < 64)
+        {
+            return m_blocks[0].load(std::memory_order_acquire)[i];
+        }
+        uint32_t bit = impl::highest_bit(i);
+        return m_blocks[bit - 5].load(std::memory_order_acquire)[i - (1u << bit)];
+    }
+    bool find(boost::string_view name, size_t hash, symbol_t &symbol, bool retain) const;
+    symbol_t add(boost::string_view name, size_t hash);
+    void add_to_index(Index &index, uint32_t i);
+    void remove(symbol_t symbol);
+    void reclaim();
+};
+
+//! @brief A reference on an interned symbol, released when the holder is destroyed.
+class SymbolRef
+{
+public:
+    SymbolRef()
+    : m_symbol(k_none)
+    {
+    }
+    //! Interns @a name.
+    explicit SymbolRef(boost::string_view name)
+    : m_symbol(SymbolTable::global().intern(name))
+    {
+    }
+    //! Adds a reference to @a symbol, which must already be referenced.
+    explicit SymbolRef(SymbolTable::symbol_t symbol)
+    : m_symbol(symbol)
+    {
+        SymbolTable::global().retain(symbol);
+    }
+    SymbolRef(const SymbolRef &other)
+    : m_symbol(other.m_symbol)
+    {
+        if (m_symbol != k_none)
+        {
+            SymbolTable::global().retain(m_symbol);
+        }
+    }
+    SymbolRef(SymbolRef &&other) NOEXCEPT
+    : m_symbol(other.m_symbol)
+    {
+        other.m_symbol = k_none;
+    }
+    SymbolRef &operator=(SymbolRef other)
+    {
+        std::swap(m_symbol, other.m_symbol);
+        return *this;
+    }
+    ~SymbolRef()
+    {
+        if (m_symbol != k_none)
+        {
+            SymbolTable::global().release(m_symbol);
+        }
+    }
+
+    operator SymbolTable::symbol_t() const { return m_symbol; }
+
+private:
+    static const SymbolTable::symbol_t k_none = UINT32_MAX;
+    SymbolTable::symbol_t m_symbol;
+};
+
+//! @brief Hit counts for the lookup caches kept in KeyPath segments.
+struct LookupStats
+{
+    size_t hits;   //!< Segments found at the entry where they were last found.
+    size_t misses; //!< Segments that needed a full hash lookup.
+};
+
+//! @brief Lookup cache counts summed over all renders that have finished.
+LookupStats lookup_stats();
+void reset_lookup_stats();
+
+//! @brief A dotted key path such as "a.b.c", split into interned segments.
+//!
+//! Templates store the key paths they reference in this form when they are parsed, so
+//! looking one up neither splits nor hashes strings. Each segment also remembers the
+//! entry number where it was last found. Maps built the same way, such as the records
+//! of a list, hold the same key at the same entry, so a lookup first checks that entry
+//! and only falls back to the hash index if it holds a different key.
+class KeyPath
+{
+public:
+    struct Segment
+    {
+        std::string name;
+        SymbolRef symbol;
+        mutable std::atomic<uint32_t> hint; //!< Entry number where the segment was last found.
+
+        explicit Segment(const std::string &segment_name)
+        : name(segment_name)
+        , symbol(segment_name)
+        , hint(0)
+        {
+        }
+        Segment(const Segment &other)
+        : name(other.name)
+        , symbol(other.symbol)
+        , hint(other.hint.load(std::memory_order_relaxed))
+        {
+        }
+        Segment &operator=(const Segment &other)
+        {
+            name = other.name;
+            symbol = other.symbol;
+            hint.store(other.hint.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    KeyPath() = default;
+    explicit KeyPath(const std::string &path);
+
+    const std::string &str() const { return m_path; }
+    const std::vector<Segment> &segments() const { return m_segments; }
+    bool empty() const { return m_segments.empty(); }
 
 private:
-    std::shared_ptr<Data> ptr;
+    std::string m_path;
+    std::vector<Segment> m_segments;
 };
 
 class data_map
@@ -200,20 +628,148 @@ public:
     };
 
     data_map()
-    : data()
+    : m_inline()
+    , m_table(nullptr)
+    , m_size(0)
     , parent(nullptr)
+    , m_parent_read_only(false)
     {
     }
+    //! @brief Copies share their entries until one of the maps is modified.
+    //!
+    //! Copying a map costs the same however many entries it has. Adding to or modifying
+    //! a map whose entries are shared first copies the entries, one level deep as a
+    //! full copy would, so the other maps are unaffected. A map that has handed out a
+    //! reference to a value past its first few is copied in full, as writes through the
+    //! reference must not reach the copy.
+    data_map(const data_map &other);
+    data_map(data_map &&other) NOEXCEPT;
+    data_map &operator=(const data_map &other);
+    data_map &operator=(data_map &&other) NOEXCEPT;
+    ~data_map();
+
     data_ptr &operator[](const std::string &key);
+    //! Like operator[], for a key that has already been interned.
+    data_ptr &operator[](const SymbolRef &key);
     bool empty();
+    size_t size() const { return m_size; }
     bool has(const std::string &key);
     data_ptr &parse_path(const std::string &key, bool create = false);
-    void set_parent(data_map *p) { parent = p; }
+    //! If @a copy_shared is set, each map on the path that is also held by another value
+    //! is first replaced with a copy, so that the other holders don't see the change.
+    data_ptr &parse_path(const KeyPath &path, bool create = false, bool copy_shared = false);
+    //! @brief Reads the value at a key path without modifying any data.
+    //!
+    //! Unlike parse_path(), this can read the members of a "loop" value in place.
+    data_ptr lookup_path(const std::string &key);
+
+    //! @brief Non-throwing lookups for the renderer.
+    //!
+    //! These search the parent maps like operator[], but report a missing key by
+    //! returning nullptr or false rather than throwing key_error, and never insert
+    //! entries. A path through a value that isn't a map still throws TemplateException.
+    //! The KeyPath forms use the path's interned symbols and cached entry numbers, and
+    //! don't allocate. They add their cache hits and misses to @a stats if given.
+    //! Values found this way are for reading: they may be shared with copies of the map,
+    //! so use operator[] or parse_path() to modify them.
+    //@{
+    data_ptr *find(boost::string_view key);
+    data_ptr *find(SymbolTable::symbol_t symbol);
+    data_ptr *find(const KeyPath::Segment &segment, LookupStats *stats = nullptr);
+    data_ptr *find_path(boost::string_view key);
+    data_ptr *find_path(const KeyPath &path, LookupStats *stats = nullptr);
+    bool try_lookup_path(boost::string_view key, data_ptr &result);
+    bool try_lookup_path(const KeyPath &path, data_ptr &result, LookupStats *stats = nullptr);
+    //@}
+
+    //! @brief Calls @a fn(key, value) for each local entry, in insertion order.
+    template <typename F>
+    void for_each(F fn)
+    {
+        unshare();
+        if (m_table)
+        {
+            m_table->referenced = true;
+        }
+        for (uint32_t i = 0; i < m_size; ++i)
+        {
+            Entry &e = entry(i);
+            fn(SymbolTable::global().name(e.symbol), e.value);
+        }
+    }
+
+    //! @brief Look up keys missing from this map in @a p and its parents.
+    //!
+    //! Normally assigning to a key that a parent has modifies the parent's value, and new
+    //! keys are added to the outermost map. If @a read_only is set, the parents are never
+    //! modified through this map: new keys are added here, and a parent's value is copied
+    //! here before it is assigned to. Maps held by such values are still shared.
+    void set_parent(data_map *p, bool read_only = false)
+    {
+        parent = p;
+        m_parent_read_only = read_only;
+    }
 private:
-    std::unordered_map<std::string, data_ptr> data;
+    struct Entry
+    {
+        SymbolRef symbol;
+        data_ptr value;
+    };
+
+    static const uint32_t k_inline_entries = 4; //!< Entries stored in the map object itself.
+    static const uint32_t k_flat_limit = 16;    //!< Largest map searched without an index.
+
+    //! Entries past the inline ones, and the index. Copies of a map share one table
+    //! until either is modified.
+    struct Table
+    {
+        Table()
+        : refs(1)
+        , referenced(false)
+        {
+        }
+        std::atomic<uint32_t> refs;
+        //! A reference to an entry has been handed out, so copies of the map can't
+        //! share the table. Only set on a table that isn't shared.
+        bool referenced;
+        //! The first block holds 4 entries and each later one doubles the capacity.
+        std::vector<std::unique_ptr<Entry[]> > blocks;
+        //! Open-addressed index of entry number + 1, or 0 for an empty slot, by symbol.
+        //! Maps of up to k_flat_limit entries have no index and are searched linearly.
+        std::vector<uint32_t> index;
+    };
+
+    //! Entry storage. The first entries are stored inline and the rest in the table.
+    //! Entries never move once added, so references to values stay valid until the map
+    //! is moved, or is modified while its table is shared.
+    mutable Entry m_inline[k_inline_entries];
+    Table *m_table;
+    uint32_t m_size;
     data_map *parent;
+    bool m_parent_read_only;
 
-    friend class DataMap;
+    Entry &entry(uint32_t i) const
+    {
+        if (i < k_inline_entries)
+        {
+            return m_inline[i];
+        }
+        uint32_t bit = impl::highest_bit(i);
+        return m_table->blocks[bit - 2][i - (1u << bit)];
+    }
+    static const uint32_t k_no_entry = UINT32_MAX;
+    uint32_t find_entry(SymbolTable::symbol_t symbol) const;
+    data_ptr *find_local(SymbolTable::symbol_t symbol) const;
+    data_ptr *find_for_update(SymbolTable::symbol_t symbol);
+    data_ptr &get_or_insert(SymbolTable::symbol_t symbol);
+    data_ptr &insert_inherited(SymbolTable::symbol_t symbol);
+    void unshare();
+    Table *copy_table() const;
+    data_ptr &insert(SymbolTable::symbol_t symbol);
+    void build_index(size_t size);
+    void copy_from(const data_map &other);
+    void move_from(data_map &other);
+    void reset();
 };
 
 class DataMap : public Data
@@ -235,13 +791,25 @@ public:
 };
 
 template <>
-void data_ptr::operator=(const bool &data);
+inline void data_ptr::operator=(const bool &data)
+{
+    set_bool(data);
+}
 template <>
-void data_ptr::operator=(const int &data);
+inline void data_ptr::operator=(const int &data)
+{
+    set_int(data);
+}
 template <>
-void data_ptr::operator=(const unsigned int &data);
+inline void data_ptr::operator=(const unsigned int &data)
+{
+    set_int(static_cast<int>(data));
+}
 template <>
-void data_ptr::operator=(const std::string &data);
+inline void data_ptr::operator=(const std::string &data)
+{
+    set_string(data.data(), data.size());
+}
 template <>
 void data_ptr::operator=(const data_map &data);
 template <>
@@ -279,39 +847,43 @@ public:
 // convenience functions for making data objects
 inline data_ptr make_data(bool val)
 {
-    return data_ptr(new DataBool(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(int val)
 {
-    return data_ptr(new DataInt(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(unsigned int val)
 {
-    return data_ptr(new DataInt(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(std::string &val)
 {
-    return data_ptr(new DataValue(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(std::string &&val)
 {
-    return data_ptr(new DataValue(val));
+    return data_ptr(std::move(val));
+}
+inline data_ptr make_data(const char *val)
+{
+    return data_ptr(val);
 }
 inline data_ptr make_data(data_list &val)
 {
-    return data_ptr(new DataList(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(data_list &&val)
 {
-    return data_ptr(new DataList(val));
+    return data_ptr(std::move(val));
 }
 inline data_ptr make_data(data_map &val)
 {
-    return data_ptr(new DataMap(val));
+    return data_ptr(val);
 }
 inline data_ptr make_data(data_map &&val)
 {
-    return data_ptr(new DataMap(val));
+    return data_ptr(std::move(val));
 }
 template <typename T>
 data_ptr make_data(const T &val)
@@ -321,6 +893,191 @@ data_ptr make_data(const T &val)
 
 void dump_data(data_ptr data);
 
+//! @brief Destination of rendered output.
+//!
+//! The renderer writes through a sink rather than a std::ostream. Output is copied into
+//! the sink's buffer inline, and the sink is only called through a virtual function once
+//! the buffer is full. Sinks are provided for a std::string, a fixed buffer, a file
+//! descriptor and a std::ostream. Derive from OutputSink to write anywhere else.
+class OutputSink
+{
+public:
+    OutputSink()
+    : m_pos(nullptr)
+    , m_end(nullptr)
+    {
+    }
+    virtual ~OutputSink() = default;
+
+    void write(const char *data, size_t size)
+    {
+        if (size <= static_cast<size_t>(m_end - m_pos))
+        {
+            std::memcpy(m_pos, data, size);
+            m_pos += size;
+            return;
+        }
+        overflow(data, size);
+    }
+    void write(boost::string_view text) { write(text.data(), text.size()); }
+
+    //! @brief Writes text that stays unchanged for as long as the template exists.
+    //!
+    //! The renderer writes the template's own text this way. Sinks that can refer to
+    //! the text instead of copying it override this.
+    virtual void write_static(const char *data, size_t size) { write(data, size); }
+
+    //! @brief Passes buffered output on to its destination.
+    virtual void flush() = 0;
+
+protected:
+    //! @brief Called with output that doesn't fit in the rest of the buffer.
+    virtual void overflow(const char *data, size_t size) = 0;
+
+    void set_buffer(char *begin, char *end)
+    {
+        m_pos = begin;
+        m_end = end;
+    }
+
+    char *m_pos; //!< Where the next output goes. Never null once a sink is constructed.
+    char *m_end; //!< End of the buffer.
+};
+
+//! @brief Appends output to a std::string.
+//!
+//! Output is written straight into the string's storage, which grows geometrically.
+//! Until flush() is called or the sink is destroyed, the string may hold unused bytes
+//! past the output, and must not be changed other than through the sink.
+class StringSink : public OutputSink
+{
+public:
+    explicit StringSink(std::string &output);
+    ~StringSink();
+    virtual void flush();
+
+protected:
+    virtual void overflow(const char *data, size_t size);
+
+private:
+    std::string &m_output;
+};
+
+//! @brief Writes output into a fixed buffer supplied by the caller.
+//!
+//! Output past the end of the buffer is dropped and truncated() becomes true. The
+//! output is not null terminated.
+class BufferSink : public OutputSink
+{
+public:
+    BufferSink(char *buffer, size_t size);
+    virtual void flush() {}
+
+    size_t size() const { return m_pos - m_begin; }
+    bool truncated() const { return m_truncated; }
+
+protected:
+    virtual void overflow(const char *data, size_t size);
+
+private:
+    char *m_begin;
+    bool m_truncated;
+};
+
+//! @brief Buffered output to a file descriptor.
+//!
+//! flush() throws TemplateException if the descriptor can't be written. The descriptor
+//! is not closed by the sink.
+class FileSink : public OutputSink
+{
+public:
+    explicit FileSink(int fd);
+    ~FileSink();
+    virtual void flush();
+
+protected:
+    virtual void overflow(const char *data, size_t size);
+
+private:
+    void write_file(const char *data, size_t size);
+
+    int m_fd;
+    char m_buffer[8192];
+};
+
+//! @brief Collects output as a list of segments without copying the template's text.
+//!
+//! Text from the template itself is referred to where it lives in the template, and
+//! only output produced by the render is copied, into chunks owned by the sink. The
+//! segments can be handed to writev() or a network stack as they are. They stay valid
+//! until the sink is cleared or destroyed, and those referring to template text only for
+//! as long as the template exists. Pieces of template text shorter than k_min_borrowed
+//! are copied, as a segment costs more than copying them.
+class SegmentSink : public OutputSink
+{
+public:
+    struct Segment
+    {
+        const char *data;
+        size_t size;
+    };
+
+    static const size_t k_min_borrowed = 32;
+
+    SegmentSink();
+
+    virtual void write_static(const char *data, size_t size);
+    virtual void flush();
+
+    //! Complete once flush() has been called, which eval() does when it returns.
+    const std::vector<Segment> &segments() const { return m_segments; }
+    //! Total size of the segments.
+    size_t size() const { return m_size; }
+    //! The segments joined into one string.
+    std::string str() const;
+    //! Drops all segments, keeping the first chunk for reuse.
+    void clear();
+
+protected:
+    virtual void overflow(const char *data, size_t size);
+
+private:
+    struct Chunk
+    {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    static const size_t k_first_chunk = 4096;
+
+    void add_chunk(size_t size);
+    void add_segment(const char *data, size_t size);
+
+    std::vector<Segment> m_segments;
+    std::vector<Chunk> m_chunks; //!< Chunks never move, so segments can point into them.
+    char *m_run;                 //!< Start of the output copied since the last segment.
+    size_t m_size;
+};
+
+//! @brief Buffered output to a std::ostream.
+//!
+//! flush() throws whatever the stream throws for a failed write, if its exceptions are
+//! enabled. The destructor doesn't.
+class StreamSink : public OutputSink
+{
+public:
+    explicit StreamSink(std::ostream &stream);
+    ~StreamSink();
+    virtual void flush();
+
+protected:
+    virtual void overflow(const char *data, size_t size);
+
+private:
+    std::ostream &m_stream;
+    char m_buffer[4096];
+};
+
 namespace impl
 {
 // node classes
@@ -328,32 +1085,229 @@ class Node;
 typedef std::shared_ptr<Node> node_ptr;
 typedef std::vector<node_ptr> node_vector;
 
+class Program;
+typedef std::shared_ptr<Program> program_ptr;
+
+struct RenderContext;
+class ExprKeyPath;
+class NodeDef;
+
 } // namespace impl
 
 // List of param names.
 typedef std::vector<std::string> string_vector;
 
+//! @brief Per-node statistics collected while rendering.
+//!
+//! Pass a profiler to DataTemplate::eval() to record, for each template line, how often
+//! its nodes ran, the time spent in them with and without their nested nodes, and the
+//! bytes they wrote. Subtemplate calls are recorded by subtemplate name. Results accumulate
+//! over renders until clear() is called. A profiler must only be used by one render at
+//! a time.
+class Profiler
+{
+public:
+    struct Entry
+    {
+        std::string label;     //!< Node kind and line such as "for:12", or "call:name" for a subtemplate.
+        uint32_t line;         //!< Template line of the node, or of the first call of the subtemplate.
+        uint64_t calls;        //!< Number of times the node ran.
+        uint64_t inclusive_ns; //!< Time including nested nodes. Recursive calls are counted once.
+        uint64_t exclusive_ns; //!< Time excluding nested nodes.
+        uint64_t bytes;        //!< Bytes written, including nested nodes.
+    };
+
+    //! @brief Statistics per label, highest exclusive time first.
+    std::vector<Entry> entries() const;
+
+    //! @brief Write entries() as a table.
+    void report(std::ostream &stream) const;
+
+    //! @brief Write call stacks in the folded format read by flame graph tools.
+    //!
+    //! Each line is a stack of labels separated by semicolons, followed by the
+    //! exclusive time spent in that stack in microseconds.
+    void write_folded(std::ostream &stream) const;
+
+    void clear();
+
+    // Called by the renderer around each node.
+    void enter(const void *key, const char *kind, uint32_t line, const char *name, size_t output_size);
+    void leave(size_t output_size);
+
+private:
+    // A node in the tree of call stacks seen so far.
+    struct Frame
+    {
+        const void *key;
+        size_t parent;
+        std::string label;
+        uint32_t line;
+        uint64_t exclusive_ns;
+        std::vector<size_t> children;
+    };
+
+    // A frame currently being rendered.
+    struct Active
+    {
+        size_t frame;
+        uint64_t start_ns;
+        uint64_t child_ns;
+        size_t start_output;
+    };
+
+    std::vector<Frame> m_frames;
+    std::vector<Active> m_stack;
+    std::unordered_map<std::string, Entry> m_entries;
+};
+
+//! @brief Fixed set of worker threads for rendering in parallel.
+//!
+//! One pool may be shared by any number of templates and renders. The thread calling
+//! parallel_for() works alongside the pool's threads, so a pool without threads runs
+//! everything on the calling thread, and parallel_for() may be called from a task.
+//! The calls are shared out by work stealing: each thread starts on an equal range of
+//! them, and one that runs out takes half of what another has left. Calls of uneven
+//! cost are thereby balanced without the threads contending for every call.
+class ThreadPool
+{
+public:
+    //! @brief Starts one thread fewer than the number of cores.
+    ThreadPool();
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+
+    size_t size() const { return m_threads.size(); }
+
+    //! @brief Calls @a fn(i) for each i in [0, count) and waits for all calls to finish.
+    //!
+    //! If any calls throw, the first exception caught is rethrown once the others are done.
+    void parallel_for(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+    struct Job;
+
+    void start(size_t threads);
+    void worker();
+    static void run_job(Job &job);
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::deque<std::shared_ptr<Job> > m_jobs; //!< Jobs that may still have calls to start.
+    bool m_stopping;
+};
+
+//! @brief Output of one render of a batch.
+struct BatchResult
+{
+    std::string output;       //!< Output, up to the point of failure if the render threw.
+    std::exception_ptr error; //!< Set if the render threw.
+};
+
 class DataTemplate : public Data
 {
     impl::node_vector m_tree;
     string_vector m_params;
+    std::shared_ptr<const std::vector<SymbolRef> > m_param_symbols; //!< Interned m_params, if set by a def.
+    impl::program_ptr m_program;
+    std::atomic<size_t> m_output_hint; //!< Running estimate of the output size.
+    ThreadPool *m_pool;
+    size_t m_parallel_min_items;
+    bool m_may_stop; //!< A render may end early with key_error, after writing some output.
+
+    friend class impl::ExprKeyPath;
+    friend class impl::NodeDef;
 
 public:
     DataTemplate(const std::string &templateText);
-    DataTemplate(const impl::node_vector &tree)
-    : m_tree(tree)
-    {
-    }
-    DataTemplate(impl::node_vector &&tree)
-    : m_tree(std::move(tree))
-    {
-    }
+    DataTemplate(const impl::node_vector &tree);
+    DataTemplate(impl::node_vector &&tree);
+    DataTemplate(const impl::node_vector &tree, const impl::program_ptr &program);
     virtual std::string getvalue();
     virtual bool empty();
+    //! @brief Render the template.
+    //!
+    //! Rendering keeps no state outside of its arguments, so one template may be
+    //! evaluated on several threads at once as long as each has its own data_map.
     std::string eval(data_map &data, data_list *param_values = nullptr);
+    //! @brief Render into @a output, replacing its contents but keeping its storage.
+    //!
+    //! Rendering repeatedly into the same string does not allocate once the string
+    //! has grown to fit the output.
+    void eval(std::string &output, data_map &data, data_list *param_values = nullptr);
     void eval(std::ostream &stream, data_map &data, data_list *param_values = nullptr);
+    //! @brief Render into @a sink, which is flushed at the end.
+    void eval(OutputSink &sink, data_map &data, data_list *param_values = nullptr);
+
+    //! @brief Render as part of an enclosing render, continuing its context.
+    //!
+    //! If @a param_values is set, its first @a param_count values are bound to the
+    //! template's parameters.
+    std::string eval(data_map &data, const data_ptr *param_values, size_t param_count, impl::RenderContext &context);
+    void eval(OutputSink &sink, data_map &data, const data_ptr *param_values, size_t param_count, impl::RenderContext &context);
+
+    //! @brief Render while recording per-node statistics into @a profiler.
+    //!
+    //! A profiled render walks the node tree even if the template is compiled, so that
+    //! time can be attributed to individual nodes.
+    std::string eval(data_map &data, Profiler &profiler);
+    void eval(std::ostream &stream, data_map &data, Profiler &profiler);
+    void eval(OutputSink &sink, data_map &data, Profiler &profiler);
     string_vector &params() { return m_params; }
     void dump(int indent = 0);
+
+    //! @brief Expected output size, learned from previous renders into strings.
+    //!
+    //! Renders into a string reserve this much up front. Zero until the first such render.
+    size_t output_size_hint() const { return m_output_hint.load(std::memory_order_relaxed); }
+
+    //! @brief Flatten the node tree into a linear program.
+    //!
+    //! Once compiled, eval() runs the program in a single interpreter loop instead of
+    //! recursively walking the node tree. The output is identical either way.
+    void compile();
+    bool is_compiled() const { return m_program != nullptr; }
+
+    //! @brief Render large for loops concurrently on @a pool, or serially if null.
+    //!
+    //! A loop over at least @a min_items items whose body doesn't assign to the data is
+    //! split into chunks of iterations that are rendered on the pool. Their output is
+    //! written in order and is the same as a serial render's. A body with set or def
+    //! statements, including in nested if and for blocks, or that calls a subtemplate,
+    //! which may assign, runs serially. Calls are only found once the body runs, so the
+    //! first render of such a loop is started on the pool and then done again serially,
+    //! and later renders of it are serial from the start. Loops nested in a parallel
+    //! loop run serially, and so do profiled renders.
+    void set_parallel_loops(ThreadPool *pool, size_t min_items = 10000)
+    {
+        m_pool = pool;
+        m_parallel_min_items = min_items;
+    }
+
+    //! @brief Render once for each map in @a items, concurrently on @a pool.
+    //!
+    //! The template is compiled first if it isn't already. Each render writes its loop
+    //! variables and set values into its own map only. A map reached from several items,
+    //! such as one shared configuration map, is never modified: assigning to one of its
+    //! members first replaces the item's value with a copy of the map. An error in one
+    //! render is recorded in its result and doesn't affect the others. The number of
+    //! renders at once is the pool's size plus one, for the calling thread.
+    std::vector<BatchResult> eval_batch(std::vector<data_map> &items, ThreadPool &pool);
+
+    //! @brief Render a batch, passing the results to @a consume in order as they finish.
+    //!
+    //! Items are rendered a window at a time, a few per thread, so that memory use
+    //! doesn't grow with the batch. @a consume is called on the calling thread with each
+    //! item's index and result. The result is only valid during the call, as its output
+    //! string is reused for a later item.
+    void eval_batch(std::vector<data_map> &items, ThreadPool &pool,
+                    const std::function<void(size_t index, const BatchResult &result)> &consume);
+
+private:
+    void eval_batch_item(data_map &data, BatchResult &result);
+    void reserve_output(std::string &output) const;
+    void update_output_hint(size_t size);
 };
 
 inline data_ptr make_template(const std::string &templateText, const string_vector *param_names = nullptr)
@@ -366,8 +1320,76 @@ inline data_ptr make_template(const std::string &templateText, const string_vect
     return data_ptr(t);
 }
 
+typedef std::shared_ptr<DataTemplate> template_ptr;
+
+//! @brief Thread-safe cache of parsed templates with LRU eviction.
+//!
+//! Templates are looked up either by their text or by a name registered with add().
+//! Both kinds of entry share one least-recently-used list. Once the cache holds more
+//! than capacity() entries, the oldest are evicted. Cached templates are compiled, and
+//! may be rendered by several threads at once.
+class TemplateCache
+{
+public:
+    struct Stats
+    {
+        size_t hits;      //!< Lookups answered from the cache.
+        size_t misses;    //!< Lookups that had to parse (by text) or found nothing (by name).
+        size_t evictions; //!< Entries dropped to stay within capacity.
+        size_t size;      //!< Current number of entries.
+    };
+
+    explicit TemplateCache(size_t capacity = 128);
+
+    //! @brief Returns the template for @a text, parsing and caching it on a miss.
+    //!
+    //! Throws TemplateException if the text does not parse; nothing is cached then.
+    template_ptr get(const std::string &text);
+
+    //! @brief Parses @a text and caches it under @a name, replacing any previous entry.
+    template_ptr add(const std::string &name, const std::string &text);
+
+    //! Returns the template registered under @a name, or nullptr.
+    template_ptr find(const std::string &name);
+
+    void set_capacity(size_t capacity);
+    size_t capacity() const;
+    void clear();
+    Stats stats() const;
+
+    //! The cache used by the free parse() functions.
+    static TemplateCache &global();
+
+private:
+    struct Entry
+    {
+        bool is_named;
+        size_t hash; //!< hash_key() of the text, for an entry that isn't named.
+        std::string key; //!< The name or the template text.
+        template_ptr tmpl;
+    };
+    typedef std::list<Entry> entry_list;
+    typedef std::unordered_map<std::string, entry_list::iterator> name_index;
+    //! Entries by the hash of their text, which is only kept in the entry.
+    typedef std::unordered_multimap<size_t, entry_list::iterator> text_index;
+
+    mutable std::mutex m_mutex;
+    size_t m_capacity;
+    entry_list m_entries; //!< Most recently used first.
+    text_index m_by_text;
+    name_index m_by_name;
+    Stats m_stats;
+
+    entry_list::iterator find_text(const std::string &text, size_t hash);
+    entry_list::iterator find_name(const std::string &name);
+    template_ptr lookup(entry_list::iterator it);
+    void insert(entry_list::iterator it, Entry &&entry);
+    void trim();
+};
+
 // The big daddy. Pass in the template and data,
-// and get out a completed doc.
+// and get out a completed doc. Templates are cached by TemplateCache::global(),
+// so repeated calls with the same text only parse it once.
 void parse(std::ostream &stream, const std::string &templ_text, data_map &data);
 std::string parse(const std::string &templ_text, data_map &data);
 }
@@ -0,0 +1,620 @@
+// Copyright (c) 2014-2016 Freescale Semiconductor, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// Benchmarks for cpptempl. Build and run with "make bench".
+//
+// Usage: cpptempl_bench [--json FILE] [--filter TEXT] [--quick]
+//
+// A table of results is printed to stdout. With --json, the results are also written
+// to FILE in a machine-readable form for tracking regressions between releases. Only
+// benchmarks whose name contains TEXT are run if --filter is given. --quick cuts the
+// iteration counts for a fast smoke run. All inputs are generated deterministically,
+// so results are comparable between runs.
+
+#define CPPTEMPL_UNIT_TEST
+#include "cpptempl.h"
+#include "cpptempl.cpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <thread>
+#include <sys/resource.h>
+
+// Count heap allocations made by the benchmarks, per thread.
+static thread_local size_t s_alloc_count = 0;
+static thread_local size_t s_alloc_bytes = 0;
+
+void *operator new(size_t size)
+{
+    ++s_alloc_count;
+    s_alloc_bytes += size;
+    if (void *p = malloc(size))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+using namespace cpptempl;
+using namespace cpptempl::impl;
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////
+// Harness
+//////////////////////////////////////////////////////////////////////////
+
+struct BenchResult
+{
+    std::string name;
+    size_t iterations;
+    double min_ms;
+    double median_ms;
+    double mean_ms;
+    size_t bytes;           //!< Input or output size processed per iteration, if meaningful.
+    double allocs;          //!< Heap allocations per iteration.
+    double alloc_kb;        //!< KiB allocated per iteration.
+    double lookup_hit_rate; //!< Fraction of key path lookups answered by the lookup cache.
+};
+
+class Bench
+{
+    std::string m_filter;
+    bool m_quick;
+    std::vector<BenchResult> m_results;
+
+public:
+    Bench(const std::string &filter, bool quick)
+    : m_filter(filter)
+    , m_quick(quick)
+    , m_results()
+    {
+    }
+
+    bool wants(const std::string &name) const { return name.find(m_filter) != std::string::npos; }
+
+    //! @brief Times @a fn, after one warmup call, over @a iterations calls.
+    //!
+    //! @a bytes is reported as throughput if it is non-zero.
+    void run(const std::string &name, size_t iterations, size_t bytes, std::function<void()> fn)
+    {
+        if (!wants(name))
+        {
+            return;
+        }
+        if (m_quick)
+        {
+            iterations = std::max<size_t>(1, iterations / 10);
+        }
+
+        fn();
+
+        std::vector<double> times;
+        reset_lookup_stats();
+        size_t allocs_before = s_alloc_count;
+        size_t bytes_before = s_alloc_bytes;
+        for (size_t i = 0; i < iterations; ++i)
+        {
+            auto start = std::chrono::steady_clock::now();
+            fn();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            times.push_back(elapsed.count());
+        }
+
+        BenchResult result;
+        result.name = name;
+        result.iterations = iterations;
+        result.allocs = double(s_alloc_count - allocs_before) / iterations;
+        result.alloc_kb = double(s_alloc_bytes - bytes_before) / 1024 / iterations;
+        result.bytes = bytes;
+        LookupStats lookups = lookup_stats();
+        result.lookup_hit_rate = lookups.hits + lookups.misses ? double(lookups.hits) / (lookups.hits + lookups.misses) : 0;
+        double total = 0;
+        for (double t : times)
+        {
+            total += t;
+        }
+        result.mean_ms = total / iterations;
+        std::sort(times.begin(), times.end());
+        result.min_ms = times.front();
+        result.median_ms = times[times.size() / 2];
+        m_results.push_back(result);
+
+        printf("%-36s %10.3f ms %10.3f ms", name.c_str(), result.min_ms, result.median_ms);
+        if (bytes)
+        {
+            printf(" %9.1f MB/s", bytes / result.min_ms / 1e3);
+        }
+        else
+        {
+            printf(" %14s", "");
+        }
+        printf(" %12.0f allocs\n", result.allocs);
+    }
+
+    void write_json(const std::string &path) const
+    {
+        std::ofstream out(path);
+        out << "{\n";
+        out << "  \"format\": 1,\n";
+        out << "  \"compiler\": \"" << __VERSION__ << "\",\n";
+        out << "  \"scanner\": \"" << get_tag_scanners()[0].name << "\",\n";
+        out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n";
+        out << "  \"quick\": " << (m_quick ? "true" : "false") << ",\n";
+        out << "  \"benchmarks\": [\n";
+        for (size_t i = 0; i < m_results.size(); ++i)
+        {
+            const BenchResult &r = m_results[i];
+            out << "    {\"name\": \"" << r.name << "\""
+                << ", \"iterations\": " << r.iterations
+                << ", \"min_ms\": " << r.min_ms
+                << ", \"median_ms\": " << r.median_ms
+                << ", \"mean_ms\": " << r.mean_ms
+                << ", \"bytes\": " << r.bytes
+                << ", \"allocs\": " << r.allocs
+                << ", \"alloc_kb\": " << r.alloc_kb
+                << ", \"lookup_hit_rate\": " << r.lookup_hit_rate
+                << "}" << (i + 1 < m_results.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n";
+        out << "}\n";
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Inputs
+//////////////////////////////////////////////////////////////////////////
+
+// Builds a template of roughly @a size bytes with a tag after every @a text_per_tag
+// bytes of static text.
+std::string make_text_template(size_t size, size_t text_per_tag)
+{
+    static const char k_line[] = "Lorem ipsum dolor sit amet, consectetur {adipiscing} elit.\n";
+    std::string text;
+    text.reserve(size + 64);
+    size_t since_tag = 0;
+    while (text.size() < size)
+    {
+        text += k_line;
+        since_tag += sizeof(k_line) - 1;
+        if (since_tag >= text_per_tag)
+        {
+            text += "{$item.name}";
+            since_tag = 0;
+        }
+    }
+    return text;
+}
+
+data_map make_rows(size_t count)
+{
+    data_list items;
+    items.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        data_map row;
+        row["id"] = (int)i;
+        row["active"] = (i % 3) != 0;
+        row["name"] = "item" + std::to_string(i);
+        row["description"] = "a somewhat longer description string";
+        items.push_back(std::move(row));
+    }
+    data_map data;
+    data["rows"] = std::move(items);
+    return data;
+}
+
+// The scanner the parser used before find_tag(): look for any brace, check the
+// following character, then count newlines in the skipped text separately.
+size_t find_tag_legacy(boost::string_view text, uint32_t &newlines)
+{
+    size_t start = 0;
+    size_t lines = 0;
+    while (true)
+    {
+        size_t pos = text.find('{', start);
+        if (pos == boost::string_view::npos)
+        {
+            newlines = lines + std::count(text.begin() + start, text.end(), '\n');
+            return pos;
+        }
+        lines += std::count(text.begin() + start, text.begin() + pos, '\n');
+        char next = pos + 1 < text.size() ? text[pos + 1] : 0;
+        if (next == '$' || next == '%' || next == '#')
+        {
+            newlines = lines;
+            return pos;
+        }
+        start = pos + 1;
+    }
+}
+
+// Scans a whole template the way TemplateParser::parse() does, returning the line count.
+uint32_t scan_all(tag_scanner_t scan, boost::string_view text)
+{
+    uint32_t lines = 0;
+    while (true)
+    {
+        uint32_t newlines;
+        size_t pos = scan(text, newlines);
+        lines += newlines;
+        if (pos == boost::string_view::npos)
+        {
+            return lines;
+        }
+        text.remove_prefix(pos + 2);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Benchmarks
+//////////////////////////////////////////////////////////////////////////
+
+void bench_tokenizer(Bench &bench)
+{
+    const std::string stmt = "for item in some.list.of_things if (item.count > 10 && item.name != 'skip\\n') "
+                             "|| upper(item.kind) == \"X\" -- trailing comment";
+    bench.run("tokenize/statement", 2000, stmt.size() * 100, [&]() {
+        for (int i = 0; i < 100; ++i)
+        {
+            tokenize_statement(stmt);
+        }
+    });
+}
+
+void bench_scanners(Bench &bench, const char *label, const std::string &text)
+{
+    uint32_t expected = scan_all(find_tag_legacy, text);
+    bench.run(std::string("scan/") + label + "/legacy", 20, text.size(), [&]() { scan_all(find_tag_legacy, text); });
+    for (const TagScanner *s = get_tag_scanners(); s->scan; ++s)
+    {
+        if (scan_all(s->scan, text) != expected)
+        {
+            printf("scan/%s/%s: line count mismatch!\n", label, s->name);
+            continue;
+        }
+        bench.run(std::string("scan/") + label + "/" + s->name, 20, text.size(), [&]() { scan_all(s->scan, text); });
+    }
+}
+
+void bench_parser(Bench &bench)
+{
+    std::string sparse = make_text_template(16 * 1024 * 1024, 4096);
+    std::string dense = make_text_template(4 * 1024 * 1024, 128);
+    bench_scanners(bench, "sparse", sparse);
+    bench_scanners(bench, "dense", dense);
+
+    bench.run("parse/sparse", 5, sparse.size(), [&]() {
+        node_vector nodes;
+        TemplateParser(sparse, nodes).parse();
+    });
+    bench.run("parse/dense", 5, dense.size(), [&]() {
+        node_vector nodes;
+        TemplateParser(dense, nodes).parse();
+    });
+
+    std::string statements;
+    for (int i = 0; i < 2000; ++i)
+    {
+        statements += "{% if a.b > 3 and c %}{$lower(x.y)}{% elif d %}{$'q' if e else f}{% else %}"
+                      "{% for i in list if i.z %}{$i.w}{% endfor %}{% endif %}\n";
+    }
+    bench.run("parse/statements", 20, statements.size(), [&]() {
+        node_vector nodes;
+        TemplateParser(statements, nodes).parse();
+    });
+}
+
+void bench_render(Bench &bench)
+{
+    // Variable-heavy: a page of substitutions with nested key paths.
+    {
+        std::string text;
+        for (int i = 0; i < 1000; ++i)
+        {
+            text += "<td>{$page.user.name}</td><td>{$page.user.id}</td><td>{$page.title}</td>\n";
+        }
+        DataTemplate tmpl(text);
+        tmpl.compile();
+        data_map user;
+        user["name"] = "Somebody Withalongname";
+        user["id"] = 12345;
+        data_map page;
+        page["user"] = std::move(user);
+        page["title"] = "Benchmark";
+        data_map data;
+        data["page"] = std::move(page);
+        size_t size = tmpl.eval(data).size();
+        bench.run("render/vars", 200, size, [&]() { tmpl.eval(data); });
+        std::string output;
+        bench.run("render/vars_reuse", 200, size, [&]() { tmpl.eval(output, data); });
+    }
+
+    // Probing optional keys that are mostly missing.
+    {
+        std::string text;
+        for (int i = 0; i < 1000; ++i)
+        {
+            text += "{% if page.subtitle %}<h2>{$page.subtitle}</h2>{% endif %}{$page.footer}{$missing}\n";
+        }
+        DataTemplate tmpl(text);
+        tmpl.compile();
+        data_map page;
+        page["title"] = "Benchmark";
+        data_map data;
+        data["page"] = std::move(page);
+        size_t size = tmpl.eval(data).size();
+        bench.run("render/missing_keys", 200, size, [&]() { tmpl.eval(data); });
+    }
+
+    // Large for loops, plain and filtered.
+    {
+        data_map data = make_rows(100000);
+        DataTemplate plain("{% for row in rows %}{$row.id} {$row.name}{% if row.active %}*{% endif %}\n{% endfor %}");
+        DataTemplate filtered("{% for row in rows if row.active %}{$loop.index}: {$row.name}\n{% endfor %}");
+        plain.compile();
+        filtered.compile();
+        size_t plain_size = plain.eval(data).size();
+        size_t filtered_size = filtered.eval(data).size();
+        bench.run("render/for_100k", 10, plain_size, [&]() { plain.eval(data); });
+        bench.run("render/for_filtered_100k", 10, filtered_size, [&]() { filtered.eval(data); });
+
+        // The profiled render walks the node tree, so compare against an uncompiled copy.
+        DataTemplate walked("{% for row in rows %}{$row.id} {$row.name}{% if row.active %}*{% endif %}\n{% endfor %}");
+        Profiler profiler;
+        bench.run("render/for_100k_tree", 10, plain_size, [&]() { walked.eval(data); });
+        bench.run("render/for_100k_profiled", 10, plain_size, [&]() { walked.eval(data, profiler); });
+    }
+
+    // Deeply dotted key paths inside a large loop.
+    {
+        data_map data = make_rows(100000);
+        data_map colors;
+        colors["primary"] = "blue";
+        data_map theme;
+        theme["colors"] = std::move(colors);
+        data_map config;
+        config["theme"] = std::move(theme);
+        data_map site;
+        site["config"] = std::move(config);
+        data["site"] = std::move(site);
+        DataTemplate tmpl("{% for row in rows %}{$site.config.theme.colors.primary}{$row.description}\n{% endfor %}");
+        tmpl.compile();
+        size_t size = tmpl.eval(data).size();
+        bench.run("render/deep_paths_100k", 10, size, [&]() { tmpl.eval(data); });
+    }
+
+    // Deeply nested subtemplates.
+    {
+        std::string text = "{% def level0(x) %}{$x}{% enddef %}";
+        for (int i = 1; i <= 50; ++i)
+        {
+            text += "{% def level" + std::to_string(i) + "(x) %}<{$level" + std::to_string(i - 1) + "(x)}>{% enddef %}";
+        }
+        text += "{% for i in items %}{$level50(i)}\n{% endfor %}";
+        DataTemplate tmpl(text);
+        tmpl.compile();
+        data_list items;
+        for (int i = 0; i < 100; ++i)
+        {
+            items.push_back(make_data(i));
+        }
+        data_map data;
+        data["items"] = std::move(items);
+        size_t size = tmpl.eval(data).size();
+        bench.run("render/subtemplate_depth_50", 50, size, [&]() { tmpl.eval(data); });
+    }
+
+    // set and def inside a loop.
+    {
+        DataTemplate tmpl("{% for row in rows %}"
+                          "{% set last = row.name %}{% set total = total + row.id %}"
+                          "{% def show(x) %}[{$x}]{% enddef %}"
+                          "{$show(last)}{% endfor %}{$total}");
+        tmpl.compile();
+        data_map data = make_rows(10000);
+        data["total"] = 0;
+        size_t size = tmpl.eval(data).size();
+        bench.run("render/set_def_10k", 20, size, [&]() { tmpl.eval(data); });
+    }
+
+    // A mostly static page, copied into a string or gathered as segments.
+    {
+        std::string block(2000, '.');
+        std::string text;
+        for (int i = 0; i < 100; ++i)
+        {
+            text += "<div>" + block + "</div>{$title}\n";
+        }
+        DataTemplate tmpl(text);
+        tmpl.compile();
+        data_map data;
+        data["title"] = "Benchmark";
+        size_t size = tmpl.eval(data).size();
+        std::string page;
+        bench.run("render/static_string", 200, size, [&]() {
+            page.clear();
+            StringSink sink(page);
+            tmpl.eval(sink, data);
+        });
+        SegmentSink segments;
+        bench.run("render/static_segments", 200, size, [&]() {
+            segments.clear();
+            tmpl.eval(segments, data);
+        });
+    }
+}
+
+void bench_data(Bench &bench)
+{
+    bench.run("data/build_100k_rows", 5, 0, []() { make_rows(100000); });
+
+    // A per-request context embedding a large site-wide map, with one key overridden.
+    data_map site;
+    for (int i = 0; i < 10000; ++i)
+    {
+        site["setting" + std::to_string(i)] = "value " + std::to_string(i);
+    }
+    bench.run("data/embed_10k_map", 1000, 0, [&]() {
+        data_map request;
+        request["site"] = site;
+        request["site"]->getmap()["setting0"] = "override";
+    });
+}
+
+// Renders one shared template concurrently, each thread with its own copy of the data,
+// and reports the time for each thread to do a fixed number of renders. Allocations
+// are only counted on the calling thread, so they are not meaningful here.
+void bench_threads(Bench &bench)
+{
+    data_map data = make_rows(1000);
+    DataTemplate tmpl("{% for row in rows %}\n{$row.id >}\n: {$row.name}\n{% endfor %}");
+    tmpl.compile();
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned thread_count = 1; thread_count <= max_threads * 2; thread_count *= 2)
+    {
+        bench.run("threads/" + std::to_string(thread_count), 5, 0, [&]() {
+            std::vector<std::thread> threads;
+            for (unsigned t = 0; t < thread_count; ++t)
+            {
+                threads.emplace_back([&]() {
+                    data_map thread_data = data;
+                    for (int i = 0; i < 50; ++i)
+                    {
+                        tmpl.eval(thread_data);
+                    }
+                });
+            }
+            for (auto &thread : threads)
+            {
+                thread.join();
+            }
+        });
+    }
+}
+
+
+// Renders one loop over 500k rows, split across a thread pool of each size.
+void bench_parallel_loop(Bench &bench)
+{
+    data_map data = make_rows(500000);
+    DataTemplate tmpl("{% for row in rows %}{$row.id} {$row.name}{% if row.active %}*{% endif %}\n{% endfor %}");
+    tmpl.compile();
+    size_t size = tmpl.eval(data).size();
+
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned thread_count = 1; thread_count <= max_threads * 2; thread_count *= 2)
+    {
+        ThreadPool pool(thread_count - 1);
+        tmpl.set_parallel_loops(&pool);
+        bench.run("parallel_loop/" + std::to_string(thread_count), 5, size, [&]() { tmpl.eval(data); });
+    }
+}
+
+
+// Renders one template for 2000 small data maps, one after another and as a batch.
+void bench_batch(Bench &bench)
+{
+    std::vector<data_map> items;
+    for (int i = 0; i < 2000; ++i)
+    {
+        items.push_back(make_rows(20 + i % 40));
+    }
+    DataTemplate tmpl("{% for row in rows %}{$row.id} {$row.name}{% if row.active %}*{% endif %}\n{% endfor %}");
+    tmpl.compile();
+
+    bench.run("batch/serial", 5, 0, [&]() {
+        std::string output;
+        for (data_map &data : items)
+        {
+            tmpl.eval(output, data);
+        }
+    });
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned thread_count = 1; thread_count <= max_threads * 2; thread_count *= 2)
+    {
+        ThreadPool pool(thread_count - 1);
+        bench.run("batch/" + std::to_string(thread_count), 5, 0, [&]() {
+            tmpl.eval_batch(items, pool, [](size_t, const BatchResult &) {});
+        });
+    }
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    std::string json_path;
+    std::string filter;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--json") && i + 1 < argc)
+        {
+            json_path = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--filter") && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--quick"))
+        {
+            quick = true;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--json FILE] [--filter TEXT] [--quick]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    Bench bench(filter, quick);
+    printf("%-36s %13s %13s %12s %19s\n", "benchmark", "min", "median", "throughput", "per iteration");
+    bench_data(bench);
+    bench_tokenizer(bench);
+    bench_parser(bench);
+    bench_render(bench);
+    bench_threads(bench);
+    bench_parallel_loop(bench);
+    bench_batch(bench);
+
+    if (!json_path.empty())
+    {
+        bench.write_json(json_path);
+        printf("\nResults written to %s\n", json_path.c_str());
+    }
+    return 0;
+}
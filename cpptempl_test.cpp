@@ -35,6 +35,7 @@
 #include <utility>
 #include <exception>
 #include <cstdint>
+#include <thread>
 
 using namespace boost::unit_test;
 using namespace std ;
@@ -134,6 +135,355 @@ BOOST_AUTO_TEST_SUITE( TestCppData )
         BOOST_CHECK_EQUAL( data2->getmap().parse_path("key")->getvalue(), "bar" ) ;
         BOOST_CHECK_EQUAL( data2->getmap().parse_path("a")->getvalue(), "zz" ) ;
     }
+    BOOST_AUTO_TEST_CASE(test_DataMap_find)
+    {
+        data_map items ;
+        data_map foo;
+        items["a"] = "a";
+        foo["b"] = "b";
+        items["foo"] = foo;
+        items["loop"] = data_ptr::make_loop(1, 3);
+
+        BOOST_CHECK_EQUAL( items.find("a")->getvalue(), "a" );
+        BOOST_CHECK( items.find("b") == nullptr );
+        BOOST_CHECK_EQUAL( items.find_path("foo.b")->getvalue(), "b" );
+        BOOST_CHECK( items.find_path("foo.yy") == nullptr );
+        BOOST_CHECK( items.find_path("xx.yy") == nullptr );
+        BOOST_CHECK( items.find_path("") == nullptr );
+        BOOST_CHECK( !items.has("xx") ) ;
+
+        data_ptr value;
+        BOOST_CHECK( items.try_lookup_path("foo.b", value) );
+        BOOST_CHECK_EQUAL( value->getvalue(), "b" );
+        BOOST_CHECK( !items.try_lookup_path("foo.yy.c", value) );
+        BOOST_CHECK_THROW( items.try_lookup_path("foo.b.c", value), TemplateException );
+        BOOST_CHECK( items.try_lookup_path("loop.index", value) );
+        BOOST_CHECK_EQUAL( value->getvalue(), "2" );
+        BOOST_CHECK( !items.try_lookup_path("loop.bogus", value) );
+        BOOST_CHECK_EQUAL( items["loop"].kind(), data_ptr::LOOP );
+        BOOST_CHECK_THROW( items.lookup_path("foo.yy"), data_map::key_error ) ;
+
+        data_map child;
+        child.set_parent(&items);
+        BOOST_CHECK_EQUAL( child.find_path("foo.b")->getvalue(), "b" );
+        BOOST_CHECK( child.try_lookup_path("a", value) );
+        BOOST_CHECK_EQUAL( value->getvalue(), "a" );
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_key_path)
+    {
+        KeyPath path("foo.bar.c") ;
+        BOOST_CHECK_EQUAL( path.str(), "foo.bar.c" ) ;
+        BOOST_REQUIRE_EQUAL( path.segments().size(), 3u ) ;
+        BOOST_CHECK_EQUAL( path.segments()[1].name, "bar" ) ;
+        BOOST_CHECK_EQUAL( path.segments()[1].symbol, SymbolTable::global().intern("bar") ) ;
+        BOOST_CHECK( KeyPath("").empty() ) ;
+
+        data_map items ;
+        data_map foo ;
+        data_map bar ;
+        bar["c"] = "c" ;
+        foo["bar"] = bar ;
+        items["foo"] = foo ;
+        data_ptr value ;
+        BOOST_CHECK( items.try_lookup_path(path, value) ) ;
+        BOOST_CHECK_EQUAL( value->getvalue(), "c" ) ;
+        BOOST_CHECK_EQUAL( items.find_path(path)->getvalue(), "c" ) ;
+        BOOST_CHECK( items.find_path(KeyPath("foo.baz")) == nullptr ) ;
+        BOOST_CHECK_THROW( items.parse_path(KeyPath("foo.baz")), data_map::key_error ) ;
+        items.parse_path(KeyPath("foo.baz"), true) = "new" ;
+        BOOST_CHECK_EQUAL( items.lookup_path("foo.baz")->getvalue(), "new" ) ;
+        BOOST_CHECK_THROW( items.parse_path(KeyPath("")), data_map::key_error ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_SymbolTable)
+    {
+        SymbolTable table ;
+        SymbolTable::symbol_t a = table.intern("alpha") ;
+        SymbolTable::symbol_t b = table.intern("beta") ;
+        BOOST_CHECK( a != b ) ;
+        BOOST_CHECK_EQUAL( table.intern("alpha"), a ) ;
+        BOOST_CHECK_EQUAL( table.name(b), "beta" ) ;
+
+        SymbolTable::symbol_t found ;
+        BOOST_CHECK( table.find("beta", found) ) ;
+        BOOST_CHECK_EQUAL( found, b ) ;
+        BOOST_CHECK( !table.find("gamma", found) ) ;
+        BOOST_CHECK_EQUAL( table.size(), 2u ) ;
+
+        // Grow across several storage blocks and index sizes.
+        for (int i = 0; i < 5000; ++i)
+        {
+            table.intern("key" + std::to_string(i)) ;
+        }
+        BOOST_CHECK_EQUAL( table.size(), 5002u ) ;
+        BOOST_CHECK( table.find("key4321", found) ) ;
+        BOOST_CHECK_EQUAL( table.name(found), "key4321" ) ;
+        BOOST_CHECK_EQUAL( table.intern("alpha"), a ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_SymbolTable_release)
+    {
+        SymbolTable table ;
+        SymbolTable::symbol_t a = table.intern("alpha") ;
+        SymbolTable::symbol_t b = table.intern("beta") ;
+        table.retain(b) ;
+        table.release(b) ;
+        BOOST_CHECK_EQUAL( table.size(), 2u ) ;
+
+        // Removed with its last reference, and its number reused.
+        table.release(b) ;
+        SymbolTable::symbol_t found ;
+        BOOST_CHECK( !table.find("beta", found) ) ;
+        BOOST_CHECK_EQUAL( table.size(), 1u ) ;
+        BOOST_CHECK_EQUAL( table.intern("gamma"), b ) ;
+        BOOST_CHECK_EQUAL( table.name(b), "gamma" ) ;
+        BOOST_CHECK_EQUAL( table.intern("alpha"), a ) ;
+
+        // Removed symbols leave the index usable as it fills and is replaced.
+        for (int round = 0; round < 4; ++round)
+        {
+            std::vector<SymbolTable::symbol_t> keys ;
+            for (int i = 0; i < 3000; ++i)
+            {
+                keys.push_back(table.intern("key" + std::to_string(round) + "_" + std::to_string(i))) ;
+            }
+            BOOST_CHECK_EQUAL( table.size(), 3002u ) ;
+            BOOST_CHECK( table.find("key" + std::to_string(round) + "_1234", found) ) ;
+            BOOST_CHECK_EQUAL( found, keys[1234] ) ;
+            for (SymbolTable::symbol_t key : keys)
+            {
+                table.release(key) ;
+            }
+            BOOST_CHECK_EQUAL( table.size(), 2u ) ;
+            BOOST_CHECK( table.find("gamma", found) ) ;
+        }
+        BOOST_CHECK( table.intern("delta") < 3010u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_dynamic_keys_are_released)
+    {
+        DataTemplate tmpl("{$count(users)}") ;
+        size_t before = SymbolTable::global().size() ;
+        for (int round = 0; round < 3; ++round)
+        {
+            // A map keyed by runtime values, as with user IDs.
+            data_map users ;
+            for (int i = 0; i < 10000; ++i)
+            {
+                users["user_" + std::to_string(round) + "_" + std::to_string(i)] = i ;
+            }
+            data_map data ;
+            data["users"] = users ;
+            BOOST_CHECK_EQUAL( SymbolTable::global().size(), before + 10000 ) ;
+            BOOST_CHECK_EQUAL( data.lookup_path("users.user_" + std::to_string(round) + "_42")->getvalue(), "42" ) ;
+        }
+        BOOST_CHECK_EQUAL( SymbolTable::global().size(), before ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_lookup_hints)
+    {
+        data_map first ;
+        first["id"] = 1 ;
+        first["name"] = "first" ;
+        data_map second ;
+        second["id"] = 2 ;
+        second["name"] = "second" ;
+        data_map other ;
+        other["name"] = "other" ;
+        other["id"] = 3 ;
+
+        KeyPath path("name") ;
+        LookupStats stats = {} ;
+        BOOST_CHECK_EQUAL( first.find_path(path, &stats)->getvalue(), "first" ) ;
+        BOOST_CHECK_EQUAL( second.find_path(path, &stats)->getvalue(), "second" ) ;
+        BOOST_CHECK_EQUAL( stats.hits, 1u ) ;
+        BOOST_CHECK_EQUAL( stats.misses, 1u ) ;
+
+        // A map with a different layout misses, then becomes the cached layout.
+        BOOST_CHECK_EQUAL( other.find_path(path, &stats)->getvalue(), "other" ) ;
+        BOOST_CHECK_EQUAL( first.find_path(path, &stats)->getvalue(), "first" ) ;
+        BOOST_CHECK_EQUAL( stats.hits, 1u ) ;
+        BOOST_CHECK_EQUAL( stats.misses, 3u ) ;
+        BOOST_CHECK( second.find_path(KeyPath("missing"), &stats) == nullptr ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_lookup_stats_from_render)
+    {
+        data_list people ;
+        for (int i = 0; i < 10; ++i)
+        {
+            data_map person ;
+            person["id"] = i ;
+            person["name"] = "p" + std::to_string(i) ;
+            people.push_back(std::move(person)) ;
+        }
+        data_map data ;
+        data["people"] = std::move(people) ;
+        DataTemplate tmpl("{% for p in people %}{$p.name} {% endfor %}") ;
+
+        reset_lookup_stats() ;
+        BOOST_CHECK_EQUAL( tmpl.eval(data), "p0 p1 p2 p3 p4 p5 p6 p7 p8 p9 " ) ;
+        LookupStats stats = lookup_stats() ;
+        BOOST_CHECK_EQUAL( stats.hits, 19u ) ;
+        BOOST_CHECK_EQUAL( stats.misses, 2u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_flat_and_indexed)
+    {
+        // Maps are searched linearly until they outgrow the flat limit, then indexed.
+        data_map items ;
+        for (int i = 0; i < 40; ++i)
+        {
+            items["k" + std::to_string(i)] = i ;
+            for (int j = 0; j <= i; ++j)
+            {
+                BOOST_REQUIRE( items.find("k" + std::to_string(j)) ) ;
+                BOOST_CHECK_EQUAL( items.find("k" + std::to_string(j))->getint(), j ) ;
+            }
+            BOOST_CHECK( !items.has("k" + std::to_string(i + 1)) ) ;
+        }
+
+        data_map parent ;
+        parent["outer"] = "outer" ;
+        data_map child ;
+        child["inner"] = "inner" ;
+        child.set_parent(&parent) ;
+        BOOST_CHECK_EQUAL( child["outer"]->getvalue(), "outer" ) ;
+        BOOST_CHECK_EQUAL( child.size(), 1u ) ;
+
+        // Assigning a smaller map drops the entries of the larger one.
+        data_map small ;
+        small["a"] = "a" ;
+        items = small ;
+        BOOST_CHECK_EQUAL( items.size(), 1u ) ;
+        BOOST_CHECK( !items.has("k0") ) ;
+        BOOST_CHECK( !items.has("k20") ) ;
+        items = std::move(child) ;
+        BOOST_CHECK_EQUAL( items.size(), 1u ) ;
+        BOOST_CHECK_EQUAL( items["inner"]->getvalue(), "inner" ) ;
+        BOOST_CHECK( !items.has("a") ) ;
+        BOOST_CHECK( items.has("outer") ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_copy_on_write)
+    {
+        data_map site ;
+        for (int i = 0; i < 100; ++i)
+        {
+            site["key" + std::to_string(i)] = i ;
+        }
+
+        data_map first ;
+        first["site"] = site ;
+        data_map second ;
+        second["site"] = site ;
+
+        // Writes to one copy, inline or not, leave the others alone.
+        first["site"]->getmap()["key1"] = "first" ;
+        first["site"]->getmap()["key50"] = "first" ;
+        first.parse_path("site.key60") = "first" ;
+        second["site"]->getmap()["extra"] = "second" ;
+        site["key70"] = "site" ;
+
+        BOOST_CHECK_EQUAL( first.lookup_path("site.key1")->getvalue(), "first" ) ;
+        BOOST_CHECK_EQUAL( first.lookup_path("site.key50")->getvalue(), "first" ) ;
+        BOOST_CHECK_EQUAL( first.lookup_path("site.key60")->getvalue(), "first" ) ;
+        BOOST_CHECK_EQUAL( first.lookup_path("site.key70")->getint(), 70 ) ;
+        BOOST_CHECK( !first["site"]->getmap().has("extra") ) ;
+        BOOST_CHECK_EQUAL( second.lookup_path("site.key1")->getint(), 1 ) ;
+        BOOST_CHECK_EQUAL( second.lookup_path("site.key50")->getint(), 50 ) ;
+        BOOST_CHECK_EQUAL( second.lookup_path("site.extra")->getvalue(), "second" ) ;
+        BOOST_CHECK_EQUAL( second["site"]->getmap().size(), 101u ) ;
+        BOOST_CHECK_EQUAL( site["key1"]->getint(), 1 ) ;
+        BOOST_CHECK_EQUAL( site["key60"]->getint(), 60 ) ;
+        BOOST_CHECK_EQUAL( site["key70"]->getvalue(), "site" ) ;
+        BOOST_CHECK_EQUAL( site.size(), 100u ) ;
+
+        // A copy taken from a copy survives the original going away.
+        data_map third ;
+        {
+            data_map temp = site ;
+            third = temp ;
+        }
+        BOOST_CHECK_EQUAL( third["key99"]->getint(), 99 ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_copy_after_reference)
+    {
+        // More keys than are stored inline, so the later ones are in the shared table.
+        data_map a ;
+        for (int i = 0; i < 8; ++i)
+        {
+            a["k" + std::to_string(i)] = 1 ;
+        }
+        data_ptr &r = a["k6"] ;
+        data_map b = a ;
+        r = "CHANGED" ;
+        BOOST_CHECK_EQUAL( b["k6"]->getvalue(), "1" ) ;
+        BOOST_CHECK_EQUAL( a["k6"]->getvalue(), "CHANGED" ) ;
+
+        // A row held by reference while copies of it are added to a list.
+        data_map row ;
+        for (int i = 0; i < 8; ++i)
+        {
+            row["c" + std::to_string(i)] = "original" ;
+        }
+        data_ptr &cell = row["c7"] ;
+        data_list items ;
+        items.push_back(make_data(row)) ;
+        cell = "mutated" ;
+        items.push_back(make_data(row)) ;
+        data_map data ;
+        data["items"] = items ;
+        BOOST_CHECK_EQUAL( DataTemplate("{% for row in items %}{$row.c7},{% endfor %}").eval(data),
+                           "original,mutated," ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_DataMap_read_only_parent)
+    {
+        data_map outer ;
+        outer["a"] = "outer" ;
+        outer["b"] = "outer" ;
+        data_map inner ;
+        inner.set_parent(&outer, true) ;
+
+        // New keys and assignments stay in the child, which starts from the parent's value.
+        inner["c"] = "inner" ;
+        BOOST_CHECK_EQUAL( inner["a"]->getvalue(), "outer" ) ;
+        inner["a"] = "inner" ;
+        inner.parse_path("b") = "inner" ;
+        BOOST_CHECK_EQUAL( inner["a"]->getvalue(), "inner" ) ;
+        BOOST_CHECK_EQUAL( inner["b"]->getvalue(), "inner" ) ;
+        BOOST_CHECK_EQUAL( outer["a"]->getvalue(), "outer" ) ;
+        BOOST_CHECK_EQUAL( outer["b"]->getvalue(), "outer" ) ;
+        BOOST_CHECK( !outer.has("c") ) ;
+        BOOST_CHECK_THROW( inner.parse_path("d"), data_map::key_error ) ;
+
+        // A map below the child inserts into the child rather than going past it.
+        data_map params ;
+        params.set_parent(&inner) ;
+        params["e"] = "params" ;
+        BOOST_CHECK_EQUAL( inner.size(), 4u ) ;
+        BOOST_CHECK_EQUAL( outer.size(), 2u ) ;
+    }
+
+    BOOST_AUTO_TEST_CASE(test_DataMap_references_stable)
+    {
+        data_map items ;
+        data_ptr &first = items["key0"] ;
+        first = "first" ;
+        for (int i = 1; i < 1000; ++i)
+        {
+            items["key" + std::to_string(i)] = i ;
+        }
+        BOOST_CHECK_EQUAL( items.size(), 1000u ) ;
+        BOOST_CHECK_EQUAL( first->getvalue(), "first" ) ;
+        BOOST_CHECK( &items["key0"] == &first ) ;
+        BOOST_CHECK_EQUAL( items["key999"]->getint(), 999 ) ;
+
+        data_map copy = items ;
+        BOOST_CHECK_EQUAL( copy.size(), 1000u ) ;
+        BOOST_CHECK_EQUAL( copy["key500"]->getint(), 500 ) ;
+        copy["key500"] = "changed" ;
+        BOOST_CHECK_EQUAL( items["key500"]->getint(), 500 ) ;
+
+        std::vector<std::string> keys ;
+        items.for_each([&keys](const std::string &key, data_ptr &) { keys.push_back(key) ; }) ;
+        BOOST_REQUIRE_EQUAL( keys.size(), 1000u ) ;
+        BOOST_CHECK_EQUAL( keys[0], "key0" ) ;
+        BOOST_CHECK_EQUAL( keys[999], "key999" ) ;
+    }
     BOOST_AUTO_TEST_CASE(test_DataMap_move)
     {
         data_map items ;
@@ -311,6 +661,98 @@ BOOST_AUTO_TEST_SUITE( TestCppData )
         data_ptr d(new DataTemplate(""));
         BOOST_CHECK( d.is_template() );
     }
+    // data_ptr representation
+    BOOST_AUTO_TEST_CASE(test_data_ptr_size)
+    {
+        BOOST_CHECK_EQUAL( sizeof(data_ptr), 16u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_inline_kinds)
+    {
+        data_ptr b = make_data(true) ;
+        data_ptr i = make_data(-42) ;
+        data_ptr s = make_data("fourteen chars") ;
+
+        BOOST_CHECK_EQUAL( b.kind(), data_ptr::BOOL ) ;
+        BOOST_CHECK_EQUAL( i.kind(), data_ptr::INT ) ;
+        BOOST_CHECK_EQUAL( s.kind(), data_ptr::STRING ) ;
+        BOOST_CHECK( !b.raw() && !i.raw() && !s.raw() ) ;
+        BOOST_CHECK_EQUAL( b->getvalue(), "true" ) ;
+        BOOST_CHECK_EQUAL( i->getvalue(), "-42" ) ;
+        BOOST_CHECK_EQUAL( s->getvalue(), "fourteen chars" ) ;
+        BOOST_CHECK_THROW( s->getlist(), TemplateException ) ;
+
+        // get() still hands out an owning Data object, copied for inline values.
+        std::shared_ptr<Data> held = s.get() ;
+        BOOST_REQUIRE( held ) ;
+        BOOST_CHECK_EQUAL( held->getvalue(), "fourteen chars" ) ;
+        BOOST_CHECK_EQUAL( i.get()->getint(), -42 ) ;
+        BOOST_CHECK( !data_ptr().get() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_get_shares_heap_value)
+    {
+        std::shared_ptr<Data> held ;
+        {
+            data_map map ;
+            map["key"] = "foo" ;
+            data_ptr a = map ;
+            held = a.get() ;
+            BOOST_CHECK( held.get() == a.raw() ) ;
+        }
+        // The handle keeps the map alive after the last data_ptr is gone.
+        BOOST_CHECK_EQUAL( held->getmap()["key"]->getvalue(), "foo" ) ;
+
+        data_ptr loop = data_ptr::make_loop(1, 3) ;
+        std::shared_ptr<Data> loop_map = loop.get() ;
+        BOOST_CHECK_EQUAL( loop.kind(), data_ptr::MAP ) ;
+        BOOST_CHECK_EQUAL( loop_map->getmap()["index"]->getvalue(), "2" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_long_string)
+    {
+        data_ptr s = make_data("fifteen chars!!") ;
+        BOOST_CHECK_EQUAL( s.kind(), data_ptr::VALUE ) ;
+        BOOST_CHECK_EQUAL( s->getvalue(), "fifteen chars!!" ) ;
+
+        data_ptr copy = s ;
+        s = 5 ;
+        BOOST_CHECK_EQUAL( copy->getvalue(), "fifteen chars!!" ) ;
+        BOOST_CHECK_EQUAL( s->getint(), 5 ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_inline_string_getint)
+    {
+        data_ptr s = make_data("0x10") ;
+        BOOST_CHECK_EQUAL( s->getint(), 16 ) ;
+        BOOST_CHECK( !s->empty() ) ;
+        BOOST_CHECK( make_data("")->empty() ) ;
+        BOOST_CHECK_EQUAL( make_data("").kind(), data_ptr::STRING ) ;
+
+        data_ptr literal = "literal" ;
+        BOOST_CHECK_EQUAL( literal.kind(), data_ptr::STRING ) ;
+        literal = "a literal longer than fourteen" ;
+        BOOST_CHECK_EQUAL( literal->getvalue(), "a literal longer than fourteen" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_shares_containers)
+    {
+        data_map items ;
+        items["key"] = "foo" ;
+        data_ptr a(std::move(items)) ;
+        data_ptr b = a ;
+        b->getmap()["key"] = "bar" ;
+
+        BOOST_CHECK_EQUAL( a.kind(), data_ptr::MAP ) ;
+        BOOST_CHECK_EQUAL( a->getmap()["key"]->getvalue(), "bar" ) ;
+        BOOST_CHECK( a.get() == b.get() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_data_ptr_null)
+    {
+        data_ptr d ;
+        BOOST_CHECK_EQUAL( d.kind(), data_ptr::NONE ) ;
+        BOOST_CHECK( d->empty() ) ;
+        BOOST_CHECK_EQUAL( d->getvalue(), "" ) ;
+
+        d.push_back(make_data(1)) ;
+        BOOST_CHECK_EQUAL( d.kind(), data_ptr::LIST ) ;
+        BOOST_CHECK_EQUAL( d->getlist().size(), 1u ) ;
+    }
 BOOST_AUTO_TEST_SUITE_END()
 
 // ------------------------------------------------------------------------------------------
@@ -380,6 +822,11 @@ BOOST_AUTO_TEST_SUITE( TestCppStmtTokenizer )
         BOOST_CHECK_EQUAL( t.size(), 1u );
         BOOST_CHECK_EQUAL( t[0].get_type(), STRING_LITERAL_TOKEN);
         BOOST_CHECK_EQUAL( t[0].get_value(), "he said,\n\"hello\"");
+
+        t = tokenize_statement("'abc\\tdef' 'ghi'");
+        BOOST_CHECK_EQUAL( t.size(), 2u );
+        BOOST_CHECK_EQUAL( t[0].get_value(), "abc\tdef");
+        BOOST_CHECK_EQUAL( t[1].get_value(), "ghi");
     }
     BOOST_AUTO_TEST_CASE(test_bool_lit)
     {
@@ -780,70 +1227,109 @@ BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE( TestCppExprParser )
 
-    BOOST_AUTO_TEST_CASE(test_get_var_value_simple)
+    BOOST_AUTO_TEST_CASE(test_key_path_simple)
     {
-        token_vector v;
+        token_vector v = tokenize_statement("item");
         TokenIterator t(v);
         data_map d;
         d["item"] = "a";
-        ExprParser p(t, d);
-        data_list params;
-        data_ptr r = p.get_var_value("item", params);
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getvalue(), "a");
     }
-    BOOST_AUTO_TEST_CASE(test_get_var_value_dotted)
+    BOOST_AUTO_TEST_CASE(test_results_inline)
+    {
+        // Bools, small ints and the empty string of a missing key never allocate.
+        data_map d;
+        d["a"] = "a string that is stored on the heap";
+        d["n"] = 3;
+        data_list items;
+        items.push_back(make_data(1));
+        d["items"] = items;
+        const char *exprs[] = { "a == a", "a != n", "not a", "a and n", "n > 2", "n * 100",
+                                "count(items)", "empty(missing)", "missing", "-n" };
+        for (const char *text : exprs)
+        {
+            token_vector v = tokenize_statement(text);
+            TokenIterator t(v);
+            data_ptr r = ExprParser(t).parse_expr()->eval(d);
+            BOOST_CHECK_MESSAGE( r.raw() == nullptr, text );
+        }
+    }
+    BOOST_AUTO_TEST_CASE(test_key_path_dotted)
     {
-        token_vector v;
+        token_vector v = tokenize_statement("x.a");
         TokenIterator t(v);
         data_map d;
         data_map x;
         x["a"] = "a";
         d["x"] = x;
-        ExprParser p(t, d);
-        data_list params;
-        data_ptr r = p.get_var_value("x.a", params);
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getvalue(), "a");
     }
-    BOOST_AUTO_TEST_CASE(test_get_var_value_fn_count)
+    BOOST_AUTO_TEST_CASE(test_key_path_missing)
     {
-        token_vector v;
+        token_vector v = tokenize_statement("x.a");
+        TokenIterator t(v);
+        data_map d;
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
+        BOOST_CHECK_EQUAL( r->getvalue(), "");
+    }
+    BOOST_AUTO_TEST_CASE(test_fn_count)
+    {
+        token_vector v = tokenize_statement("count(a)");
         TokenIterator t(v);
         data_map d;
         data_list a;
         a.push_back("1");
         a.push_back("2");
         a.push_back("3");
-        ExprParser p(t, d);
-        data_list params;
-        params.push_back(a);
-        data_ptr r = p.get_var_value("count", params);
+        d["a"] = a;
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getvalue(), "3");
     }
-    BOOST_AUTO_TEST_CASE(test_get_var_value_fn_empty)
+    BOOST_AUTO_TEST_CASE(test_fn_empty)
     {
-        token_vector v;
+        token_vector v = tokenize_statement("empty(a)");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        data_list params;
-        params.push_back("");
-        data_ptr r = p.get_var_value("empty", params);
+        d["a"] = "";
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getvalue(), "true");
-        params[0] = "x";
-        data_ptr m = p.get_var_value("empty", params);
+        d["a"] = "x";
+        data_ptr m = e->eval(d);
         BOOST_CHECK_EQUAL( m->getvalue(), "false");
     }
-    BOOST_AUTO_TEST_CASE(test_get_var_value_fn_defined)
+    BOOST_AUTO_TEST_CASE(test_fn_defined)
     {
         // Placeholder until defined() is fixed.
     }
+    BOOST_AUTO_TEST_CASE(test_fn_wrong_param_count)
+    {
+        token_vector v = tokenize_statement("count(a, b)");
+        TokenIterator t(v);
+        BOOST_CHECK_THROW( ExprParser(t).parse_expr(), TemplateException );
+        v = tokenize_statement("addIndent(a)");
+        TokenIterator t2(v);
+        BOOST_CHECK_THROW( ExprParser(t2).parse_expr(), TemplateException );
+    }
+    BOOST_AUTO_TEST_CASE(test_syntax_error)
+    {
+        token_vector v = tokenize_statement("a ==");
+        TokenIterator t(v);
+        BOOST_CHECK_THROW( ExprParser(t).parse_expr(), TemplateException );
+    }
     BOOST_AUTO_TEST_CASE(test_str_lit)
     {
         token_vector v = tokenize_statement("'hi'");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        data_ptr r = p.parse_expr();
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getvalue(), "hi");
     }
     BOOST_AUTO_TEST_CASE(test_int_lit)
@@ -851,8 +1337,8 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         token_vector v = tokenize_statement("123");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        data_ptr r = p.parse_expr();
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getint(), 123);
     }
     BOOST_AUTO_TEST_CASE(test_int_lit_hex)
@@ -860,8 +1346,8 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         token_vector v = tokenize_statement("0x1000");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        data_ptr r = p.parse_expr();
+        expr_ptr e = ExprParser(t).parse_expr();
+        data_ptr r = e->eval(d);
         BOOST_CHECK_EQUAL( r->getint(), 4096);
     }
     BOOST_AUTO_TEST_CASE(test_and)
@@ -871,18 +1357,15 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = false;
         d["b"] = false;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = false;
         d["b"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_and_multiline_commented)
     {
@@ -891,18 +1374,15 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = false;
         d["b"] = false;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = false;
         d["b"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_or)
     {
@@ -911,18 +1391,15 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = false;
         d["b"] = false;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = false;
         d["b"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_or_value)
     {
@@ -931,12 +1408,11 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "x";
         d["b"] = "";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "x");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "x");
         d["a"] = "";
         d["b"] = "y";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "y");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "y");
     }
     BOOST_AUTO_TEST_CASE(test_equal)
     {
@@ -945,11 +1421,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "x";
         d["b"] = "y";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = "y";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_not_equal)
     {
@@ -958,11 +1433,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "x";
         d["b"] = "y";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = "y";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
     }
     BOOST_AUTO_TEST_CASE(test_gt)
     {
@@ -971,14 +1445,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["b"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
     }
     BOOST_AUTO_TEST_CASE(test_gt_txt)
     {
@@ -987,14 +1459,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "apple";
         d["b"] = "bear";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["b"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
     }
     BOOST_AUTO_TEST_CASE(test_ge)
     {
@@ -1003,14 +1473,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["b"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_ge_txt)
     {
@@ -1019,14 +1487,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "apple";
         d["b"] = "bear";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["b"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_lt)
     {
@@ -1035,14 +1501,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["b"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
     }
     BOOST_AUTO_TEST_CASE(test_lt_txt)
     {
@@ -1051,14 +1515,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "apple";
         d["b"] = "bear";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["b"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
     }
     BOOST_AUTO_TEST_CASE(test_le)
     {
@@ -1067,14 +1529,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["b"] = 50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_le_txt)
     {
@@ -1083,14 +1543,12 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "apple";
         d["b"] = "bear";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["b"] = "monkey";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_str_cat)
     {
@@ -1099,20 +1557,19 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = "hello";
         d["b"] = "world";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "helloworld");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "helloworld");
         d["a"] = 50;
         d["b"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "50true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "50true");
     }
     BOOST_AUTO_TEST_CASE(test_str_cat_lit)
     {
         token_vector v = tokenize_statement("\"a\" & \"b\"");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "ab");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "ab");
     }
     BOOST_AUTO_TEST_CASE(test_add)
     {
@@ -1121,11 +1578,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 300);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 300);
         d["a"] = -50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 50);
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 50);
     }
     BOOST_AUTO_TEST_CASE(test_sub)
     {
@@ -1134,11 +1590,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 100);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 100);
         d["a"] = -50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), -150);
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), -150);
     }
     BOOST_AUTO_TEST_CASE(test_mul)
     {
@@ -1147,11 +1602,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 20000);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 20000);
         d["a"] = -50;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), -5000);
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), -5000);
     }
     BOOST_AUTO_TEST_CASE(test_div)
     {
@@ -1160,11 +1614,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 200;
         d["b"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 2);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 2);
         d["b"] = -5;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), -40);
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), -40);
     }
     BOOST_AUTO_TEST_CASE(test_mod)
     {
@@ -1173,11 +1626,10 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         data_map d;
         d["a"] = 12;
         d["b"] = 10;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 2);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 2);
         d["a"] = 10;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), 0);
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), 0);
     }
     BOOST_AUTO_TEST_CASE(test_not)
     {
@@ -1185,19 +1637,18 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         TokenIterator t(v);
         data_map d;
         d["a"] = true;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["a"] = false;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_unary_minus)
     {
         token_vector v = tokenize_statement("-12");
         TokenIterator t(v);
         data_map d;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), -12);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), -12);
     }
     BOOST_AUTO_TEST_CASE(test_unary_minus_var)
     {
@@ -1205,8 +1656,8 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         TokenIterator t(v);
         data_map d;
         d["a"] = 100;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getint(), -100);
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getint(), -100);
     }
     BOOST_AUTO_TEST_CASE(test_parens)
     {
@@ -1214,8 +1665,8 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         TokenIterator t(v);
         data_map d;
         d["a"] = "xyzzy";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "xyzzy");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "xyzzy");
     }
     BOOST_AUTO_TEST_CASE(test_parens_or)
     {
@@ -1225,17 +1676,14 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         d["a"] = "";
         d["b"] = "foo";
         d["z"] = "xyzzy";
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["z"] = "foo";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = "bar";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["z"] = "bar";
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
     }
     BOOST_AUTO_TEST_CASE(test_and_or)
     {
@@ -1245,14 +1693,109 @@ BOOST_AUTO_TEST_SUITE( TestCppExprParser )
         d["a"] = true;
         d["b"] = true;
         d["c"] = false;
-        ExprParser p(t, d);
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        expr_ptr e = ExprParser(t).parse_expr();
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
         d["a"] = false;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "false");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "false");
         d["c"] = true;
-        t.reset();
-        BOOST_CHECK_EQUAL( p.parse_expr()->getvalue(), "true");
+        BOOST_CHECK_EQUAL( e->eval(d)->getvalue(), "true");
+    }
+
+    // Evaluates an expression with a subtemplate "t" that records whether it was called.
+    string eval_with_tracer(const char *expr, bool &called)
+    {
+        token_vector v = tokenize_statement(expr);
+        TokenIterator t(v);
+        data_map d;
+        d["t"] = make_template("{% set called = true %}T");
+        d["called"] = false;
+        string result = ExprParser(t).parse_expr()->eval(d)->getvalue();
+        called = !d["called"]->empty();
+        return result;
+    }
+    BOOST_AUTO_TEST_CASE(test_or_short_circuit)
+    {
+        bool called;
+        BOOST_CHECK_EQUAL( eval_with_tracer("'a' || t", called), "a");
+        BOOST_CHECK( !called );
+        BOOST_CHECK_EQUAL( eval_with_tracer("'' || t", called), "T");
+        BOOST_CHECK( called );
+        BOOST_CHECK_EQUAL( eval_with_tracer("'' or ''", called), "");
+    }
+    BOOST_AUTO_TEST_CASE(test_and_short_circuit)
+    {
+        bool called;
+        BOOST_CHECK_EQUAL( eval_with_tracer("'' && t", called), "false");
+        BOOST_CHECK( !called );
+        BOOST_CHECK_EQUAL( eval_with_tracer("'a' && t", called), "true");
+        BOOST_CHECK( called );
+    }
+    BOOST_AUTO_TEST_CASE(test_inline_if_lazy)
+    {
+        bool called;
+        BOOST_CHECK_EQUAL( eval_with_tracer("'a' if true else t", called), "a");
+        BOOST_CHECK( !called );
+        BOOST_CHECK_EQUAL( eval_with_tracer("t if false else 'b'", called), "b");
+        BOOST_CHECK( !called );
+        BOOST_CHECK_EQUAL( eval_with_tracer("t if true else 'b'", called), "T");
+        BOOST_CHECK( called );
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+// ------------------------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE( TestCppTagScanner )
+
+    // Checks every available scanner against the scalar one.
+    void check_scanners(const string &text, size_t expected_pos, uint32_t expected_lines)
+    {
+        for (const TagScanner *s = get_tag_scanners(); s->scan; ++s)
+        {
+            uint32_t lines = ~0u ;
+            BOOST_TEST_CONTEXT( s->name << " on \"" << text << "\"" )
+            {
+                BOOST_CHECK_EQUAL( s->scan(text, lines), expected_pos ) ;
+                BOOST_CHECK_EQUAL( lines, expected_lines ) ;
+            }
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(test_no_tag)
+    {
+        check_scanners("", string::npos, 0) ;
+        check_scanners("plain text\nwith { braces } and $%#\n", string::npos, 2) ;
+        check_scanners(string(100, 'x') + "{", string::npos, 0) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_tag_kinds)
+    {
+        check_scanners("ab{$x}", 2, 0) ;
+        check_scanners("\n{% if x %}", 1, 1) ;
+        check_scanners("a\nb\n{# c #}", 4, 2) ;
+        check_scanners("{{$x}", 1, 0) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_block_boundaries)
+    {
+        // Move a tag across the 16- and 32-byte block edges, with newlines on both sides.
+        for (size_t pos = 0; pos < 80; ++pos)
+        {
+            string text(pos, 'a') ;
+            uint32_t lines = 0 ;
+            for (size_t i = 0; i < pos; i += 7)
+            {
+                text[i] = '\n' ;
+                ++lines ;
+            }
+            text += "{%\n\n" + string(40, 'b') + "{$" ;
+            check_scanners(text, pos, lines) ;
+        }
+    }
+    BOOST_AUTO_TEST_CASE(test_find_tag_uses_best)
+    {
+        BOOST_CHECK( get_tag_scanners()[0].scan ) ;
+        uint32_t lines ;
+        BOOST_CHECK_EQUAL( find_tag("a\n{$b}", lines), 2u ) ;
+        BOOST_CHECK_EQUAL( lines, 1u ) ;
     }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -1286,9 +1829,8 @@ BOOST_AUTO_TEST_SUITE( TestCppParser )
         impl::TemplateParser(text, nodes).parse() ;
         data_map data ;
 
-        BOOST_CHECK_EQUAL( 2u, nodes.size() ) ;
-        BOOST_CHECK_EQUAL( gettext(nodes[0], data), "{" ) ;
-        BOOST_CHECK_EQUAL( gettext(nodes[1], data), "foo}" ) ;
+        BOOST_CHECK_EQUAL( 1u, nodes.size() ) ;
+        BOOST_CHECK_EQUAL( gettext(nodes[0], data), "{foo}" ) ;
     }
     BOOST_AUTO_TEST_CASE(test_ends_with_bracket)
     {
@@ -1297,9 +1839,8 @@ BOOST_AUTO_TEST_SUITE( TestCppParser )
         impl::TemplateParser(text, nodes).parse() ;
         data_map data ;
 
-        BOOST_CHECK_EQUAL( 2u, nodes.size() ) ;
-        BOOST_CHECK_EQUAL( gettext(nodes[0], data), "blah blah blah" ) ;
-        BOOST_CHECK_EQUAL( gettext(nodes[1], data), "{" ) ;
+        BOOST_CHECK_EQUAL( 1u, nodes.size() ) ;
+        BOOST_CHECK_EQUAL( gettext(nodes[0], data), "blah blah blah{" ) ;
     }
     // var
     BOOST_AUTO_TEST_CASE(test_var)
@@ -1387,6 +1928,35 @@ BOOST_AUTO_TEST_SUITE( TestCppParser )
         BOOST_CHECK_EQUAL( gettext(nodes[0]->get_children()[1], data), "my ax" ) ;
         BOOST_CHECK_EQUAL( gettext(nodes[0]->get_children()[2], data), "}" ) ;
     }
+    BOOST_AUTO_TEST_CASE(test_text_outlives_source)
+    {
+        node_vector nodes ;
+        {
+            string text = "abc{$foo}def{" ;
+            impl::TemplateParser(text, nodes).parse() ;
+        }
+        data_map data ;
+        data["foo"] = make_data("x") ;
+
+        BOOST_CHECK_EQUAL( 3u, nodes.size() ) ;
+        BOOST_CHECK_EQUAL( gettext(nodes[0], data), "abc" ) ;
+        BOOST_CHECK_EQUAL( gettext(nodes[2], data), "def{" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_many_blocks)
+    {
+        const int count = 20000 ;
+        string text ;
+        for (int i = 0; i < count; ++i)
+        {
+            text += "line {$foo}\n" ;
+        }
+        text += "{$bar.baz}" ;
+        node_vector nodes ;
+        impl::TemplateParser(text, nodes).parse() ;
+
+        BOOST_CHECK_EQUAL( (size_t)count * 2 + 2, nodes.size() ) ;
+        BOOST_CHECK_EQUAL( nodes.back()->get_line(), (uint32_t)count + 1 ) ;
+    }
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -1442,6 +2012,171 @@ BOOST_AUTO_TEST_SUITE(TestCppTemplateEval)
         string expected = "I heart Okinawa!" ;
         BOOST_CHECK_EQUAL( result, expected ) ;
     }
+    BOOST_AUTO_TEST_CASE(test_string_sink)
+    {
+        DataTemplate tmpl("{% for x in items %}{$x},{% endfor %}") ;
+        data_map data ;
+        data_list items ;
+        string expected = "head:" ;
+        for (int i = 0; i < 5000; ++i)
+        {
+            items.push_back(make_data(i)) ;
+            expected += std::to_string(i) + "," ;
+        }
+        data["items"] = items ;
+
+        // Output is appended to what the string already holds.
+        string output = "head:" ;
+        StringSink sink(output) ;
+        tmpl.eval(sink, data) ;
+        BOOST_CHECK_EQUAL( output, expected ) ;
+        sink.write("!", 1) ;
+        sink.flush() ;
+        BOOST_CHECK_EQUAL( output, expected + "!" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_buffer_sink)
+    {
+        DataTemplate tmpl("Hello {$name}!") ;
+        data_map data ;
+        data["name"] = "world" ;
+
+        char buffer[32] ;
+        BufferSink sink(buffer, sizeof(buffer)) ;
+        tmpl.eval(sink, data) ;
+        BOOST_CHECK_EQUAL( string(buffer, sink.size()), "Hello world!" ) ;
+        BOOST_CHECK( !sink.truncated() ) ;
+
+        BufferSink small(buffer, 8) ;
+        tmpl.eval(small, data) ;
+        BOOST_CHECK_EQUAL( string(buffer, small.size()), "Hello wo" ) ;
+        BOOST_CHECK( small.truncated() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_file_and_stream_sinks)
+    {
+        // Long enough to fill the sinks' buffers several times.
+        string name(10000, 'x') ;
+        DataTemplate tmpl("<{$name}>") ;
+        data_map data ;
+        data["name"] = name ;
+        string expected = "<" + name + ">" ;
+
+        std::ostringstream stream ;
+        tmpl.eval(stream, data) ;
+        BOOST_CHECK_EQUAL( stream.str(), expected ) ;
+
+        FILE *file = std::tmpfile() ;
+        BOOST_REQUIRE( file ) ;
+        {
+            FileSink sink(fileno(file)) ;
+            tmpl.eval(sink, data) ;
+            tmpl.eval(sink, data) ;
+        }
+        std::rewind(file) ;
+        string contents ;
+        char chunk[4096] ;
+        size_t count ;
+        while ((count = std::fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            contents.append(chunk, count) ;
+        }
+        std::fclose(file) ;
+        BOOST_CHECK_EQUAL( contents, expected + expected ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_stream_sink_write_error)
+    {
+        // A stream buffer with nowhere to write fails every write.
+        struct FailingBuf : std::streambuf {} buf ;
+        std::ostream stream(&buf) ;
+        stream.exceptions(std::ios::badbit) ;
+        DataTemplate tmpl("text") ;
+        data_map data ;
+        {
+            StreamSink sink(stream) ;
+            BOOST_CHECK_THROW( tmpl.eval(sink, data), std::ios_base::failure ) ;
+            // The output is still buffered, and the destructor's flush fails too.
+        }
+        BOOST_CHECK( stream.bad() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_eval_into_string)
+    {
+        DataTemplate tmpl("{% for x in items %}{$x},{% endfor %}") ;
+        data_map data ;
+        data_list items ;
+        string expected ;
+        for (int i = 0; i < 1000; ++i)
+        {
+            items.push_back(make_data(i)) ;
+            expected += std::to_string(i) + "," ;
+        }
+        data["items"] = items ;
+        BOOST_CHECK_EQUAL( tmpl.output_size_hint(), 0u ) ;
+
+        // The previous contents are replaced. Once the string has room for the
+        // expected size, its storage is reused.
+        string output = "old" ;
+        tmpl.eval(output, data) ;
+        BOOST_CHECK_EQUAL( output, expected ) ;
+        BOOST_CHECK_EQUAL( tmpl.output_size_hint(), expected.size() ) ;
+        tmpl.eval(output, data) ;
+        BOOST_CHECK( output.capacity() >= expected.size() + expected.size() / 8 ) ;
+        const char *storage = output.data() ;
+        tmpl.eval(output, data) ;
+        BOOST_CHECK_EQUAL( output, expected ) ;
+        BOOST_CHECK( output.data() == storage ) ;
+
+        // Later renders reserve the expected size up front.
+        string result = tmpl.eval(data) ;
+        BOOST_CHECK_EQUAL( result, expected ) ;
+        BOOST_CHECK( result.capacity() >= expected.size() ) ;
+
+        // The estimate follows the size of later renders.
+        items.resize(10) ;
+        data["items"] = items ;
+        for (int i = 0; i < 20; ++i)
+        {
+            tmpl.eval(output, data) ;
+        }
+        BOOST_CHECK_EQUAL( output, "0,1,2,3,4,5,6,7,8,9," ) ;
+        BOOST_CHECK( tmpl.output_size_hint() < 100u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_segment_sink)
+    {
+        string header(100, 'h') ;
+        string text = header + "{% for x in items %}<{$x}>{% endfor %}" + "ab" ;
+        data_map data ;
+        data_list items ;
+        for (int i = 0; i < 2000; ++i)
+        {
+            items.push_back(make_data(i)) ;
+        }
+        data["items"] = items ;
+
+        for (int compiled = 0; compiled < 2; ++compiled)
+        {
+            DataTemplate tmpl(text) ;
+            if (compiled)
+            {
+                tmpl.compile() ;
+            }
+            string expected = tmpl.eval(data) ;
+
+            SegmentSink sink ;
+            tmpl.eval(sink, data) ;
+            BOOST_CHECK_EQUAL( sink.str(), expected ) ;
+            BOOST_CHECK_EQUAL( sink.size(), expected.size() ) ;
+
+            // The header is borrowed from the template, the rest of the output is
+            // copied into chunks that outgrow the first.
+            const std::vector<SegmentSink::Segment> &segments = sink.segments() ;
+            BOOST_REQUIRE( segments.size() > 2 ) ;
+            BOOST_CHECK_EQUAL( string(segments[0].data, segments[0].size), header ) ;
+
+            sink.clear() ;
+            BOOST_CHECK( sink.segments().empty() ) ;
+            tmpl.eval(sink, data) ;
+            BOOST_CHECK_EQUAL( sink.str(), expected ) ;
+        }
+    }
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -1487,6 +2222,21 @@ BOOST_AUTO_TEST_SUITE(TestCppTemplateMisc)
         data_map data ;
         BOOST_CHECK_EQUAL( parse(text, data), "hello world" ) ;
     }
+    BOOST_AUTO_TEST_CASE(test_syntax_error_at_load)
+    {
+        // The error is reported even though the bad expression is never evaluated.
+        string text = "aaa\n"
+                      "{% if false %}{$foo(}{% endif %}" ;
+        try
+        {
+            DataTemplate t(text) ;
+            BOOST_FAIL( "expected exception" ) ;
+        }
+        catch (TemplateException &e)
+        {
+            BOOST_CHECK_EQUAL( string(e.what()), "Line 2: syntax error" ) ;
+        }
+    }
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -1761,6 +2511,53 @@ BOOST_AUTO_TEST_SUITE(TestCppTemplateFor)
         // parse the template with the supplied data dictionary
         BOOST_CHECK_EQUAL( cpptempl::parse(text, data), ".1:1:2:3-1.2:1:2:3-2" ) ;
     }
+    BOOST_AUTO_TEST_CASE(test_set_snapshots_loop)
+    {
+        string text = "{% for x in items %}"
+                        "{% set outer = loop %}"
+                        "{% for y in items %}{% endfor %}"
+                        "{$outer.index}/{$outer.count}{$'L' if outer.last else ''}{$loop.addNewLineIfNotLast}"
+                      "{% endfor %}";
+        data_list items;
+        items.push_back("a");
+        items.push_back("b");
+        items.push_back("c");
+        cpptempl::data_map data ;
+        data["items"] = items;
+
+        BOOST_CHECK_EQUAL( cpptempl::parse(text, data), "1/3\n2/3\n3/3L" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_loop_variable_after_render)
+    {
+        string text = "{% for x in items %}{% endfor %}";
+        data_list items;
+        items.push_back("a");
+        items.push_back("b");
+        cpptempl::data_map data ;
+        data["items"] = items;
+        cpptempl::parse(text, data);
+
+        BOOST_CHECK_EQUAL( data["loop"].kind(), data_ptr::LOOP ) ;
+        data_map &loop = data["loop"]->getmap();
+        BOOST_CHECK_EQUAL( data["loop"].kind(), data_ptr::MAP ) ;
+        BOOST_CHECK_EQUAL( loop["index"]->getvalue(), "2" ) ;
+        BOOST_CHECK_EQUAL( loop["index0"]->getvalue(), "1" ) ;
+        BOOST_CHECK_EQUAL( loop["last"]->getvalue(), "true" ) ;
+        BOOST_CHECK_EQUAL( loop["count"]->getvalue(), "2" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_loop_unknown_member)
+    {
+        data_ptr loop = data_ptr::make_loop(0, 1) ;
+        BOOST_CHECK_EQUAL( loop.loop_member("first")->getvalue(), "true" ) ;
+        BOOST_CHECK_THROW( loop.loop_member("bogus"), data_map::key_error ) ;
+
+        string text = "{% for x in items %}[{$loop.bogus}]{% endfor %}";
+        data_list items;
+        items.push_back("a");
+        cpptempl::data_map data ;
+        data["items"] = items;
+        BOOST_CHECK_EQUAL( cpptempl::parse(text, data), "[]" ) ;
+    }
 
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -1807,6 +2604,36 @@ BOOST_AUTO_TEST_SUITE(TestCppTemplateDef)
         string text2 = "{$items.bar('world')}";
         BOOST_CHECK_EQUAL( parse(text2, data), "hello world" );
     }
+    BOOST_AUTO_TEST_CASE(test_def_streamed_newline_elision)
+    {
+        string text = "{% def blank(x) %}{% enddef %}"
+                      "{% def word(x) %}{$x}{% enddef %}"
+                      "{$> blank(1)}\n"
+                      "a{$> word('b')}\n"
+                      "c{$> word('') or blank(2)}\n"
+                      "d{$> 'e' if word('') else word('f')}\n";
+        data_map data ;
+        BOOST_CHECK_EQUAL( parse(text, data), "ab\ncdf\n" );
+    }
+    BOOST_AUTO_TEST_CASE(test_def_result_in_operator)
+    {
+        string text = "{% def word(x) %}<{$x}>{% enddef %}"
+                      "{$word('a') & word('b')}|{$upper(word('c'))}";
+        data_map data ;
+        BOOST_CHECK_EQUAL( parse(text, data), "<a><b>|<C>" );
+    }
+    BOOST_AUTO_TEST_CASE(test_def_deep_nesting)
+    {
+        // Each level wraps the next one in brackets.
+        string text = "{% def level0(x) %}{$x}{% enddef %}";
+        for (int i = 1; i <= 50; ++i)
+        {
+            text += "{% def level" + std::to_string(i) + "(x) %}[{$level" + std::to_string(i - 1) + "(x)}]{% enddef %}";
+        }
+        text += "{$level50('core')}";
+        data_map data ;
+        BOOST_CHECK_EQUAL( parse(text, data), string(50, '[') + "core" + string(50, ']') );
+    }
 
     data_map get_things_map()
     {
@@ -1872,6 +2699,868 @@ BOOST_AUTO_TEST_SUITE(TestCppTemplateDef)
 
 BOOST_AUTO_TEST_SUITE_END()
 
+// ------------------------------------------------------------------------------------------
+
+// Renders a template by walking the node tree and by running the compiled program,
+// each with its own copy of the data, and checks that both produce the same output.
+std::string eval_both(const std::string &text, const data_map &data)
+{
+    DataTemplate walked(text);
+    DataTemplate compiled(text);
+    compiled.compile();
+    BOOST_CHECK( !walked.is_compiled() );
+    BOOST_CHECK( compiled.is_compiled() );
+
+    data_map walked_data = data;
+    data_map compiled_data = data;
+    std::string expected = walked.eval(walked_data);
+    std::string actual = compiled.eval(compiled_data);
+    BOOST_CHECK_EQUAL( expected, actual );
+    return actual;
+}
+
+BOOST_AUTO_TEST_SUITE(TestCppTemplateCompiled)
+
+    BOOST_AUTO_TEST_CASE(test_if_chain_code)
+    {
+        node_vector nodes ;
+        impl::TemplateParser("{% if a %}x{% elif b %}y{% else %}z{% endif %}", nodes).parse() ;
+        Program program(nodes) ;
+        const std::vector<Instruction> &code = program.code() ;
+
+        BOOST_REQUIRE_EQUAL( code.size(), 7u ) ;
+        BOOST_CHECK_EQUAL( code[0].op, JUMP_IF_FALSE_OP ) ;
+        BOOST_CHECK_EQUAL( code[0].arg, 3u ) ;
+        BOOST_CHECK_EQUAL( code[1].op, TEXT_OP ) ;
+        BOOST_CHECK_EQUAL( code[2].op, JUMP_OP ) ;
+        BOOST_CHECK_EQUAL( code[2].arg, 7u ) ;
+        BOOST_CHECK_EQUAL( code[3].op, JUMP_IF_FALSE_OP ) ;
+        BOOST_CHECK_EQUAL( code[3].arg, 6u ) ;
+        BOOST_CHECK_EQUAL( code[4].op, TEXT_OP ) ;
+        BOOST_CHECK_EQUAL( code[5].op, JUMP_OP ) ;
+        BOOST_CHECK_EQUAL( code[5].arg, 7u ) ;
+        BOOST_CHECK_EQUAL( code[6].op, TEXT_OP ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_for_code)
+    {
+        node_vector nodes ;
+        impl::TemplateParser("{% for x in items %}{$x}{% endfor %}.", nodes).parse() ;
+        Program program(nodes) ;
+        const std::vector<Instruction> &code = program.code() ;
+
+        BOOST_REQUIRE_EQUAL( code.size(), 4u ) ;
+        BOOST_CHECK_EQUAL( code[0].op, FOR_BEGIN_OP ) ;
+        BOOST_CHECK_EQUAL( code[0].arg, 3u ) ;
+        BOOST_CHECK_EQUAL( code[1].op, VAR_OP ) ;
+        BOOST_CHECK_EQUAL( code[2].op, FOR_NEXT_OP ) ;
+        BOOST_CHECK_EQUAL( code[2].arg, 1u ) ;
+        BOOST_CHECK_EQUAL( code[3].op, TEXT_OP ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_if_elif_else)
+    {
+        string text = "{% if foo %}aa{% elif bar %}bb{% elif baz %}cc{% else %}dd{% endif %}." ;
+        data_map data ;
+        data["foo"] = false ;
+        data["bar"] = false ;
+        data["baz"] = false ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "dd." ) ;
+        data["baz"] = true ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "cc." ) ;
+        data["bar"] = true ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "bb." ) ;
+        data["foo"] = true ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "aa." ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_nested_for)
+    {
+        string text = "{% for x in items %}.{$loop.index}"
+                        "{% for y in more if y != '2' %}:{$y}/{$loop.count}{% endfor %}"
+                        "-{$loop.index}{% endfor %}{% for z in empty %}never{% endfor %}";
+        data_list items ;
+        items.push_back("a") ;
+        items.push_back("b") ;
+        data_list more ;
+        more.push_back("1") ;
+        more.push_back("2") ;
+        more.push_back("3") ;
+        data_map data ;
+        data["items"] = items ;
+        data["more"] = more ;
+        data["empty"] = data_list() ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), ".1:1/2:3/2-1.2:1/2:3/2-2" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_newline_elision)
+    {
+        string text = "{% for x in items %}\n"
+                      "{$> x }\n"
+                      "{% if x %}\n"
+                      "[{$x >}]\n"
+                      "{% endif %}\n"
+                      "{% endfor %}\n"
+                      "done\n" ;
+        data_list items ;
+        items.push_back("a") ;
+        items.push_back("") ;
+        items.push_back("b") ;
+        data_map data ;
+        data["items"] = items ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "a\n[a]\nb\n[b]\ndone\n" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_subtemplate_call_scope)
+    {
+        // A set in a subtemplate called without arguments stays in the call's scope.
+        data_map data ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub %}{% set y = 5 %}{% enddef %}{$sub}[{$y}]", data), "[]" ) ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub %}{% set y = 5 %}{$y}{% enddef %}{% if sub %}{% endif %}({$sub})[{$y}]", data),
+                           "(5)[]" ) ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub() %}{% set y = 5 %}{% enddef %}{$sub()}[{$y}]", data), "[]" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_subtemplate_stopped_by_key_error)
+    {
+        // A subtemplate that stops on a key error writes nothing, even in output position.
+        data_map data ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub %}hello{% set missing.x = 1 %}{% enddef %}[{$sub}]", data), "[]" ) ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub %}hello{% if true %}{% def missing.x %}{% enddef %}{% endif %}{% enddef %}"
+                                     "[{$sub}]{$>sub}\nend", data), "[]end" ) ;
+
+        // Inside a loop, the error only ends the loop and the output so far is kept.
+        data_list items ;
+        items.push_back("a") ;
+        items.push_back("b") ;
+        data["items"] = items ;
+        BOOST_CHECK_EQUAL( eval_both("{% def sub %}{% for x in items %}{$x}{% set missing.x = 1 %}{% endfor %}!{% enddef %}[{$sub}]", data), "[a!]" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_def_and_set)
+    {
+        string text =
+            "{% def outerdef(info) %}({$info.name}:{$defwithloop(info)}){% enddef %}"
+            "{% def defwithloop(info) %}"
+            "{% for thing in info.members %}"
+            "[{$thing.name}{% if thing.value %}={$thing.value}{% endif%}]"
+            "{% endfor %}"
+            "{% enddef %}"
+            "{% set n = 0 %}"
+            "{% for x in things %}"
+            "{% set n = n + 1 %}"
+            "{$n}{$outerdef(x)}"
+            "{% endfor %}";
+        data_map data = TestCppTemplateDef::get_things_map() ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "1(letters:[A=1][B=2])2(fun:[Q=10])" ) ;
+
+        // Subtemplates created by a compiled template are compiled too.
+        DataTemplate t(text) ;
+        t.compile() ;
+        t.eval(data) ;
+        BOOST_CHECK( dynamic_cast<DataTemplate *>(data["outerdef"].get().get())->is_compiled() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_missing_key_ends_loop)
+    {
+        string text = "{% for x in items %}{$x}{% set a.b = x %}{% endfor %}after" ;
+        data_list items ;
+        items.push_back("1") ;
+        items.push_back("2") ;
+        data_map data ;
+        data["items"] = items ;
+        BOOST_CHECK_EQUAL( eval_both(text, data), "1after" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_error_line)
+    {
+        string text = "{% for x in items %}\n"
+                      "{% set x.y = 1 %}{% endfor %}" ;
+        data_list items ;
+        items.push_back("1") ;
+        data_map data ;
+        data["items"] = items ;
+        DataTemplate compiled(text) ;
+        compiled.compile() ;
+        try
+        {
+            compiled.eval(data) ;
+            BOOST_FAIL( "expected exception" ) ;
+        }
+        catch (TemplateException &e)
+        {
+            BOOST_CHECK_EQUAL( string(e.what()), "Line 1: Data item is not a dictionary" ) ;
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(test_arena)
+    {
+        impl::Arena arena ;
+        void *first = arena.allocate(0) ;
+        BOOST_CHECK( first != nullptr ) ;
+        {
+            ArenaScope scope(arena) ;
+            char *big = static_cast<char *>(arena.allocate(100000)) ;
+            std::memset(big, 'x', 100000) ;
+            BOOST_CHECK( arena.allocate(16) != nullptr ) ;
+        }
+        size_t capacity = arena.capacity() ;
+
+        // Memory given back by a scope is reused without growing the arena.
+        for (int i = 0; i < 100; ++i)
+        {
+            ArenaScope scope(arena) ;
+            arena.allocate(50000) ;
+            arena.allocate(50000) ;
+        }
+        BOOST_CHECK_EQUAL( arena.capacity(), capacity ) ;
+
+        // The most recent allocation can be given back directly.
+        void *p = arena.allocate(64) ;
+        arena.deallocate(p, 64) ;
+        BOOST_CHECK( arena.allocate(64) == p ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_temporaries_in_nested_loops)
+    {
+        // Filtered loops and subtemplate arguments use the render arena; values set
+        // from them must still be valid after the render.
+        string text = "{% def tag(a, b) %}<{$a}{$b}>{% enddef %}"
+                      "{% for row in rows if row.n %}"
+                      "{% for col in cols if col != row.skip %}{$tag(row.name, col)}{% set last = row.name & col %}{% endfor %}"
+                      "{% endfor %}" ;
+        data_map data ;
+        data_list rows ;
+        for (int i = 0; i < 4; ++i)
+        {
+            data_map row ;
+            row["n"] = i % 2 ;
+            row["name"] = "row with a long name " + std::to_string(i) ;
+            row["skip"] = "b" ;
+            rows.push_back(make_data(row)) ;
+        }
+        data["rows"] = rows ;
+        data_list cols ;
+        cols.push_back(make_data("a")) ;
+        cols.push_back(make_data("b")) ;
+        cols.push_back(make_data("c")) ;
+        data["cols"] = cols ;
+
+        BOOST_CHECK_EQUAL( eval_both(text, data),
+                           "<row with a long name 1a><row with a long name 1c>"
+                           "<row with a long name 3a><row with a long name 3c>" ) ;
+        DataTemplate tmpl(text) ;
+        tmpl.compile() ;
+        tmpl.eval(data) ;
+        BOOST_CHECK_EQUAL( data["last"]->getvalue(), "row with a long name 3c" ) ;
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+// ------------------------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(TestCppTemplateCache)
+
+    BOOST_AUTO_TEST_CASE(test_hit_and_miss)
+    {
+        TemplateCache cache ;
+        data_map data ;
+        data["x"] = "foo" ;
+        template_ptr a = cache.get("<{$x}>") ;
+        template_ptr b = cache.get("<{$x}>") ;
+
+        BOOST_CHECK( a == b ) ;
+        BOOST_CHECK( a->is_compiled() ) ;
+        BOOST_CHECK_EQUAL( b->eval(data), "<foo>" ) ;
+        TemplateCache::Stats stats = cache.stats() ;
+        BOOST_CHECK_EQUAL( stats.hits, 1u ) ;
+        BOOST_CHECK_EQUAL( stats.misses, 1u ) ;
+        BOOST_CHECK_EQUAL( stats.evictions, 0u ) ;
+        BOOST_CHECK_EQUAL( stats.size, 1u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_lru_eviction)
+    {
+        TemplateCache cache(2) ;
+        template_ptr a = cache.get("a") ;
+        cache.get("b") ;
+        cache.get("a") ;    // b is now least recently used
+        cache.get("c") ;
+
+        BOOST_CHECK_EQUAL( cache.stats().evictions, 1u ) ;
+        BOOST_CHECK_EQUAL( cache.stats().size, 2u ) ;
+        BOOST_CHECK( cache.get("a") == a ) ;
+        BOOST_CHECK_EQUAL( cache.stats().misses, 3u ) ;
+        cache.get("b") ;
+        BOOST_CHECK_EQUAL( cache.stats().misses, 4u ) ;
+
+        cache.set_capacity(0) ;
+        BOOST_CHECK_EQUAL( cache.stats().size, 0u ) ;
+        BOOST_CHECK_EQUAL( cache.stats().evictions, 4u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_named)
+    {
+        TemplateCache cache ;
+        data_map data ;
+        BOOST_CHECK( !cache.find("greeting") ) ;
+        cache.add("greeting", "hello") ;
+        BOOST_CHECK_EQUAL( cache.find("greeting")->eval(data), "hello" ) ;
+        cache.add("greeting", "goodbye") ;
+        BOOST_CHECK_EQUAL( cache.find("greeting")->eval(data), "goodbye" ) ;
+
+        // Names and template text are separate keys.
+        BOOST_CHECK_EQUAL( cache.get("greeting")->eval(data), "greeting" ) ;
+        BOOST_CHECK_EQUAL( cache.stats().size, 2u ) ;
+        BOOST_CHECK_EQUAL( cache.stats().hits, 2u ) ;
+        BOOST_CHECK_EQUAL( cache.stats().misses, 2u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_parse_error_not_cached)
+    {
+        TemplateCache cache ;
+        BOOST_CHECK_THROW( cache.get("{% if %}") , TemplateException ) ;
+        BOOST_CHECK_EQUAL( cache.stats().size, 0u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_parse_uses_global_cache)
+    {
+        string text = "cached {$x} parse" ;
+        data_map data ;
+        data["x"] = 1 ;
+        TemplateCache::Stats before = TemplateCache::global().stats() ;
+        BOOST_CHECK_EQUAL( parse(text, data), "cached 1 parse" ) ;
+        BOOST_CHECK_EQUAL( parse(text, data), "cached 1 parse" ) ;
+        TemplateCache::Stats after = TemplateCache::global().stats() ;
+        BOOST_CHECK_EQUAL( after.misses - before.misses, 1u ) ;
+        BOOST_CHECK_EQUAL( after.hits - before.hits, 1u ) ;
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+// ------------------------------------------------------------------------------------------
+
+namespace
+{
+    const Profiler::Entry *find_entry(const std::vector<Profiler::Entry> &entries, const std::string &label)
+    {
+        for (auto &entry : entries)
+        {
+            if (entry.label == label)
+            {
+                return &entry;
+            }
+        }
+        return nullptr;
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(TestCppProfiler)
+
+    BOOST_AUTO_TEST_CASE(test_node_counts)
+    {
+        DataTemplate tmpl("{% for i in items %}\n"
+                          "<{$i}>\n"
+                          "{% endfor %}") ;
+        tmpl.compile() ;
+        data_map data ;
+        data_list items ;
+        items.push_back(make_data(1)) ;
+        items.push_back(make_data(2)) ;
+        items.push_back(make_data(3)) ;
+        data["items"] = items ;
+
+        Profiler profiler ;
+        BOOST_CHECK_EQUAL( tmpl.eval(data, profiler), "<1>\n<2>\n<3>\n" ) ;
+        std::vector<Profiler::Entry> entries = profiler.entries() ;
+
+        const Profiler::Entry *loop = find_entry(entries, "for:1") ;
+        const Profiler::Entry *var = find_entry(entries, "var:2") ;
+        BOOST_REQUIRE( loop && var ) ;
+        BOOST_CHECK_EQUAL( loop->calls, 1u ) ;
+        BOOST_CHECK_EQUAL( loop->bytes, 12u ) ;
+        BOOST_CHECK_EQUAL( var->calls, 3u ) ;
+        BOOST_CHECK_EQUAL( var->bytes, 3u ) ;
+        BOOST_CHECK( loop->inclusive_ns >= var->inclusive_ns ) ;
+        BOOST_CHECK( loop->inclusive_ns >= loop->exclusive_ns ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_subtemplate_calls)
+    {
+        DataTemplate tmpl("{% def fact(n) %}{% if n > 1 %}{$n}*{$fact(n - 1)}{% else %}1{% endif %}{% enddef %}\n"
+                          "{$fact(3)}") ;
+        data_map data ;
+        Profiler profiler ;
+        BOOST_CHECK_EQUAL( tmpl.eval(data, profiler), "\n3*2*1" ) ;
+        std::vector<Profiler::Entry> entries = profiler.entries() ;
+
+        const Profiler::Entry *top = find_entry(entries, "var:2") ;
+        const Profiler::Entry *call = find_entry(entries, "call:fact") ;
+        BOOST_REQUIRE( top && call ) ;
+        BOOST_CHECK_EQUAL( call->line, 2u ) ;
+        BOOST_CHECK_EQUAL( call->calls, 3u ) ;
+        BOOST_CHECK_EQUAL( call->bytes, 5u ) ;
+        BOOST_CHECK( call->inclusive_ns <= top->inclusive_ns ) ;
+
+        std::ostringstream folded ;
+        profiler.write_folded(folded) ;
+        BOOST_CHECK( folded.str().find("var:2;call:fact;if:1;var:1;call:fact ") != std::string::npos ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_accumulates_until_clear)
+    {
+        DataTemplate tmpl("a{$x}") ;
+        data_map data ;
+        data["x"] = "b" ;
+        Profiler profiler ;
+        tmpl.eval(data, profiler) ;
+        tmpl.eval(data, profiler) ;
+        std::vector<Profiler::Entry> entries = profiler.entries() ;
+        const Profiler::Entry *text = find_entry(entries, "text:1") ;
+        BOOST_REQUIRE( text ) ;
+        BOOST_CHECK_EQUAL( text->calls, 2u ) ;
+
+        std::ostringstream report ;
+        profiler.report(report) ;
+        BOOST_CHECK( report.str().find("var:1") != std::string::npos ) ;
+
+        profiler.clear() ;
+        BOOST_CHECK( profiler.entries().empty() ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_error_unwinds)
+    {
+        DataTemplate tmpl("{% for i in items %}{$count(i)}{% endfor %}") ;
+        data_map data ;
+        data_list items ;
+        items.push_back(make_data("x")) ;
+        data["items"] = items ;
+        Profiler profiler ;
+        BOOST_CHECK_THROW( tmpl.eval(data, profiler), TemplateException ) ;
+        BOOST_CHECK_EQUAL( find_entry(profiler.entries(), "for:1")->calls, 1u ) ;
+
+        data["items"] = data_list() ;
+        tmpl.eval(data, profiler) ;
+        BOOST_CHECK_EQUAL( find_entry(profiler.entries(), "for:1")->calls, 2u ) ;
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
+// ------------------------------------------------------------------------------------------
+
+BOOST_AUTO_TEST_SUITE(TestCppTemplateThreads)
+
+    // Renders one template on several threads at once, each with its own data_map, and
+    // checks every output against a single-threaded render. The template leans on newline
+    // elision, whose state used to be a global shared by all renders.
+    void check_concurrent_renders(DataTemplate &tmpl, const data_map &data)
+    {
+        const size_t thread_count = 8 ;
+        const size_t iterations = 200 ;
+
+        data_map serial_data = data ;
+        string expected = tmpl.eval(serial_data) ;
+
+        std::vector<size_t> mismatches(thread_count, 0) ;
+        std::vector<std::thread> threads ;
+        for (size_t t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                data_map thread_data = data ;
+                for (size_t i = 0; i < iterations; ++i)
+                {
+                    if (tmpl.eval(thread_data) != expected)
+                    {
+                        ++mismatches[t] ;
+                    }
+                }
+            }) ;
+        }
+        for (auto &thread : threads)
+        {
+            thread.join() ;
+        }
+        for (size_t t = 0; t < thread_count; ++t)
+        {
+            BOOST_CHECK_EQUAL( mismatches[t], 0u ) ;
+        }
+    }
+
+    BOOST_AUTO_TEST_CASE(test_concurrent_interning)
+    {
+        const size_t thread_count = 8 ;
+        const size_t key_count = 2000 ;
+        std::vector<std::vector<SymbolTable::symbol_t> > symbols(thread_count) ;
+        std::vector<std::thread> threads ;
+        for (size_t t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                // Each thread walks the keys from a different starting point.
+                symbols[t].resize(key_count) ;
+                for (size_t i = 0; i < key_count; ++i)
+                {
+                    size_t k = (i + t * 251) % key_count ;
+                    symbols[t][k] = SymbolTable::global().intern("concurrent_key_" + std::to_string(k)) ;
+                }
+            }) ;
+        }
+        for (auto &thread : threads)
+        {
+            thread.join() ;
+        }
+        for (size_t t = 1; t < thread_count; ++t)
+        {
+            BOOST_CHECK( symbols[t] == symbols[0] ) ;
+        }
+        BOOST_CHECK_EQUAL( SymbolTable::global().name(symbols[0][1234]), "concurrent_key_1234" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_concurrent_symbol_release)
+    {
+        // Threads add and drop overlapping keys, so symbols are removed and reused while
+        // other threads look them up.
+        std::vector<std::thread> threads ;
+        std::atomic<int> wrong(0) ;
+        for (int t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                for (int round = 0; round < 20; ++round)
+                {
+                    data_map map ;
+                    for (int i = 0; i < 300; ++i)
+                    {
+                        map["churn_" + std::to_string((i + t * 100 + round * 7) % 500)] = i ;
+                    }
+                    map.for_each([&](const std::string &key, data_ptr &) {
+                        if (key.compare(0, 6, "churn_") != 0)
+                        {
+                            ++wrong ;
+                        }
+                    }) ;
+                    data_ptr *value = map.find("churn_" + std::to_string((t * 100 + round * 7) % 500)) ;
+                    if (!value || value->getint() != 0)
+                    {
+                        ++wrong ;
+                    }
+                }
+            }) ;
+        }
+        for (auto &thread : threads)
+        {
+            thread.join() ;
+        }
+        BOOST_CHECK_EQUAL( wrong.load(), 0 ) ;
+    }
+
+    string get_elision_template()
+    {
+        return "{% def item(x) %}\n{$> x }\n{% enddef %}"
+               "{% for x in items %}\n"
+               "{$> x }\n"
+               "{% if x %}\n"
+               "[{$item(x) >}]\n"
+               "{% endif %}\n"
+               "{% endfor %}\n"
+               "done\n" ;
+    }
+
+    data_map get_elision_data()
+    {
+        data_list items ;
+        for (int i = 0; i < 50; ++i)
+        {
+            items.push_back(i % 2 ? make_data("") : make_data(i)) ;
+        }
+        data_map data ;
+        data["items"] = items ;
+        return data ;
+    }
+
+    BOOST_AUTO_TEST_CASE(test_concurrent_walk)
+    {
+        DataTemplate tmpl(get_elision_template()) ;
+        check_concurrent_renders(tmpl, get_elision_data()) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_concurrent_compiled)
+    {
+        DataTemplate tmpl(get_elision_template()) ;
+        tmpl.compile() ;
+        check_concurrent_renders(tmpl, get_elision_data()) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_concurrent_cache)
+    {
+        // More distinct texts than the cache holds, so threads race on hits, misses
+        // and evictions.
+        TemplateCache cache(4) ;
+        const size_t thread_count = 8 ;
+        std::vector<size_t> mismatches(thread_count, 0) ;
+        std::vector<std::thread> threads ;
+        for (size_t t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&, t]() {
+                data_map data ;
+                for (int i = 0; i < 300; ++i)
+                {
+                    int n = (i + (int)t) % 6 ;
+                    data["n"] = n ;
+                    string text = "{$n}:" + std::to_string(n) ;
+                    if (cache.get(text)->eval(data) != std::to_string(n) + ":" + std::to_string(n))
+                    {
+                        ++mismatches[t] ;
+                    }
+                }
+            }) ;
+        }
+        for (auto &thread : threads)
+        {
+            thread.join() ;
+        }
+        for (size_t t = 0; t < thread_count; ++t)
+        {
+            BOOST_CHECK_EQUAL( mismatches[t], 0u ) ;
+        }
+        TemplateCache::Stats stats = cache.stats() ;
+        BOOST_CHECK_EQUAL( stats.hits + stats.misses, thread_count * 300 ) ;
+        BOOST_CHECK_LE( stats.size, 4u ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_thread_pool)
+    {
+        for (size_t threads = 0; threads < 4; threads += 3)
+        {
+            ThreadPool pool(threads) ;
+            BOOST_CHECK_EQUAL( pool.size(), threads ) ;
+            std::vector<std::atomic<int> > calls(1000) ;
+            pool.parallel_for(calls.size(), [&](size_t i) {
+                // Nested calls are run too, with the calling thread taking part.
+                pool.parallel_for(3, [&](size_t) { ++calls[i] ; }) ;
+            }) ;
+            for (auto &count : calls)
+            {
+                BOOST_CHECK_EQUAL( count.load(), 3 ) ;
+            }
+
+            std::atomic<int> finished(0) ;
+            BOOST_CHECK_THROW( pool.parallel_for(100, [&](size_t i) {
+                if (i == 50)
+                {
+                    throw TemplateException("fails") ;
+                }
+                ++finished ;
+            }), TemplateException ) ;
+            BOOST_CHECK_EQUAL( finished.load(), 99 ) ;
+        }
+    }
+
+    // Renders a template with and without parallel loops, walked and compiled, and checks
+    // that the output and the loop variables left in the data are the same every time.
+    string check_parallel_loops(const string &text, const data_map &data, ThreadPool &pool)
+    {
+        data_map serial_data = data ;
+        string expected = DataTemplate(text).eval(serial_data) ;
+        for (int compiled = 0; compiled < 2; ++compiled)
+        {
+            DataTemplate tmpl(text) ;
+            if (compiled)
+            {
+                tmpl.compile() ;
+            }
+            tmpl.set_parallel_loops(&pool, 100) ;
+            data_map parallel_data = data ;
+            BOOST_CHECK_EQUAL( tmpl.eval(parallel_data), expected ) ;
+            BOOST_CHECK_EQUAL( parallel_data.lookup_path("loop.index")->getvalue(),
+                               serial_data.lookup_path("loop.index")->getvalue() ) ;
+            BOOST_CHECK_EQUAL( parallel_data.lookup_path("row.id")->getvalue(),
+                               serial_data.lookup_path("row.id")->getvalue() ) ;
+        }
+        return expected ;
+    }
+
+    data_map make_parallel_rows(int count)
+    {
+        data_list rows ;
+        for (int i = 0; i < count; ++i)
+        {
+            data_map row ;
+            row["id"] = i ;
+            row["odd"] = i % 2 == 1 ;
+            row["note"] = i % 7 == 0 ? "" : "n" ;
+            data_list tags ;
+            tags.push_back(make_data("a")) ;
+            tags.push_back(make_data("b")) ;
+            row["tags"] = tags ;
+            rows.push_back(make_data(row)) ;
+        }
+        data_map data ;
+        data["rows"] = rows ;
+        return data ;
+    }
+
+    BOOST_AUTO_TEST_CASE(test_parallel_loops)
+    {
+        ThreadPool pool(3) ;
+        data_map data = make_parallel_rows(5000) ;
+
+        string text = "{% for row in rows %}{$loop.index}/{$loop.count}:{$row.id}"
+                      "{% if row.odd %}o{% elif loop.last %}L{% else %}e{% endif %}"
+                      "{% for tag in row.tags %}{$tag}{$loop.index}{% endfor %}\n{% endfor %}" ;
+        string output = check_parallel_loops(text, data, pool) ;
+        BOOST_CHECK_EQUAL( output.substr(0, 22), "1/5000:0ea1b2\n2/5000:1" ) ;
+
+        // Filtered, with the loop variable read after the loop.
+        check_parallel_loops("{% for row in rows if row.odd %}{$loop.index}={$row.id},{% endfor %}{$row.id}", data, pool) ;
+
+        // Subtemplates called from the body may assign, so the loop runs serially.
+        check_parallel_loops("{% def show(x) %}{% set shown = x %}[{$shown}]{% enddef %}"
+                             "{% for row in rows %}{$show(row.id)}{% endfor %}{$shown}", data, pool) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_parallel_loop_stateful_subtemplate)
+    {
+        ThreadPool pool(3) ;
+        data_list rows ;
+        for (int i = 0; i < 1000; ++i)
+        {
+            rows.push_back(make_data(i)) ;
+        }
+        data_map data ;
+        data["rows"] = rows ;
+        data["prev"] = "start" ;
+
+        // Each call reads what the previous one set.
+        string text = "{% def s(x) %}{$prev}{% set prev = x %}{% enddef %}"
+                      "{% for r in rows %}{$s(r)},{% endfor %}|{$prev}" ;
+        data_map serial_data = data ;
+        string expected = DataTemplate(text).eval(serial_data) ;
+        BOOST_CHECK( expected.find(",64,65,66,") != string::npos ) ;
+        BOOST_CHECK( expected.find("|999") != string::npos ) ;
+        for (int compiled = 0; compiled < 2; ++compiled)
+        {
+            DataTemplate tmpl(text) ;
+            if (compiled)
+            {
+                tmpl.compile() ;
+            }
+            tmpl.set_parallel_loops(&pool, 100) ;
+            // The second render knows the loop calls a subtemplate.
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                data_map parallel_data = data ;
+                BOOST_CHECK_EQUAL( tmpl.eval(parallel_data), expected ) ;
+                BOOST_CHECK_EQUAL( parallel_data["prev"]->getvalue(), "999" ) ;
+            }
+        }
+    }
+    BOOST_AUTO_TEST_CASE(test_parallel_loop_newlines)
+    {
+        ThreadPool pool(3) ;
+        data_map data = make_parallel_rows(5000) ;
+
+        // An empty note drops the next newline, which is in the next iteration and may
+        // be in the next chunk.
+        string output = check_parallel_loops("{% for row in rows %}{$row.id}\n{$>row.note}{% endfor %}end", data, pool) ;
+        BOOST_CHECK_EQUAL( output.substr(0, 10), "0\n1n2\nn3\nn" ) ;
+        BOOST_CHECK( output.find("1561\n1562n1563\nn") != string::npos ) ;
+        BOOST_CHECK_EQUAL( output.substr(output.size() - 8), "4999nend" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_parallel_loop_serial_fallback)
+    {
+        ThreadPool pool(3) ;
+        data_map data = make_parallel_rows(5000) ;
+        data["total"] = 0 ;
+
+        // A set in the body is seen by later iterations, so the loop runs serially.
+        string output = check_parallel_loops("{% for row in rows %}{% if row.odd %}{% set total = total + 1 %}{% endif %}{% endfor %}{$total}", data, pool) ;
+        BOOST_CHECK_EQUAL( output, "2500" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_parallel_loop_errors)
+    {
+        ThreadPool pool(3) ;
+        data_map data = make_parallel_rows(5000) ;
+        data["rows"]->getlist()[3000]->getmap()["tags"] = "x" ;
+
+        // The output before the failing iteration is written, as in a serial render.
+        string text = "{% for row in rows %}{$row.id},{% for tag in row.tags %}{% endfor %}{% endfor %}" ;
+        DataTemplate serial(text) ;
+        data_map serial_data = data ;
+        string serial_output ;
+        BOOST_CHECK_THROW( serial.eval(serial_output, serial_data), TemplateException ) ;
+
+        DataTemplate parallel(text) ;
+        parallel.set_parallel_loops(&pool, 100) ;
+        data_map parallel_data = data ;
+        string parallel_output ;
+        BOOST_CHECK_THROW( parallel.eval(parallel_output, parallel_data), TemplateException ) ;
+        BOOST_CHECK_EQUAL( parallel_output, serial_output ) ;
+        BOOST_CHECK_EQUAL( parallel_output.substr(parallel_output.size() - 5), "3000," ) ;
+        BOOST_CHECK_EQUAL( parallel_data["row"]->getmap()["id"]->getvalue(), "3000" ) ;
+    }
+    BOOST_AUTO_TEST_CASE(test_eval_batch)
+    {
+        DataTemplate tmpl("{% for row in rows %}{% set last = row.id %}{$row.id},{% endfor %}{$last}") ;
+        std::vector<data_map> items ;
+        std::vector<string> expected ;
+        for (int i = 0; i < 500; ++i)
+        {
+            data_map data = make_parallel_rows(i % 20) ;
+            if (i % 50 == 7)
+            {
+                data["rows"] = "not a list" ;
+            }
+            items.push_back(data) ;
+            DataTemplate serial("{% for row in rows %}{% set last = row.id %}{$row.id},{% endfor %}{$last}") ;
+            expected.push_back(i % 50 == 7 ? "" : serial.eval(data)) ;
+        }
+
+        for (size_t threads = 0; threads < 4; threads += 3)
+        {
+            ThreadPool pool(threads) ;
+            std::vector<data_map> batch = items ;
+            std::vector<BatchResult> results = tmpl.eval_batch(batch, pool) ;
+            BOOST_CHECK( tmpl.is_compiled() ) ;
+            BOOST_REQUIRE_EQUAL( results.size(), items.size() ) ;
+            for (size_t i = 0; i < results.size(); ++i)
+            {
+                BOOST_CHECK_EQUAL( results[i].output, expected[i] ) ;
+                BOOST_CHECK_EQUAL( bool(results[i].error), i % 50 == 7 ) ;
+            }
+            BOOST_CHECK_THROW( std::rethrow_exception(results[7].error), TemplateException ) ;
+
+            // Streamed results arrive in order.
+            batch = items ;
+            size_t next = 0 ;
+            size_t errors = 0 ;
+            tmpl.eval_batch(batch, pool, [&](size_t index, const BatchResult &result) {
+                BOOST_CHECK_EQUAL( index, next++ ) ;
+                BOOST_CHECK_EQUAL( result.output, expected[index] ) ;
+                errors += result.error ? 1 : 0 ;
+            }) ;
+            BOOST_CHECK_EQUAL( next, items.size() ) ;
+            BOOST_CHECK_EQUAL( errors, 10u ) ;
+        }
+    }
+    BOOST_AUTO_TEST_CASE(test_eval_batch_shared_map)
+    {
+        data_map sub ;
+        sub["n"] = "sub" ;
+        data_map cfg ;
+        cfg["n"] = "cfg" ;
+        cfg["sub"] = sub ;
+        data_ptr shared = cfg ;
+
+        std::vector<data_map> items(5000) ;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            items[i]["id"] = static_cast<int>(i) ;
+            items[i]["cfg"] = shared ;
+        }
+
+        // Every render assigns into the one cfg map held by all the items.
+        DataTemplate tmpl("{$cfg.n}{% set cfg.n = id %}{% set cfg.sub.n = id %}"
+                          "{% def cfg.f %}f{% enddef %}/{$cfg.n}/{$cfg.sub.n}{$cfg.f}") ;
+        ThreadPool pool(3) ;
+        std::vector<BatchResult> results = tmpl.eval_batch(items, pool) ;
+        for (size_t i = 0; i < items.size(); ++i)
+        {
+            string id = boost::lexical_cast<string>(i) ;
+            BOOST_CHECK( !results[i].error ) ;
+            BOOST_CHECK_EQUAL( results[i].output, "cfg/" + id + "/" + id + "f" ) ;
+            BOOST_CHECK_EQUAL( items[i].lookup_path("cfg.sub.n")->getvalue(), id ) ;
+        }
+        BOOST_CHECK_EQUAL( shared->getmap().lookup_path("n")->getvalue(), "cfg" ) ;
+        BOOST_CHECK_EQUAL( shared->getmap().lookup_path("sub.n")->getvalue(), "sub" ) ;
+        BOOST_CHECK( !shared->getmap().has("f") ) ;
+
+        // A plain render still assigns to the shared map in place.
+        data_map data ;
+        data["id"] = 1 ;
+        data["cfg"] = shared ;
+        DataTemplate("{% set cfg.n = id %}").eval(data) ;
+        BOOST_CHECK_EQUAL( shared->getmap().lookup_path("n")->getvalue(), "1" ) ;
+    }
+
+BOOST_AUTO_TEST_SUITE_END()
+
 // According to the docs this main() should be provided by the boost unit test lib,
 // but it wasn't linking until I added it.
 int main(int argc, char* argv[] )